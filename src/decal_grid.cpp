@@ -0,0 +1,220 @@
+#include "decal_grid.hpp"
+#include "decals.hpp"
+#include <algorithm>
+
+// key layout: | level: 7 bits | x: 19 bits | y: 19 bits | z: 19 bits |, the coordinates are offset so they are positive
+constexpr int KEY_COORD_BITS = 19;
+constexpr i32 KEY_COORD_OFFSET = 1 << (KEY_COORD_BITS - 1);
+constexpr u64 KEY_COORD_MASK = (u64(1) << KEY_COORD_BITS) - 1;
+
+static u64 packKey(u32 level, glm::ivec3 c)
+{
+    const glm::u64vec3 u = glm::u64vec3(glm::clamp(c + KEY_COORD_OFFSET, 0, i32(KEY_COORD_MASK)));
+    return (u64(level) << (3 * KEY_COORD_BITS)) | (u.x << (2 * KEY_COORD_BITS)) | (u.y << KEY_COORD_BITS) | u.z;
+}
+
+static void unpackKey(u64 key, u32& level, glm::ivec3& c)
+{
+    level = key >> (3 * KEY_COORD_BITS);
+    c.x = i32((key >> (2 * KEY_COORD_BITS)) & KEY_COORD_MASK) - KEY_COORD_OFFSET;
+    c.y = i32((key >> KEY_COORD_BITS) & KEY_COORD_MASK) - KEY_COORD_OFFSET;
+    c.z = i32(key & KEY_COORD_MASK) - KEY_COORD_OFFSET;
+}
+
+u32 DecalGrid::levelForRadius(float radius) const
+{
+    const float cells = 2 * radius / baseCellSize;
+    if (cells <= 1)
+        return 0;
+    return glm::min(u32(ceilf(log2f(cells))), MAX_LEVELS - 1);
+}
+
+u64 DecalGrid::cellKey(u32 level, vec3 pos) const
+{
+    return packKey(level, glm::ivec3(glm::floor(pos / cellSize(level))));
+}
+
+void DecalGrid::cellBounds(u64 key, vec3& min, vec3& max) const
+{
+    u32 level;
+    glm::ivec3 c;
+    unpackKey(key, level, c);
+    const float cs = cellSize(level);
+    min = vec3(c) * cs - 0.5f * cs;
+    max = vec3(c + 1) * cs + 0.5f * cs;
+}
+
+u64 DecalGrid::blockKey(u64 cellKey) const
+{
+    u32 level;
+    glm::ivec3 c;
+    unpackKey(cellKey, level, c);
+    return packKey(level, glm::ivec3(glm::floor(vec3(c) / float(BLOCK_SIZE))));
+}
+
+void DecalGrid::blockBounds(u64 key, vec3& min, vec3& max) const
+{
+    u32 level;
+    glm::ivec3 b;
+    unpackKey(key, level, b);
+    const float cs = cellSize(level);
+    min = vec3(b * BLOCK_SIZE) * cs - 0.5f * cs;
+    max = vec3((b + 1) * BLOCK_SIZE) * cs + 0.5f * cs;
+}
+
+void DecalGrid::clear()
+{
+    cells.clear();
+    blocks.clear();
+    slotKeys.clear();
+    slotEntryInds.clear();
+    for (u32& count : levelCounts)
+        count = 0;
+}
+
+void DecalGrid::update(u32 slot, vec3 pos, float radius)
+{
+    if (slot >= slotKeys.size()) {
+        slotKeys.resize(slot + 1, INVALID_KEY);
+        slotEntryInds.resize(slot + 1);
+    }
+
+    const u32 level = levelForRadius(radius);
+    const u64 key = cellKey(level, pos);
+    if (key == slotKeys[slot]) {
+        cells[key][slotEntryInds[slot]] = { pos, radius, slot };
+        return;
+    }
+
+    remove(slot);
+    auto& cell = cells[key];
+    if (cell.empty())
+        blocks[blockKey(key)].push_back(key);
+    slotKeys[slot] = key;
+    slotEntryInds[slot] = cell.size();
+    cell.push_back({ pos, radius, slot });
+    levelCounts[level]++;
+}
+
+void DecalGrid::remove(u32 slot)
+{
+    if (slot >= slotKeys.size() || slotKeys[slot] == INVALID_KEY)
+        return;
+    const u64 key = slotKeys[slot];
+    auto it = cells.find(key);
+    assert(it != cells.end());
+    auto& cell = it->second;
+    const u32 ind = slotEntryInds[slot];
+    cell[ind] = cell.back();
+    slotEntryInds[cell[ind].slot] = ind;
+    cell.pop_back();
+    if (cell.empty()) {
+        cells.erase(it);
+        auto blockIt = blocks.find(blockKey(key));
+        auto& blockCells = blockIt->second;
+        blockCells.erase(std::find(blockCells.begin(), blockCells.end(), key));
+        if (blockCells.empty())
+            blocks.erase(blockIt);
+    }
+    slotKeys[slot] = INVALID_KEY;
+    levelCounts[key >> (3 * KEY_COORD_BITS)]--;
+}
+
+void DecalGrid::queryRadius(vec3 center, float radius, std::vector<u32>& slots) const
+{
+    auto testBlock = [&](const std::vector<u64>& blockCells) {
+        for (u64 key : blockCells) {
+            vec3 min, max;
+            cellBounds(key, min, max);
+            if (distance2(center, glm::clamp(center, min, max)) > radius * radius)
+                continue;
+            for (const DecalGridEntry& e : cells.find(key)->second) {
+                const float r = radius + e.radius;
+                if (distance2(center, e.pos) <= r * r)
+                    slots.push_back(e.slot);
+            }
+        }
+    };
+    for (u32 level = 0; level < MAX_LEVELS; level++) {
+        if (levelCounts[level] == 0)
+            continue;
+        const float bs = BLOCK_SIZE * cellSize(level);
+        // the decals of this level have their center at most half a cell outside of their cell
+        const glm::ivec3 b0 = glm::floor((center - radius - 0.5f * cellSize(level)) / bs);
+        const glm::ivec3 b1 = glm::floor((center + radius + 0.5f * cellSize(level)) / bs);
+        const glm::ivec3 n = b1 - b0 + 1;
+        if (size_t(n.x) * n.y * n.z > blocks.size()) {
+            // huge query: cheaper to go through the blocks that exist
+            for (const auto& [key, blockCells] : blocks) {
+                if ((key >> (3 * KEY_COORD_BITS)) == level)
+                    testBlock(blockCells);
+            }
+            continue;
+        }
+        for (int z = b0.z; z <= b1.z; z++)
+        for (int y = b0.y; y <= b1.y; y++)
+        for (int x = b0.x; x <= b1.x; x++) {
+            auto it = blocks.find(packKey(level, { x, y, z }));
+            if (it != blocks.end())
+                testBlock(it->second);
+        }
+    }
+}
+
+void DecalGrid::queryFrustum(const Frustum& frustum, std::vector<u32>& slots) const
+{
+    for (const auto& [blockKey, blockCells] : blocks) {
+        vec3 min, max;
+        blockBounds(blockKey, min, max);
+        const EFrustumTest blockTest = testAabbFrustum(frustum, min, max);
+        if (blockTest == FRUSTUM_OUTSIDE)
+            continue;
+        for (u64 key : blockCells) {
+            const auto& cell = cells.find(key)->second;
+            EFrustumTest test = blockTest;
+            if (test == FRUSTUM_INTERSECTS) {
+                cellBounds(key, min, max);
+                test = testAabbFrustum(frustum, min, max);
+            }
+            if (test == FRUSTUM_INSIDE) {
+                for (const DecalGridEntry& e : cell)
+                    slots.push_back(e.slot);
+            }
+            else if (test == FRUSTUM_INTERSECTS) {
+                for (const DecalGridEntry& e : cell) {
+                    if (sphereInFrustum(frustum, e.pos, e.radius))
+                        slots.push_back(e.slot);
+                }
+            }
+        }
+    }
+}
+
+u32 DecalGrid::raycast(vec3 origin, vec3 dir, float maxDist, float* outDist) const
+{
+    const vec3 invDir = 1.f / dir;
+    u32 bestSlot = INVALID_DECAL_INDEX;
+    float bestDist = maxDist;
+    for (const auto& [blockKey, blockCells] : blocks) {
+        vec3 min, max;
+        blockBounds(blockKey, min, max);
+        float tmin;
+        if (!rayAabbIntersection(origin, invDir, min, max, bestDist, tmin))
+            continue;
+        for (u64 key : blockCells) {
+            cellBounds(key, min, max);
+            if (!rayAabbIntersection(origin, invDir, min, max, bestDist, tmin))
+                continue;
+            for (const DecalGridEntry& e : cells.find(key)->second) {
+                const float t = raySphereIntersection(origin, dir, e.pos, e.radius);
+                if (t >= 0 && t < bestDist) {
+                    bestDist = t;
+                    bestSlot = e.slot;
+                }
+            }
+        }
+    }
+    if (outDist)
+        *outDist = bestDist;
+    return bestSlot;
+}
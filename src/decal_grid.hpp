@@ -0,0 +1,48 @@
+#pragma once
+
+#include "utils.hpp"
+#include <vector>
+#include <unordered_map>
+
+struct DecalGridEntry {
+    vec3 pos;
+    float radius;
+    u32 slot;
+};
+
+// Hierarchical loose hashed grid over the decal spheres, for radius, frustum and ray queries
+// The level of a decal is the smallest one whose cells are at least as big as its diameter, and the decal is stored
+// in the cell that contains its center. So at each level the cells only need to be enlarged by half a cell to bound their contents
+// The non-empty cells are also grouped in blocks of BLOCK_SIZE^3 cells, so the frustum and ray queries can reject whole blocks
+// Decals are identified by their pool slot, which is stable, so the pool's swap-removes don't touch the grid
+struct DecalGrid {
+    static constexpr u32 MAX_LEVELS = 16;
+    static constexpr u64 INVALID_KEY = u64(-1);
+    static constexpr i32 BLOCK_SIZE = 16;
+
+    float baseCellSize = 0.25f; // size of the cells of level 0
+    std::unordered_map<u64, std::vector<DecalGridEntry>> cells;
+    std::unordered_map<u64, std::vector<u64>> blocks; // keys of the non-empty cells of each block
+    // per slot: the cell the decal is in and its index inside of the cell
+    std::vector<u64> slotKeys;
+    std::vector<u32> slotEntryInds;
+    u32 levelCounts[MAX_LEVELS] = {}; // number of decals per level, to skip the empty ones
+
+    void clear();
+    // inserts the decal or moves it to the right cell. Cheap if the cell doesn't change
+    void update(u32 slot, vec3 pos, float radius);
+    void remove(u32 slot);
+
+    // the queries append the slots of the decals whose sphere touches the query volume
+    void queryRadius(vec3 center, float radius, std::vector<u32>& slots) const;
+    void queryFrustum(const Frustum& frustum, std::vector<u32>& slots) const;
+    // returns the slot of the closest decal hit by the ray (INVALID_DECAL_INDEX if none). dir must be normalized
+    u32 raycast(vec3 origin, vec3 dir, float maxDist, float* outDist = nullptr) const;
+
+    float cellSize(u32 level) const { return baseCellSize * float(1 << level); }
+    u32 levelForRadius(float radius) const;
+    u64 cellKey(u32 level, vec3 pos) const;
+    void cellBounds(u64 key, vec3& min, vec3& max) const; // loose bounds: the cell enlarged by half a cell
+    u64 blockKey(u64 cellKey) const;
+    void blockBounds(u64 key, vec3& min, vec3& max) const; // loose bounds of all the cells of the block
+};
@@ -0,0 +1,345 @@
+#include "decals.hpp"
+#include <algorithm>
+
+vec3 fitDecalShapeExtents(EDecalShape shape, vec3 proportions)
+{
+    switch (shape) {
+    case DECAL_SHAPE_ELLIPSOID:
+        return proportions / glm::max(proportions.x, glm::max(proportions.y, proportions.z));
+    case DECAL_SHAPE_CAPSULE:
+        return vec3(proportions.x, proportions.y, proportions.y) / (proportions.x + proportions.y);
+    case DECAL_SHAPE_BOX:
+        return proportions / length(proportions);
+    default:
+        return vec3(1);
+    }
+}
+
+void Decals::reserve(size_t n)
+{
+    positions.reserve(n);
+    rotations.reserve(n);
+    radiuses.reserve(n);
+    spawnTimes.reserve(n);
+    lifetimes.reserve(n);
+    intensities.reserve(n);
+    materials.reserve(n);
+    shapes.reserve(n);
+    extents.reserve(n);
+    slots.reserve(n);
+    slotToDense.reserve(n);
+    generations.reserve(n);
+}
+
+void Decals::clear()
+{
+    // all the slots go back to the free list so the handles that are out there become stale
+    for (u32 slot : slots) {
+        slotToDense[slot] = INVALID_DECAL_INDEX;
+        generations[slot]++;
+        freeSlots.push_back(slot);
+    }
+    positions.clear();
+    rotations.clear();
+    radiuses.clear();
+    spawnTimes.clear();
+    lifetimes.clear();
+    intensities.clear();
+    materials.clear();
+    shapes.clear();
+    extents.clear();
+    slots.clear();
+    dirtyInds.clear();
+    spawnOrder.clear();
+    spawnOrderHead = 0;
+    expiries.clear();
+    grid.clear();
+    numChanges++;
+}
+
+static bool expiryCmp(const DecalExpiry& a, const DecalExpiry& b)
+{
+    return a.time > b.time; // the heap functions build a max-heap, so we flip the comparison
+}
+
+DecalHandle Decals::spawn(const DecalSpawn& spawn)
+{
+    if (coalescing.enabled) {
+        if (const u32 ind = findCoalesceTarget(spawn); ind != INVALID_DECAL_INDEX) {
+            coalesce(ind, spawn);
+            return handleAt(ind);
+        }
+    }
+
+    if (budget && size() >= budget)
+        evictOldest();
+
+    u32 slot;
+    if (freeSlots.size()) {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else {
+        slot = slotToDense.size();
+        slotToDense.push_back(INVALID_DECAL_INDEX);
+        generations.push_back(0);
+    }
+
+    const u32 ind = positions.size();
+    positions.push_back(spawn.pos);
+    rotations.push_back(spawn.rot);
+    radiuses.push_back(spawn.radius);
+    spawnTimes.push_back(time);
+    lifetimes.push_back(spawn.lifetime);
+    intensities.push_back(spawn.intensity);
+    materials.push_back(spawn.material);
+    shapes.push_back(spawn.shape);
+    extents.push_back(spawn.extents);
+    slots.push_back(slot);
+    slotToDense[slot] = ind;
+    markDirty(ind);
+
+    const DecalHandle h = { slot, generations[slot] };
+    spawnOrder.push_back(h);
+    if (spawn.lifetime > 0) {
+        expiries.push_back({ time + spawn.lifetime, h });
+        std::push_heap(expiries.begin(), expiries.end(), expiryCmp);
+    }
+    return h;
+}
+
+void Decals::spawn(std::span<const DecalSpawn> spawns, DecalHandle* outHandles)
+{
+    reserve(size() + spawns.size());
+    for (size_t i = 0; i < spawns.size(); i++) {
+        const DecalHandle h = spawn(spawns[i]);
+        if (outHandles)
+            outHandles[i] = h;
+    }
+}
+
+bool Decals::remove(DecalHandle h)
+{
+    const u32 ind = indexOf(h);
+    if (ind == INVALID_DECAL_INDEX)
+        return false;
+    removeAt(ind);
+    return true;
+}
+
+void Decals::remove(std::span<const DecalHandle> handles)
+{
+    for (const DecalHandle& h : handles)
+        remove(h);
+}
+
+void Decals::removeAt(u32 ind)
+{
+    assert(ind < size());
+    numChanges++;
+    const u32 slot = slots[ind];
+    const u32 last = size() - 1;
+    if (ind != last) {
+        // swap-remove: the last decal fills the hole
+        positions[ind] = positions[last];
+        rotations[ind] = rotations[last];
+        radiuses[ind] = radiuses[last];
+        spawnTimes[ind] = spawnTimes[last];
+        lifetimes[ind] = lifetimes[last];
+        intensities[ind] = intensities[last];
+        materials[ind] = materials[last];
+        shapes[ind] = shapes[last];
+        extents[ind] = extents[last];
+        slots[ind] = slots[last];
+        slotToDense[slots[ind]] = ind;
+        // the decal moved in the pool but not in the world, so the grid (which works with slots) doesn't need to know
+        if (!allDirty)
+            dirtyInds.push_back(ind);
+    }
+    positions.pop_back();
+    rotations.pop_back();
+    radiuses.pop_back();
+    spawnTimes.pop_back();
+    lifetimes.pop_back();
+    intensities.pop_back();
+    materials.pop_back();
+    shapes.pop_back();
+    extents.pop_back();
+    slots.pop_back();
+
+    slotToDense[slot] = INVALID_DECAL_INDEX;
+    generations[slot]++;
+    freeSlots.push_back(slot);
+    grid.remove(slot);
+}
+
+void Decals::execute(const DecalCommand& cmd)
+{
+    switch (cmd.type) {
+    case DECAL_COMMAND_SPAWN:
+        spawn(cmd.spawn);
+        break;
+    case DECAL_COMMAND_REMOVE:
+        remove(cmd.handle); // the handle might be stale by now, that's fine
+        break;
+    }
+}
+
+bool Decals::evictOldest()
+{
+    while (spawnOrderHead < spawnOrder.size()) {
+        const DecalHandle h = spawnOrder[spawnOrderHead++];
+        if (remove(h)) {
+            numEvicted++;
+            return true;
+        }
+    }
+    return false;
+}
+
+u32 Decals::findCoalesceTarget(const DecalSpawn& spawn)
+{
+    // the enclosing sphere of two shapes is not a shape that makes sense, so those are never merged
+    if (spawn.shape != DECAL_SHAPE_SPHERE)
+        return INVALID_DECAL_INDEX;
+    // only the decals whose center is close enough can be merged, so that's all we need to query
+    queryScratch.clear();
+    grid.queryRadius(spawn.pos, coalescing.maxDistance * spawn.radius, queryScratch);
+    u32 bestInd = INVALID_DECAL_INDEX;
+    float bestScore = FLT_MAX;
+    for (u32 slot : queryScratch) {
+        const u32 ind = slotToDense[slot];
+        if (materials[ind] != spawn.material || shapes[ind] != DECAL_SHAPE_SPHERE)
+            continue;
+        const float minRad = glm::min(spawn.radius, radiuses[ind]);
+        const float maxRad = glm::max(spawn.radius, radiuses[ind]);
+        if (maxRad > coalescing.maxRadiusRatio * minRad)
+            continue;
+        const float score = distance(spawn.pos, positions[ind]) / minRad;
+        if (score <= coalescing.maxDistance && score < bestScore) {
+            bestScore = score;
+            bestInd = ind;
+        }
+    }
+    return bestInd;
+}
+
+void Decals::coalesce(u32 ind, const DecalSpawn& spawn)
+{
+    // smallest sphere that encloses both
+    const vec3 toSpawn = spawn.pos - positions[ind];
+    const float d = length(toSpawn);
+    if (d + spawn.radius > radiuses[ind]) {
+        if (d + radiuses[ind] <= spawn.radius) {
+            positions[ind] = spawn.pos;
+            radiuses[ind] = spawn.radius;
+        }
+        else {
+            const float r = 0.5f * (d + radiuses[ind] + spawn.radius);
+            positions[ind] += (r - radiuses[ind]) / d * toSpawn;
+            radiuses[ind] = r;
+        }
+    }
+    intensities[ind] = glm::min(intensities[ind] + spawn.intensity, glm::max(coalescing.maxIntensity, intensities[ind]));
+
+    // the merged decal lives as long as the longest of the two. The spawn time is kept, so it doesn't grow again
+    // its entry in the expiry heap will be pushed again with the new time when it comes up, see update()
+    if (lifetimes[ind] > 0) {
+        if (spawn.lifetime > 0)
+            lifetimes[ind] = glm::max(lifetimes[ind], time + spawn.lifetime - spawnTimes[ind]);
+        else
+            lifetimes[ind] = 0;
+    }
+    markDirty(ind);
+    numCoalesced++;
+}
+
+void Decals::update(float time)
+{
+    this->time = time;
+    while (expiries.size() && expiries[0].time <= time) {
+        const DecalExpiry expiry = expiries[0];
+        std::pop_heap(expiries.begin(), expiries.end(), expiryCmp);
+        expiries.pop_back();
+        const u32 ind = indexOf(expiry.handle);
+        if (ind == INVALID_DECAL_INDEX || lifetimes[ind] == 0)
+            continue; // already removed, or coalesced with an immortal decal
+        const float expiryTime = spawnTimes[ind] + lifetimes[ind];
+        if (expiryTime <= time) {
+            removeAt(ind);
+            numExpired++;
+        }
+        else {
+            // the lifetime was extended by coalescing
+            expiries.push_back({ expiryTime, expiry.handle });
+            std::push_heap(expiries.begin(), expiries.end(), expiryCmp);
+        }
+    }
+
+    while (budget && size() > budget)
+        evictOldest();
+
+    // drop the consumed (or stale) part of the FIFO once it dominates, so it doesn't grow forever
+    if (spawnOrderHead > 1024 && spawnOrderHead > spawnOrder.size() / 2) {
+        spawnOrder.erase(spawnOrder.begin(), spawnOrder.begin() + spawnOrderHead);
+        spawnOrderHead = 0;
+    }
+    if (spawnOrder.size() - spawnOrderHead > 2 * size() + 1024) {
+        size_t n = 0;
+        for (size_t i = spawnOrderHead; i < spawnOrder.size(); i++) {
+            if (isAlive(spawnOrder[i]))
+                spawnOrder[n++] = spawnOrder[i];
+        }
+        spawnOrder.resize(n);
+        spawnOrderHead = 0;
+    }
+}
+
+bool Decals::isAlive(DecalHandle h) const
+{
+    return h.slot < generations.size() && generations[h.slot] == h.generation;
+}
+
+u32 Decals::indexOf(DecalHandle h) const
+{
+    if (!isAlive(h))
+        return INVALID_DECAL_INDEX;
+    return slotToDense[h.slot];
+}
+
+void Decals::markDirty(u32 ind)
+{
+    numChanges++;
+    if (!allDirty)
+        dirtyInds.push_back(ind);
+    grid.update(slots[ind], positions[ind], radiuses[ind]);
+}
+
+void Decals::markAllDirty()
+{
+    numChanges++;
+    dirtyInds.clear();
+    allDirty = true;
+}
+
+void Decals::popDirtyRanges(std::vector<DecalRange>& ranges, u32 maxGap)
+{
+    ranges.clear();
+    if (allDirty) {
+        if (size())
+            ranges.push_back({ 0, u32(size()) });
+    }
+    else {
+        std::sort(dirtyInds.begin(), dirtyInds.end());
+        for (u32 ind : dirtyInds) {
+            if (ind >= size())
+                break; // the decal was removed after being marked
+            if (ranges.size() && ind <= ranges.back().end + maxGap)
+                ranges.back().end = glm::max(ranges.back().end, ind + 1);
+            else
+                ranges.push_back({ ind, ind + 1 });
+        }
+    }
+    dirtyInds.clear();
+    allDirty = false;
+}
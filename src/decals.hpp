@@ -0,0 +1,143 @@
+#pragma once
+
+#include "utils.hpp"
+#include "decal_grid.hpp"
+#include <vector>
+#include <glm/gtc/quaternion.hpp>
+
+// Stable reference to a decal. It stays valid while the decal is alive, even if the decal moves inside the pool
+// The generation is bumped every time a slot is freed, so stale handles can be detected
+struct DecalHandle {
+    u32 slot;
+    u32 generation;
+    bool operator==(const DecalHandle&) const = default;
+};
+constexpr DecalHandle INVALID_DECAL_HANDLE = { u32(-1), u32(-1) };
+constexpr u32 INVALID_DECAL_INDEX = u32(-1);
+
+struct DecalRange {
+    u32 begin, end;
+};
+
+// Shape of the decal volume. It always fits inside of the decal's sphere, which is still what the grid, the culling and the proxy meshes use
+// The extents are relative to the radius, in the frame of the decal's rotation (which also orients the noise)
+enum EDecalShape : u8 {
+    DECAL_SHAPE_SPHERE, // the extents are ignored
+    DECAL_SHAPE_ELLIPSOID, // semi-axes
+    DECAL_SHAPE_CAPSULE, // x: half length of the segment, which lies along the x axis. y: radius
+    DECAL_SHAPE_BOX, // half sizes
+    DECAL_SHAPE_COUNT
+};
+
+// scales the proportions of the shape (semi-axes, or half length and radius for the capsules) so it just fits in the unit sphere
+vec3 fitDecalShapeExtents(EDecalShape shape, vec3 proportions);
+
+struct DecalSpawn {
+    vec3 pos;
+    glm::quat rot;
+    float radius;
+    float lifetime = 0; // in seconds, 0 means the decal lives until it's removed or evicted
+    float intensity = 1; // the decal is drawn as if it was stacked this many times
+    u16 material = 0; // index into the material palette (see DecalMaterial in main.cpp)
+    EDecalShape shape = DECAL_SHAPE_SPHERE;
+    vec3 extents = vec3(1); // see EDecalShape
+};
+
+// Spawns that land on top of an existing decal can be merged into it instead of adding another one
+// Stacked decals quickly saturate to black, so the extra fragment work (and noise evaluations) is mostly wasted
+// The merged decal becomes the smallest sphere that encloses both, and the intensities add up. Only spheres are merged
+struct DecalCoalescing {
+    bool enabled = false;
+    float maxDistance = 0.35f; // max distance between the centers, relative to the smaller radius
+    float maxRadiusRatio = 2; // the bigger radius can be at most this many times the smaller one
+    float maxIntensity = 8; // further merges still happen, but they don't make the decal any darker
+};
+
+// Commands that other threads can send to the pool through a queue, see drainDecalCommands() in main.cpp
+enum EDecalCommand : u8 {
+    DECAL_COMMAND_SPAWN,
+    DECAL_COMMAND_REMOVE,
+};
+struct DecalCommand {
+    EDecalCommand type;
+    DecalSpawn spawn; // DECAL_COMMAND_SPAWN
+    DecalHandle handle; // DECAL_COMMAND_REMOVE
+    double pushTime; // when the command was pushed, to measure the latency until it's executed
+};
+
+struct DecalExpiry {
+    float time;
+    DecalHandle handle;
+};
+
+// Structure-of-arrays pool of decals
+// Alive decals are densely packed in [0, size()) so they can be iterated linearly when building the instancing data
+// Removing a decal moves the last one into the hole (O(1)), so dense indices are not stable: use handles to refer to decals across frames
+// Aging (fade, growth) is computed on the GPU from the spawn time, the pool only removes the decals once they have expired
+struct Decals {
+    // dense arrays, indexed by [0, size())
+    std::vector<vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<float> radiuses;
+    std::vector<float> spawnTimes;
+    std::vector<float> lifetimes;
+    std::vector<float> intensities;
+    std::vector<u16> materials;
+    std::vector<EDecalShape> shapes;
+    std::vector<vec3> extents;
+    std::vector<u32> slots; // dense index -> slot
+
+    // slot arrays, indexed by DecalHandle::slot
+    std::vector<u32> slotToDense;
+    std::vector<u32> generations;
+    std::vector<u32> freeSlots;
+
+    // dense indices whose data changed since the last popDirtyRanges()
+    // spawn and remove mark them automatically, call markDirty() after modifying a decal in place
+    std::vector<u32> dirtyInds;
+    bool allDirty = false;
+    u32 numChanges = 0; // bumped by every change, including the ones that don't leave dirty indices (clear, removing the last decal)
+
+    DecalGrid grid; // spatial index, kept up to date by markDirty()
+
+    float time = 0; // current time, new decals take it as their spawn time. Advanced with update()
+    u32 budget = 0; // max number of alive decals, the oldest ones get evicted to make room. 0 means unlimited
+    u32 numEvicted = 0;
+    u32 numExpired = 0;
+    // handles in spawn order, for FIFO eviction. Can contain stale handles of decals that were removed by other means
+    std::vector<DecalHandle> spawnOrder;
+    size_t spawnOrderHead = 0;
+    std::vector<DecalExpiry> expiries; // min-heap of the decals that have a finite lifetime. Entries can be outdated because of coalescing
+
+    DecalCoalescing coalescing;
+    u32 numCoalesced = 0; // spawns that were merged into an existing decal
+    std::vector<u32> queryScratch;
+
+    size_t size() const { return positions.size(); }
+    void reserve(size_t n);
+    void clear();
+
+    // returns the handle of the decal the spawn was merged into, if it was coalesced
+    DecalHandle spawn(const DecalSpawn& spawn);
+    void spawn(std::span<const DecalSpawn> spawns, DecalHandle* outHandles = nullptr);
+    bool remove(DecalHandle h);
+    void remove(std::span<const DecalHandle> handles);
+    void removeAt(u32 ind);
+    void execute(const DecalCommand& cmd);
+    bool evictOldest();
+    // returns the dense index of the decal that the spawn should be merged into, or INVALID_DECAL_INDEX
+    u32 findCoalesceTarget(const DecalSpawn& spawn);
+    void coalesce(u32 ind, const DecalSpawn& spawn);
+    // advances the time and removes the decals that expired
+    void update(float time);
+
+    bool isAlive(DecalHandle h) const;
+    u32 indexOf(DecalHandle h) const; // returns INVALID_DECAL_INDEX if the decal is not alive
+    DecalHandle handleAt(u32 ind) const { return { slots[ind], generations[slots[ind]] }; }
+
+    void markDirty(u32 ind);
+    void markAllDirty();
+    // coalesces the dirty indices into sorted, non-overlapping ranges and clears them
+    // ranges separated by at most maxGap clean decals are merged, because a few extra bytes are cheaper than another upload call
+    void popDirtyRanges(std::vector<DecalRange>& ranges, u32 maxGap = 16);
+};
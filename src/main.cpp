@@ -1,11 +1,22 @@
 #include "utils.hpp"
+#include "decals.hpp"
+#include "scorch_atlas.hpp"
+#include "mpsc_queue.hpp"
 #include <GLFW/glfw3.h>
 #include <cgltf.h>
 #include <vector>
 #include <span>
+#include <string>
+#include <functional>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
 #include <stb_image.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/euler_angles.hpp>
+#include <glm/gtc/packing.hpp>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
@@ -21,9 +32,18 @@ struct Vert {
     vec3 pos, normal;
     vec2 tc;
 };
+// 48 bytes per decal
 struct InstancingData {
-    mat4 modelMtx;
+    vec3 pos;
+    float radius;
+    i16 rot[3]; // xyz of a unit quaternion, snorm16. It's flipped so w is positive, and w is reconstructed in the shader
+    u16 material; // index into the material palette
+    float spawnTime;
+    u16 params[2]; // half floats. x: lifetime in seconds (0 means infinite), y: intensity
+    vec3 extents; // relative to the radius, see EDecalShape
+    u32 shape; // EDecalShape
 };
+static_assert(sizeof(InstancingData) == 48);
 
 namespace shader_srcs
 {
@@ -33,10 +53,14 @@ R"GLSL(
 layout(location = 0)in vec3 a_pos;
 layout(location = 1)in vec3 a_normal;
 layout(location = 3)in vec2 a_tc;
+layout(location = 4)in vec2 a_lmTexel; // second UV set (TEXCOORD_1): texel in the virtual scorch texture, see scorch_atlas.hpp
 
 out vec3 v_pos;
 out vec3 v_normal;
 out vec2 v_tc;
+#if SCORCH_ATLAS
+out vec2 v_lmTexel;
+#endif
 
 uniform mat4 u_modelMtx;
 uniform mat4 u_modelView;
@@ -48,12 +72,40 @@ void main()
     v_pos = (u_modelMtx * vec4(a_pos, 1)).xyz;
     v_normal = mat3(u_modelMtx) * a_normal;
 	v_tc = a_tc;
+#if SCORCH_ATLAS
+    v_lmTexel = a_lmTexel;
+#endif
+}
+)GLSL";
+
+// The light of the room: an ambient term and a point light
+// The forward path lights the surfaces in scene_frag, the deferred one in deferred_light_frag
+ConstStr lighting_common =
+R"GLSL(
+const vec3 LIGHT_POS = vec3(0, 2, 0.2);
+const vec3 LIGHT_INTENSITY = 2.0*vec3(0.8, 0.8, 0.9);
+
+vec3 diffuseLighting(vec3 pos, vec3 normal, vec3 albedo)
+{
+    vec3 pl = LIGHT_POS - pos;
+    float dist2 = dot(pl, pl);
+    vec3 lightIntensity = LIGHT_INTENSITY * (1.0 / dist2);
+    vec3 l = normalize(pl);
+    return albedo * (0.3 +  lightIntensity * dot(l, normal));
 }
 )GLSL";
 
 ConstStr scene_frag =
 R"GLSL(
+// DEFERRED is defined by the shader variant: the material goes to the G-buffer, to be lit after the decals modify it (deferred_light_frag)
+#if DEFERRED
+layout(location = 0) out vec4 o_albedo;
+layout(location = 1) out vec4 o_normal;
+layout(location = 2) out vec4 o_roughness;
+uniform float u_roughness;
+#else
 layout(location = 0) out vec4 o_color;
+#endif
 
 in vec3 v_pos;
 in vec3 v_normal;
@@ -61,45 +113,106 @@ in vec2 v_tc;
 
 uniform sampler2D u_tex;
 
+// SCORCH_ATLAS is defined by the shader variant: the decals baked in the scorch atlas (rgb: decal color, a: transmittance) are applied like the decal layer
+#if SCORCH_ATLAS
+in vec2 v_lmTexel;
+uniform usampler2D u_scorchPageTable; // physical page + 1 of each virtual page, 0 if it's not resident
+uniform sampler2DArray u_scorchAtlas; // a layer per physical page, with a border so it can be filtered
+
+vec4 sampleScorch(vec2 texel)
+{
+    if(texel.x < 0.0)
+        return vec4(0, 0, 0, 1); // the chart didn't fit in the virtual texture
+    ivec2 page = ivec2(texel) / SCORCH_PAGE_SIZE;
+    uint physical = texelFetch(u_scorchPageTable, page, 0).r;
+    if(physical == 0u)
+        return vec4(0, 0, 0, 1);
+    vec2 uv = (texel - vec2(page * SCORCH_PAGE_SIZE) + float(SCORCH_PAGE_BORDER)) / float(SCORCH_PAGE_SIZE + 2 * SCORCH_PAGE_BORDER);
+    return textureLod(u_scorchAtlas, vec3(uv, physical - 1u), 0.0);
+}
+#endif
+
 void main()
 {
     vec3 albedo = texture(u_tex, v_tc).rgb;
     vec3 normal = normalize(v_normal);
-    const vec3 lightPos = vec3(0, 2, 0.2);
-    vec3 lightIntensity = 2.0*vec3(0.8, 0.8, 0.9);
-    vec3 pl = lightPos - v_pos;
-    float dist2 = dot(pl, pl);
-    lightIntensity *= 1.0 / dist2;
-    vec3 l = normalize(pl);
-    o_color = vec4(albedo * (0.3 +  lightIntensity * dot(l, normal)), 1);
+#if DEFERRED
+#if SCORCH_ATLAS // the baked decals modify the albedo too, like the live ones
+    vec4 scorch = sampleScorch(v_lmTexel);
+    albedo = albedo * scorch.a + scorch.rgb;
+#endif
+    o_albedo = vec4(albedo, 1);
+    o_normal = vec4(0.5 * normal + 0.5, 0);
+    o_roughness = vec4(u_roughness, 0, 0, 1);
+#else
+    o_color = vec4(diffuseLighting(v_pos, normal, albedo), 1);
+#if SCORCH_ATLAS
+    vec4 scorch = sampleScorch(v_lmTexel);
+    o_color.rgb = o_color.rgb * scorch.a + scorch.rgb;
+#endif
+#endif
 }
 )GLSL";
 
-ConstStr decal_vert =
-R"GLSL(
-layout(location = 0)in vec3 a_pos;
-layout(location = 2)in mat4 a_modelMtx;
-
-out vec3 v_pos;
-flat out vec3 v_spherePos;
-flat out mat3 v_envRotation;
+// Lighting pass of the deferred path, once per pixel no matter how many decals overlap
+// The roughness of the G-buffer (which the decals can change) drives a specular term that the forward path doesn't have
+ConstStr deferred_light_frag = R"GLSL(
+layout(location = 0) out vec4 o_color;
 
-uniform mat4 u_viewProj;
+uniform sampler2D u_albedoTex;
+uniform sampler2D u_normalTex;
+uniform sampler2D u_roughnessTex;
+uniform sampler2D u_depthTex;
+uniform mat4 u_invViewProj;
+uniform vec3 u_camPos;
 
 void main()
 {
-	gl_Position = u_viewProj * a_modelMtx * vec4(a_pos, 1);
-    v_pos = a_pos;
-    v_spherePos = vec3(a_modelMtx[3]);
-    v_envRotation = mat3(a_modelMtx);
+    ivec2 px = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(u_depthTex, px, 0).r;
+    if(depth == FAR_DEPTH)
+        discard; // background, it keeps the clear color
+    vec4 p = u_invViewProj * vec4(2.0 * gl_FragCoord.xy / vec2(textureSize(u_depthTex, 0)) - 1.0, ndcDepth(depth), 1);
+    vec3 pos = p.xyz / p.w;
+    vec3 albedo = texelFetch(u_albedoTex, px, 0).rgb;
+    vec3 normal = normalize(2.0 * texelFetch(u_normalTex, px, 0).xyz - 1.0);
+    float roughness = texelFetch(u_roughnessTex, px, 0).r;
+
+    // normalized Blinn-Phong, with the shininess that matches the GGX alpha (roughness^2), and the reflectance of a dielectric
+    vec3 pl = LIGHT_POS - pos;
+    vec3 l = normalize(pl);
+    vec3 h = normalize(l + normalize(u_camPos - pos));
+    float alpha = max(roughness * roughness, 1e-3);
+    float shininess = 2.0 / (alpha * alpha) - 2.0;
+    float specular = 0.04 * (shininess + 8.0) / (8.0 * 3.14159265) * pow(max(dot(normal, h), 0.0), shininess);
+    vec3 color = diffuseLighting(pos, normal, albedo) + specular * max(dot(l, normal), 0.0) * LIGHT_INTENSITY / dot(pl, pl);
+    o_color = vec4(color, 1);
 }
 )GLSL";
 
-ConstStr decal_frag =
+// Code shared by the decal shaders: the instanced spheres and the tiled resolve
+ConstStr decal_common =
 R"GLSL(
+// pcg3d, from "Hash Functions for GPU Rendering" (Jarzynski and Olano, 2020)
+// Cheaper than the sin based hash and it doesn't lose precision for big coordinates
+vec3 random3_int(vec3 c)
+{
+    uvec3 v = uvec3(ivec3(c)) * 1664525u + 1013904223u;
+    v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+    v ^= v >> 16u;
+    v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+    return vec3(v) * (1.0 / 4294967296.0) - 0.5;
+}
+
+// NOISE_BACKEND is defined by the shader variant
+#define NOISE_BACKEND_ALU 0
+#define NOISE_BACKEND_ALU_INT_HASH 1
+#define NOISE_BACKEND_CUBEMAP 2
+uniform samplerCubeArray u_noiseCubes; // for NOISE_BACKEND_CUBEMAP: one layer per material, with the noise of the material's frequency baked (see noise_bake_comp)
+
 // The following noise code is adapted from https://www.shadertoy.com/view/XsX3zB, which is MIT licensed
 // vvv-----------------------------------------------------------------------------------------------------
-vec3 random3(vec3 c) {
+vec3 random3_sin(vec3 c) {
 	float j = 4096.0 * sin(dot(c, vec3(17, 59.4, 15)));
 	vec3 r;
 	r.z = fract(512.0 * j);
@@ -110,6 +223,15 @@ vec3 random3(vec3 c) {
 	return r - 0.5;
 }
 
+vec3 random3(vec3 c)
+{
+#if NOISE_BACKEND == NOISE_BACKEND_ALU_INT_HASH
+    return random3_int(c);
+#else
+    return random3_sin(c);
+#endif
+}
+
 float simplex3d(vec3 p)
 {
     const float F3 =  0.3333333;
@@ -161,44 +283,289 @@ float simplex3d(vec3 p)
 }
 
 // directional artifacts can be reduced by rotating each octave
-float simplex3d_fractal(vec3 m)
+// octaves: 1 to 4, the LOD drops the finest ones
+float simplex3d_fractal(vec3 m, int octaves)
 {
     const mat3 rot1 = mat3(-0.37, 0.36, 0.85,-0.14,-0.93, 0.34,0.92, 0.01,0.4);
     const mat3 rot2 = mat3(-0.55,-0.39, 0.74, 0.33,-0.91,-0.24,0.77, 0.12,0.63);
     const mat3 rot3 = mat3(-0.71, 0.52,-0.47,-0.08,-0.72,-0.68,-0.7,-0.45,0.56);
 
-    return   0.5333333*simplex3d(m*rot1)
-			+0.2666667*simplex3d(2.0*m*rot2)
-			+0.1333333*simplex3d(4.0*m*rot3)
-			+0.0666667*simplex3d(8.0*m);
+    float n = 0.5333333*simplex3d(m*rot1);
+    if(octaves > 1)
+        n += 0.2666667*simplex3d(2.0*m*rot2);
+    if(octaves > 2)
+        n += 0.1333333*simplex3d(4.0*m*rot3);
+    if(octaves > 3)
+        n += 0.0666667*simplex3d(8.0*m);
+    return n;
 }
 // ^^^---------------------------------------------------------------------------------------------------
 
+struct Material {
+    vec4 params; // x: noise frequency, y: center base (base darkness so the decal is not too dim, specially at the center), z: exponent for the distance attenuation, w: roughness (deferred path)
+    vec4 color; // rgb: color of the burn
+};
+layout(std140, binding = 0) uniform Materials {
+    Material u_materials[16]; // MAX_DECAL_MATERIALS
+};
+
+uniform float u_time;
+uniform float u_growDuration; // time it takes for a new decal to reach its full radius
+uniform float u_growStart; // radius of a new decal, relative to its full radius
+uniform float u_fadeDuration; // decals fade out during the last seconds of their lifetime
+
+vec3 quatRotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+// growth and fade of a decal, from its age. lifetime 0 means infinite
+void decalAnimation(float spawnTime, float lifetime, out float radiusScale, out float fade)
+{
+    float age = u_time - spawnTime;
+    float grow = 1.0 - clamp(age / max(u_growDuration, 1e-4), 0.0, 1.0);
+    grow = 1.0 - grow * grow * grow; // ease out
+    radiusScale = mix(u_growStart, 1.0, grow);
+    fade = lifetime > 0.0 ? clamp((lifetime - age) / max(u_fadeDuration, 1e-4), 0.0, 1.0) : 1.0;
+}
+
+// the noise only depends on the direction from the center of the decal, so it can be baked into a cubemap
+// octaves only affects the ALU backends, the cubemaps have all of them baked
+float decalNoise(uint materialInd, vec3 dir, int octaves)
+{
+#if NOISE_BACKEND == NOISE_BACKEND_CUBEMAP
+    return textureLod(u_noiseCubes, vec4(dir, materialInd), 0.0).r;
+#else
+    return simplex3d_fractal(u_materials[materialInd].params.x * dir, octaves);
+#endif
+}
+
+// EDecalShape
+#define DECAL_SHAPE_SPHERE 0u
+#define DECAL_SHAPE_ELLIPSOID 1u
+#define DECAL_SHAPE_CAPSULE 2u
+#define DECAL_SHAPE_BOX 3u
+
+// 1 at the core of the decal's shape, 0 on its surface and negative outside. For the spheres it's 1 - distance / radius
+// sphere.w is the current radius and the extents are relative to it. rotation takes the shape to world space (it's also the envRotation of the decal)
+float decalShapeFalloff(vec3 p, vec4 sphere, vec4 rotation, uint shape, vec3 extents)
+{
+    if(shape == DECAL_SHAPE_SPHERE)
+        return 1.0 - distance(p, sphere.xyz) / sphere.w;
+    vec3 q = quatRotate(vec4(-rotation.xyz, rotation.w), p - sphere.xyz) / sphere.w; // in the frame of the shape
+    if(shape == DECAL_SHAPE_ELLIPSOID)
+        return 1.0 - length(q / extents); // not a distance, but it's enough for the falloff
+    if(shape == DECAL_SHAPE_CAPSULE)
+        return 1.0 - length(vec3(q.x - clamp(q.x, -extents.x, extents.x), q.yz)) / extents.y;
+    // box: signed distance, relative to the smallest half size
+    vec3 d = abs(q) - extents;
+    float sd = length(max(d, 0.0)) + min(max(d.x, max(d.y, d.z)), 0.0);
+    return -sd / min(extents.x, min(extents.y, extents.z));
+}
+
+// alpha of the decal at the surface point p, which must be inside of its shape: falloff is decalShapeFalloff() at p
+// envRotation rotates the direction we sample the noise environment so not all the decals look the same
+float decalAlpha(vec3 p, vec4 sphere, vec4 envRotation, float falloff, float fade, float intensity, uint materialInd, int octaves)
+{
+    Material material = u_materials[materialInd];
+    float r1 = falloff;
+    float noise = decalNoise(materialInd, quatRotate(envRotation, normalize(p - sphere.xyz)), octaves);
+    float a = fade * mix(0.0, material.params.y + noise, pow(r1, material.params.z));
+    return 1.0 - pow(1.0 - clamp(a, 0.0, 1.0), intensity); // same as blending the decal `intensity` times
+}
+)GLSL";
+
+// Screen size LOD, shared by the decal vertex shader and the culling
+ConstStr lod_common = R"GLSL(
+#define DECAL_MESH_LODS 3
+
+uniform mat4 u_viewProj;
+uniform float u_lodPixelScale; // screen radius, in pixels, of a sphere of radius 1 at distance 1. 0 disables the LOD
+uniform float u_lodMinPixels; // decals with a smaller screen radius are rejected
+uniform vec2 u_lodMeshPixels; // under these screen radiuses, the icosphere with 1 and 0 subdivisions is used
+uniform float u_lodOctavePixels; // all the noise octaves above this screen radius, one less each time it halves
+
+// DECAL_LOD is defined by the shader variant. Without it the functions below return the full detail
+#if DECAL_LOD
+// conservative: with the distance to the closest point of the sphere, so it's huge with the camera inside
+float decalScreenRadius(vec4 sphere)
+{
+    float w = (u_viewProj * vec4(sphere.xyz, 1)).w;
+    return u_lodPixelScale * sphere.w / max(w - sphere.w, 1e-4);
+}
+
+bool decalLodRejected(float screenRadius)
+{
+    return u_lodPixelScale > 0.0 && screenRadius < u_lodMinPixels;
+}
+
+uint decalMeshLod(float screenRadius)
+{
+    if(u_lodPixelScale == 0.0)
+        return 0u;
+    return screenRadius < u_lodMeshPixels.y ? 2u : screenRadius < u_lodMeshPixels.x ? 1u : 0u;
+}
+
+int decalOctaves(float screenRadius)
+{
+    if(u_lodPixelScale == 0.0)
+        return 4;
+    return 4 - clamp(int(ceil(log2(u_lodOctavePixels / screenRadius))), 0, 3);
+}
+#else
+float decalScreenRadius(vec4 sphere) { return 0.0; }
+bool decalLodRejected(float screenRadius) { return false; }
+uint decalMeshLod(float screenRadius) { return 0u; }
+int decalOctaves(float screenRadius) { return 4; }
+#endif
+)GLSL";
+
+ConstStr decal_vert =
+R"GLSL(
+layout(location = 0)in vec3 a_pos;
+layout(location = 2)in vec4 a_sphere; // xyz: position, w: radius
+layout(location = 3)in vec3 a_rot; // xyz of a unit quaternion with positive w
+layout(location = 4)in float a_spawnTime;
+layout(location = 5)in vec2 a_params; // x: lifetime (0 means infinite), y: intensity
+layout(location = 6)in uint a_material;
+layout(location = 7)in vec3 a_extents; // relative to the radius
+layout(location = 8)in uint a_shape;
+
+out vec3 v_pos;
+flat out vec4 v_sphere;
+flat out vec4 v_envRotation;
+flat out float v_fade;
+flat out float v_intensity;
+flat out uint v_material;
+flat out vec3 v_extents;
+flat out uint v_shape;
+flat out uint v_meshLod;
+flat out int v_octaves;
+flat out vec2 v_depthRange; // view space depths of the front and the back of the sphere, for TILE_DEPTH_REJECT
+
+// SCREEN_QUAD_PROXY is defined by the shader variant: the vertices are the corners of the screen space bounding rectangle (DECAL_PROXY_SCREEN_QUAD)
+// instead of a mesh around the sphere (DECAL_PROXY_ICOSPHERE and DECAL_PROXY_BOX)
+#if SCREEN_QUAD_PROXY
+uniform mat4 u_view;
+uniform mat4 u_proj;
+uniform mat4 u_invViewProj;
+
+// NDC of the tangents from the eye to a circle of the sphere (in the plane of the axis and the view direction)
+// x: coordinate of the center along the axis, z: distance of the center in front of the eye (> r)
+vec2 tangentsNdc(float x, float z, float r, float projScale)
+{
+    float s = r * sqrt(x * x + z * z - r * r);
+    return projScale * vec2(x * z - s, x * z + s) / (z * z - r * r);
+}
+
+// Screen space bounding rectangle of the sphere, at the depth of its farthest point so the depth test is as conservative as with the sphere.
+// The corner is chosen by a_pos.xy (+-1)
+vec4 screenQuadPosition(vec3 center, float r)
+{
+    vec3 c = (u_view * vec4(center, 1)).xyz;
+    vec4 farClip = u_proj * vec4(0, 0, c.z - r, 1);
+#if REVERSE_Z
+    float near = u_proj[3][2] / (u_proj[2][2] + 1.0);
+    float farDepth = max(farClip.z / farClip.w, 0.0);
+#else
+    float near = u_proj[3][2] / (u_proj[2][2] - 1.0);
+    float farDepth = min(farClip.z / farClip.w, 1.0);
+#endif
+    if(c.z - r > -near)
+        return vec4(0, 0, 2, 1); // behind the camera
+    vec2 ndc = a_pos.xy; // the sphere crosses the near plane (or has the camera inside): full screen
+    if(-c.z - r > near) {
+        vec2 xs = tangentsNdc(c.x, -c.z, r, u_proj[0][0]);
+        vec2 ys = tangentsNdc(c.y, -c.z, r, u_proj[1][1]);
+        ndc = clamp(vec2(a_pos.x < 0.0 ? xs.x : xs.y, a_pos.y < 0.0 ? ys.x : ys.y), -1.0, 1.0);
+    }
+    return vec4(ndc, farDepth, 1);
+}
+#endif
+
+void main()
+{
+    float radiusScale;
+    decalAnimation(a_spawnTime, a_params.x, radiusScale, v_fade);
+    float radius = a_sphere.w * radiusScale;
+
+#if SCREEN_QUAD_PROXY
+    gl_Position = screenQuadPosition(a_sphere.xyz, radius);
+    vec4 p = u_invViewProj * gl_Position;
+    v_pos = p.xyz / p.w;
+#else
+    v_pos = a_sphere.xyz + radius * a_pos; // the box proxy has its corners at +-1, so it's the bounding box
+    gl_Position = u_viewProj * vec4(v_pos, 1);
+#endif
+    // the LOD is chosen with the full radius, like in the culling
+    float screenRadius = decalScreenRadius(a_sphere);
+    v_meshLod = decalMeshLod(screenRadius);
+    v_octaves = decalOctaves(screenRadius);
+    if(v_fade == 0.0 || decalLodRejected(screenRadius))
+        gl_Position = vec4(0, 0, 2, 1); // expired but the CPU hasn't removed it yet, or too small: clip it away
+    v_sphere = vec4(a_sphere.xyz, radius);
+    v_envRotation = vec4(a_rot, sqrt(max(0.0, 1.0 - dot(a_rot, a_rot))));
+    v_intensity = a_params.y;
+    v_material = a_material;
+    v_extents = a_extents;
+    v_shape = a_shape;
+    float w = (u_viewProj * vec4(a_sphere.xyz, 1)).w;
+    v_depthRange = vec2(w - radius, w + radius);
+}
+)GLSL";
+
+ConstStr decal_frag =
+R"GLSL(
+
+// STENCIL_VOLUMES is defined by the shader variant. The depth and stencil tests don't depend on the shader (the discard doesn't write anything),
+// so run them before it: this is what makes the stencil marked sphere volumes skip the shading.
+// Only there, because it also counts the discarded fragments in GL_SAMPLES_PASSED
+#if STENCIL_VOLUMES
+layout(early_fragment_tests) in;
+#endif
+
 layout(location = 0) out vec4 o_color;
+// DEFERRED is defined by the shader variant: o_color goes to the albedo of the G-buffer, and the roughness is blended too
+#if DEFERRED
+layout(location = 2) out vec4 o_roughness;
+#endif
 
 in vec3 v_pos;
-flat in vec3 v_spherePos; // position of the sphere in world space
-flat in mat3 v_envRotation; // rotate the direction we sample the noise environment so not all the decals look the same
+flat in vec4 v_sphere; // xyz: position of the sphere in world space, w: radius
+flat in vec4 v_envRotation; // quaternion to rotate the direction we sample the noise environment so not all the decals look the same
+flat in float v_fade; // goes to 0 at the end of the decal's lifetime
+flat in float v_intensity; // > 1 when other decals were coalesced into this one
+flat in uint v_material;
+flat in vec3 v_extents; // of the shape, relative to the radius (see decalShapeFalloff)
+flat in uint v_shape;
+flat in uint v_meshLod;
+flat in int v_octaves;
+flat in vec2 v_depthRange;
+
+uniform int u_materialOverride; // when >= 0, used instead of the material of the instance (to compare with one draw call per material)
 
 uniform vec2 u_invScreenSize;
 uniform mat4 u_invViewProj;
-//uniform vec3 u_spherePos; // position of the sphere in world space
-uniform float u_sphereRad; // radius of the sphere
-//uniform mat3 u_envRotation; // rotate the direction we sample the noise environment so not all the decals look the same
+// MSAA is defined by the shader variant: the scene is multisampled
+// The depth is read at the first covered sample, which is the sample being shaded when the pass runs per sample (GL_SAMPLE_SHADING)
+#if MSAA
+uniform sampler2DMS u_depthTex;
+#define DEPTH_SAMPLE findLSB(gl_SampleMaskIn[0])
+#else
 uniform sampler2D u_depthTex; // the depth buffer of the scene
-uniform float u_noiseFreq; // noise frequency
-uniform float u_centerBase; // base darkness so the decal is not too dim, specially at the center
-uniform float u_exponent; // exponent for the distance attenuation
-uniform int u_displayMode; // display mode for debugging (see DISPLAY_MODE_ constants below)
+#define DEPTH_SAMPLE 0
+#endif
 
-const int DISPLAY_MODE_DEFAULT = 0;
-const int DISPLAY_MODE_CIRCLE = 1;
-const int DISPLAY_MODE_SPHERE = 2;
-const int DISPLAY_MODE_SPHERE_NOISE = 3;
+// DISPLAY_MODE is defined by the shader variant, the debug modes are not compiled into the default one
+#define DISPLAY_MODE_DEFAULT 0
+#define DISPLAY_MODE_CIRCLE 1
+#define DISPLAY_MODE_SPHERE 2
+#define DISPLAY_MODE_SPHERE_NOISE 3
+#define DISPLAY_MODE_LOD 4
 
 vec3 calcWorldPosFromDepth(vec3 fc_depth)
 {
-    vec4 clipSpacePos = vec4(2.0 * fc_depth - 1.0, 1);
+    vec4 clipSpacePos = vec4(2.0 * fc_depth.xy - 1.0, ndcDepth(fc_depth.z), 1);
     vec4 worldSpacePos = u_invViewProj * clipSpacePos;
     worldSpacePos /= worldSpacePos.w;
     return worldSpacePos.xyz;
@@ -206,189 +573,3463 @@ vec3 calcWorldPosFromDepth(vec3 fc_depth)
 
 void main()
 {
+#if TILE_DEPTH_REJECT // defined by the shader variant: b_tiles has the depths of the tiles of this frame (tile_depth_comp)
+    // none of the surfaces of the tile are in the depth range of the sphere, so skip the position reconstruction and the shading
+    ivec2 tile = ivec2(gl_FragCoord.xy) / TILE_SIZE;
+    if(!tileDepthOverlaps(b_tiles[tile.y * ((u_viewSize.x + TILE_SIZE - 1) / TILE_SIZE) + tile.x], v_depthRange.x, v_depthRange.y))
+        discard;
+#endif
     vec2 fc = gl_FragCoord.xy * u_invScreenSize;
-    float bgDepth = texture(u_depthTex, fc).r;
+#if VIEW_RAYS // defined by the shader variant: reconstruct the position from the linear depth prepass (view_ray_common) instead of u_depthTex
+    vec3 bgPos = viewRayWorldPos(ivec2(gl_FragCoord.xy), fc);
+#else
+    float bgDepth = texelFetch(u_depthTex, ivec2(gl_FragCoord.xy), DEPTH_SAMPLE).r;
     vec3 bgPos = calcWorldPosFromDepth(vec3(fc, bgDepth));
-    float d = distance(bgPos, v_spherePos);
+#endif
+    vec3 spherePos = v_sphere.xyz;
+    float falloff = decalShapeFalloff(bgPos, v_sphere, v_envRotation, v_shape, v_extents);
 
-    if(u_displayMode != DISPLAY_MODE_SPHERE && u_displayMode != DISPLAY_MODE_SPHERE_NOISE && d > u_sphereRad)
+#if DISPLAY_MODE != DISPLAY_MODE_SPHERE && DISPLAY_MODE != DISPLAY_MODE_SPHERE_NOISE
+    if(falloff < 0.0)
         discard;
+#endif
+
+    uint materialInd = u_materialOverride >= 0 ? uint(u_materialOverride) : v_material;
+#if DISPLAY_MODE == DISPLAY_MODE_DEFAULT
+    o_color = vec4(u_materials[materialInd].color.rgb, decalAlpha(bgPos, v_sphere, v_envRotation, falloff, v_fade, v_intensity, materialInd, v_octaves));
+#elif DISPLAY_MODE == DISPLAY_MODE_SPHERE_NOISE
+    float noise = decalNoise(materialInd, quatRotate(v_envRotation, normalize(v_pos - spherePos)), v_octaves);
+    o_color = vec4(vec3(noise), 1);
+#elif DISPLAY_MODE == DISPLAY_MODE_LOD
+    // green at full detail, towards red as the mesh and the noise octaves drop
+    float lod = float(v_meshLod) + float(4 - v_octaves);
+    o_color = vec4(mix(vec3(0, 1, 0), vec3(1, 0, 0), lod / 5.0), 0.5);
+#else
+    float a = (DISPLAY_MODE == DISPLAY_MODE_SPHERE && falloff >= 0.0) ? 0.35 : 0.2;
+    o_color = vec4(1, 0, 0, a);
+#endif
+#if DEFERRED
+    o_roughness = vec4(u_materials[materialInd].params.w, 0, 0, DISPLAY_MODE == DISPLAY_MODE_DEFAULT ? o_color.a : 0.0);
+#endif
+}
+)GLSL";
+
+// Bakes the noise of one material into a layer of the noise cubemap array, with the ALU reference noise
+ConstStr noise_bake_comp = R"GLSL(
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(r16f, binding = 0) writeonly uniform imageCubeArray u_outImg;
+uniform uint u_layer;
+
+void main()
+{
+    int size = imageSize(u_outImg).x;
+    ivec2 px = ivec2(gl_GlobalInvocationID.xy);
+    if(any(greaterThanEqual(px, ivec2(size))))
+        return;
+    int face = int(gl_GlobalInvocationID.z);
+    vec2 st = 2.0 * (vec2(px) + 0.5) / float(size) - 1.0;
+    // direction of each cube face texel (table 8.19 of the GL 4.6 spec, inverted)
+    vec3 dir =
+        face == 0 ? vec3(1, -st.y, -st.x) :
+        face == 1 ? vec3(-1, -st.y, st.x) :
+        face == 2 ? vec3(st.x, 1, st.y) :
+        face == 3 ? vec3(st.x, -1, -st.y) :
+        face == 4 ? vec3(st.x, -st.y, 1) :
+                    vec3(-st.x, -st.y, -1);
+    float noise = simplex3d_fractal(u_materials[u_layer].params.x * normalize(dir), 4);
+    imageStore(u_outImg, ivec3(px, 6 * int(u_layer) + face), vec4(noise));
+}
+)GLSL";
+
+// For the stencil marking pass of the sphere volumes, only the depth test matters
+ConstStr decal_stencil_frag = R"GLSL(
+void main() {}
+)GLSL";
+
+// InstancingData, for the compute shaders
+ConstStr instance_common = R"GLSL(
+struct Instance {
+    vec4 sphere;
+    uvec2 rot; // 3 x snorm16 + material index
+    float spawnTime;
+    uint params; // 2 x half
+    vec3 extents;
+    uint shape;
+};
+
+vec4 instanceRotation(Instance inst)
+{
+    vec3 xyz = vec3(unpackSnorm2x16(inst.rot.x), unpackSnorm2x16(inst.rot.y).x);
+    return vec4(xyz, sqrt(max(0.0, 1.0 - dot(xyz, xyz))));
+}
+
+uint instanceMaterial(Instance inst)
+{
+    return inst.rot.y >> 16;
+}
+)GLSL";
+
+// Frustum culling of the decals: the visible instances are compacted into another buffer, which is drawn with glDrawElementsIndirect
+// The instance count of the draw command is written here, so the CPU never needs to know how many decals are visible
+// It's done in 3 dispatches, so the visible instances keep the order of b_instances and the frames don't flicker where decals overlap:
+//   CULL_PASS_COUNT: culls the instances of each workgroup and writes how many are visible per LOD
+//   CULL_PASS_SCAN: a single workgroup turns those counts into the first index of each workgroup, in order, and places the LODs
+//   CULL_PASS_WRITE: each instance is written to the first index of its workgroup plus its prefix sum within the workgroup
+ConstStr cull_comp = R"GLSL(
+layout(local_size_x = 64) in;
+
+layout(std430, binding = 0) readonly buffer Instances {
+    Instance b_instances[];
+};
+layout(std430, binding = 1) writeonly buffer VisibleInstances {
+    Instance b_visibleInstances[];
+};
+struct DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+// one per mesh LOD. The visible instances of each LOD go to their own region of b_visibleInstances, starting at baseInstance
+// The regions are one after the other, instanceCount and baseInstance are written by the scan pass
+layout(std430, binding = 2) buffer DrawCommands {
+    DrawCommand b_cmds[DECAL_MESH_LODS];
+};
+// the LOD of each instance, or CULLED. Written by the count pass, so the write pass doesn't have to cull again
+layout(std430, binding = 5) buffer InstanceLods {
+    uint b_instanceLods[];
+};
+// DECAL_MESH_LODS per workgroup: the visible instances after the count pass, the first index within the LOD after the scan
+layout(std430, binding = 6) buffer GroupOffsets {
+    uint b_groupOffsets[];
+};
+
+#define CULL_PASS_COUNT 0
+#define CULL_PASS_SCAN 1
+#define CULL_PASS_WRITE 2
+#define CULLED 0xFFFFFFFFu
 
-    float r1 = 1.0 - d / u_sphereRad;
-    float noise = simplex3d_fractal(u_noiseFreq * v_envRotation * normalize(bgPos - v_spherePos));
-    float a = mix(0.0, u_centerBase + noise, pow(r1, u_exponent));
-    o_color = vec4(0, 0, 0, a);
-    if(u_displayMode == DISPLAY_MODE_SPHERE_NOISE) {
-        noise = simplex3d_fractal(u_noiseFreq * v_envRotation * normalize(v_pos - v_spherePos));
-        o_color = vec4(vec3(noise), 1); 
+uniform int u_pass;
+uniform vec4 u_frustumPlanes[6]; // pointing inwards
+uniform uint u_numInstances;
+uniform bool u_meshLods; // if false, all the instances go to the first command
+uniform bool u_tileDepthReject; // test the decals against the min/max depth of the tiles they cover (b_tiles, see tile_depth_comp)
+
+// inclusive prefix sums, with the count of each LOD packed in 10 bits
+shared uint s_sums[64];
+
+#define MAX_TESTED_TILES 64 // the decals that cover more tiles are kept without testing them
+
+// whether the sphere can touch the surfaces of some of the tiles it covers on screen. The screen rectangle is the one of its bounding box
+bool tileDepthVisible(vec4 sphere)
+{
+    vec4 c = u_viewProj * vec4(sphere.xyz, 1);
+    vec2 ndcMin = vec2(1), ndcMax = vec2(-1);
+    for(int k = 0; k < 8; k++) {
+        vec3 corner = vec3(k & 1, (k >> 1) & 1, k >> 2) * 2.0 - 1.0;
+        vec4 p = c + sphere.w * (corner.x * u_viewProj[0] + corner.y * u_viewProj[1] + corner.z * u_viewProj[2]);
+        if(p.w <= 0.0)
+            return true; // crosses the plane of the eye, the rectangle is unbounded
+        ndcMin = min(ndcMin, p.xy / p.w);
+        ndcMax = max(ndcMax, p.xy / p.w);
+    }
+    ivec2 numTiles = (u_viewSize + TILE_SIZE - 1) / TILE_SIZE;
+    ivec2 t0 = clamp(ivec2((0.5 * ndcMin + 0.5) * vec2(u_viewSize)) / TILE_SIZE, ivec2(0), numTiles - 1);
+    ivec2 t1 = clamp(ivec2((0.5 * ndcMax + 0.5) * vec2(u_viewSize)) / TILE_SIZE, ivec2(0), numTiles - 1);
+    if((t1.x - t0.x + 1) * (t1.y - t0.y + 1) > MAX_TESTED_TILES)
+        return true;
+    for(int y = t0.y; y <= t1.y; y++)
+    for(int x = t0.x; x <= t1.x; x++) {
+        if(tileDepthOverlaps(b_tiles[y * numTiles.x + x], c.w - sphere.w, c.w + sphere.w))
+            return true;
+    }
+    return false;
+}
+
+// inclusive prefix sum of s_sums over the workgroup
+void scanWorkgroup()
+{
+    uint lane = gl_LocalInvocationIndex;
+    barrier();
+    for(uint offset = 1u; offset < 64u; offset *= 2u) {
+        uint v = lane >= offset ? s_sums[lane - offset] : 0u;
+        barrier();
+        s_sums[lane] += v;
+        barrier();
+    }
+}
+
+uint unpackLodCount(uint sums, uint lod) { return (sums >> (10u * lod)) & 0x3FFu; }
+
+void main()
+{
+    uint lane = gl_LocalInvocationIndex;
+    if(u_pass == CULL_PASS_SCAN) {
+        // each lane scans a contiguous range of workgroups, then the ranges are offset by the sums of the previous lanes
+        uint numGroups = (u_numInstances + 63u) / 64u;
+        uint groupsPerLane = (numGroups + 63u) / 64u;
+        uint g0 = min(lane * groupsPerLane, numGroups);
+        uint g1 = min(g0 + groupsPerLane, numGroups);
+        uint lodBase = 0u;
+        for(uint lod = 0u; lod < DECAL_MESH_LODS; lod++) {
+            uint laneSum = 0u;
+            for(uint g = g0; g < g1; g++)
+                laneSum += b_groupOffsets[g * DECAL_MESH_LODS + lod];
+            s_sums[lane] = laneSum;
+            scanWorkgroup();
+            uint first = s_sums[lane] - laneSum;
+            for(uint g = g0; g < g1; g++) {
+                uint n = b_groupOffsets[g * DECAL_MESH_LODS + lod];
+                b_groupOffsets[g * DECAL_MESH_LODS + lod] = first;
+                first += n;
+            }
+            if(lane == 63u) {
+                b_cmds[lod].instanceCount = s_sums[63];
+                b_cmds[lod].baseInstance = lodBase;
+            }
+            lodBase += s_sums[63];
+            barrier();
+        }
+        return;
+    }
+
+    uint i = gl_GlobalInvocationID.x;
+    uint lod = CULLED;
+    if(u_pass == CULL_PASS_COUNT) {
+        if(i < u_numInstances) {
+            vec4 sphere = b_instances[i].sphere;
+            bool visible = true;
+            for(int p = 0; p < 6; p++)
+                visible = visible && dot(u_frustumPlanes[p].xyz, sphere.xyz) + u_frustumPlanes[p].w >= -sphere.w;
+            float screenRadius = decalScreenRadius(sphere);
+            visible = visible && !decalLodRejected(screenRadius);
+            if(visible && u_tileDepthReject)
+                visible = tileDepthVisible(sphere);
+            if(visible)
+                lod = u_meshLods ? decalMeshLod(screenRadius) : 0u;
+            b_instanceLods[i] = lod;
+        }
+    }
+    else if(i < u_numInstances) {
+        lod = b_instanceLods[i];
+    }
+
+    s_sums[lane] = lod != CULLED ? 1u << (10u * lod) : 0u;
+    scanWorkgroup();
+    uint groupOffsetsInd = gl_WorkGroupID.x * DECAL_MESH_LODS;
+    if(u_pass == CULL_PASS_COUNT) {
+        if(lane < DECAL_MESH_LODS)
+            b_groupOffsets[groupOffsetsInd + lane] = unpackLodCount(s_sums[63], lane);
     }
-    else if(u_displayMode != DISPLAY_MODE_DEFAULT) {
-        a = (u_displayMode == DISPLAY_MODE_SPHERE && d <= u_sphereRad) ? 0.35 : 0.2;
-        o_color = vec4(1, 0, 0, a);
+    else if(lod != CULLED) {
+        uint dst = b_cmds[lod].baseInstance + b_groupOffsets[groupOffsetsInd + lod] + unpackLodCount(s_sums[lane], lod) - 1u;
+        b_visibleInstances[dst] = b_instances[i];
     }
 }
 )GLSL";
 
+ConstStr depth_common = R"GLSL(
+uniform float u_near;
+uniform float u_far;
+
+// REVERSE_Z is defined by the shader variant: the depth goes from 1 at the near plane to 0 at the far plane, with glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE)
+// Otherwise it's the default OpenGL depth, from 0 to 1 with the NDC from -1 to 1
+#if REVERSE_Z
+#define FAR_DEPTH 0.0
+#else
+#define FAR_DEPTH 1.0
+#endif
+
+// view space distance along -z
+float linearDepth(float depth)
+{
+#if REVERSE_Z
+    return u_near * u_far / (u_near + depth * (u_far - u_near));
+#else
+    float z = 2.0 * depth - 1.0;
+    return 2.0 * u_near * u_far / (u_far + u_near - z * (u_far - u_near));
+#endif
 }
 
-static u32 fbo;
-static u32 fb_colorRbo, fb_depthTex;
+// the z in normalized device coordinates, to unproject with the inverse view projection
+float ndcDepth(float depth)
+{
+#if REVERSE_Z
+    return depth;
+#else
+    return 2.0 * depth - 1.0;
+#endif
+}
+)GLSL";
 
-struct GltfGpuResources {
-    std::vector<u32> buffers;
-    std::vector<u32> textures;
-    std::vector<std::vector<u32>> vaos; //[meshInd][primitiveInd]
-};
+// Writes the view space depth (R32F) once per frame, so the screen space passes don't have to undo the projection per pixel
+ConstStr linear_depth_frag = R"GLSL(
+layout(location = 0) out float o_depth;
+uniform sampler2D u_depthTex;
+void main()
+{
+    o_depth = linearDepth(texelFetch(u_depthTex, ivec2(gl_FragCoord.xy), 0).r);
+}
+)GLSL";
 
-GltfGpuResources modelResources;
+// Flags the edge pixels of the multisampled scene in the stencil: the ones whose samples are on surfaces at different depths
+// Within a triangle the depth only changes by a fraction of a pixel footprint, so a relative threshold skips the interiors
+// The decals are shaded per sample on these pixels, and once per pixel elsewhere
+ConstStr msaa_edge_frag = R"GLSL(
+uniform sampler2DMS u_depthTex;
+uniform int u_numSamples;
+const float EDGE_THRESHOLD = 0.01; // relative to the view space depth
 
-struct SceneShader {
-    u32 prog;
-    struct Locs {
-        u32 modelMtx,
-            modelView,
-            modelViewProj,
-            tex;
-    } locs;
+void main()
+{
+    ivec2 px = ivec2(gl_FragCoord.xy);
+    float z0 = linearDepth(texelFetch(u_depthTex, px, 0).r);
+    for(int i = 1; i < u_numSamples; i++) {
+        if(abs(linearDepth(texelFetch(u_depthTex, px, i).r) - z0) > EDGE_THRESHOLD * z0)
+            return; // edge, the stencil is written
+    }
+    discard;
+}
+)GLSL";
+
+// Position reconstruction from the linear depth, with the view ray interpolated from the frustum corners
+ConstStr view_ray_common = R"GLSL(
+uniform sampler2D u_linearDepthTex; // see linear_depth_frag
+uniform vec3 u_camPos;
+uniform vec3 u_viewRay00; // world space ray to the bottom left corner of the screen, scaled so its view space depth is 1
+uniform vec3 u_viewRayDx; // change of the ray from the left to the right side of the screen
+uniform vec3 u_viewRayDy; // from the bottom to the top
+
+// uv: [0, 1] across the screen
+vec3 viewRayWorldPos(ivec2 px, vec2 uv)
+{
+    vec3 ray = u_viewRay00 + uv.x * u_viewRayDx + uv.y * u_viewRayDy;
+    return u_camPos + texelFetch(u_linearDepthTex, px, 0).r * ray;
+}
+)GLSL";
+
+// Tiled decals: the screen is split in tiles and the decals are binned into the tiles they touch (tile_bin_comp)
+// Then a single pass reads the depth once per pixel and evaluates only the decals of its tile (tile_resolve_comp)
+ConstStr tile_common = R"GLSL(
+#define TILE_SIZE 16
+#define MAX_DECALS_PER_TILE 512
+
+struct Tile {
+    float minDepth, maxDepth; // view space depth of the surfaces in the tile. minDepth > maxDepth if there are none (only background)
+    uint depthMask; // 32 slices between minDepth and maxDepth, the bits are set where there are surfaces
+    uint numDecals; // can be more than MAX_DECALS_PER_TILE, only the first ones are in b_tileDecals
+};
+layout(std430, binding = 3) buffer Tiles {
+    Tile b_tiles[];
 };
-static SceneShader sceneShader;
 
-struct DecalShader {
-    u32 prog;
-    struct Locs {
-        u32 invScreenSize,
-            invViewProj,
-            viewProj,
-            spherePos,
-            sphereRad,
-            envRotation,
-            depthTex,
-            noiseFreq,
-            centerBase,
-            exponent,
-            displayMode;
-    } locs;
+// the part of the depth texture that is used. Smaller than the texture when rendering the decals at low resolution
+uniform ivec2 u_viewSize;
+
+int depthSlice(float z, float zMin, float zMax)
+{
+    return clamp(int(32.0 * (z - zMin) / max(zMax - zMin, 1e-6)), 0, 31);
+}
+
+// whether some surface of the tile can be in the range of view space depths [zMin, zMax]. Always false for the empty tiles
+bool tileDepthOverlaps(Tile tile, float zMin, float zMax)
+{
+    if(zMax < tile.minDepth || zMin > tile.maxDepth)
+        return false;
+    int s0 = depthSlice(zMin, tile.minDepth, tile.maxDepth);
+    int s1 = depthSlice(zMax, tile.minDepth, tile.maxDepth);
+    uint mask = (s1 == 31 ? 0xFFFFFFFFu : (1u << (s1 + 1)) - 1u) & ~((1u << s0) - 1u);
+    return (mask & tile.depthMask) != 0u;
+}
+)GLSL";
+
+// Min/max depth and depth slice mask of each tile
+ConstStr tile_depth_comp = R"GLSL(
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+uniform sampler2D u_depthTex;
+
+shared uint s_minDepth;
+shared uint s_maxDepth;
+shared uint s_depthMask;
+
+void main()
+{
+    if(gl_LocalInvocationIndex == 0u) {
+        s_minDepth = floatBitsToUint(u_far);
+        s_maxDepth = 0u;
+        s_depthMask = 0u;
+    }
+    barrier();
+
+    // linear depths, so the tiles don't depend on the depth convention. They are positive, so their bits can be compared as uints
+    ivec2 px = ivec2(gl_GlobalInvocationID.xy);
+    bool inside = all(lessThan(px, u_viewSize));
+    float depth = inside ? texelFetch(u_depthTex, px, 0).r : FAR_DEPTH;
+    bool surface = depth != FAR_DEPTH;
+    float z = linearDepth(depth);
+    if(surface) {
+        atomicMin(s_minDepth, floatBitsToUint(z));
+        atomicMax(s_maxDepth, floatBitsToUint(z));
+    }
+    barrier();
+
+    float minDepth = uintBitsToFloat(s_minDepth);
+    float maxDepth = uintBitsToFloat(s_maxDepth);
+    if(surface)
+        atomicOr(s_depthMask, 1u << depthSlice(z, minDepth, maxDepth));
+    barrier();
+
+    if(gl_LocalInvocationIndex == 0u) {
+        uint tileInd = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+        b_tiles[tileInd] = Tile(minDepth, maxDepth, s_depthMask, 0u);
+    }
+}
+)GLSL";
+
+// One workgroup per tile, it tests the visible decals against the tile frustum (and depth slices) in chunks
+// The decals are compacted with a prefix sum so they keep their order, like in the instanced path
+ConstStr tile_bin_comp = R"GLSL(
+layout(local_size_x = 64) in;
+
+layout(std430, binding = 0) readonly buffer Instances {
+    Instance b_instances[];
+};
+layout(std430, binding = 2) readonly buffer DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+} b_cmd;
+layout(std430, binding = 4) writeonly buffer TileDecals {
+    uint b_tileDecals[]; // MAX_DECALS_PER_TILE per tile
+};
+// cleared before the dispatch
+layout(std430, binding = 7) buffer TileOverflow {
+    uint b_overflowTiles; // with more than MAX_DECALS_PER_TILE decals
+    uint b_droppedDecals; // the ones that didn't fit in those tiles
 };
-static DecalShader decalShader;
 
-struct Camera {
-    vec3 pos;
-    float heading, pitch;
+uniform mat4 u_view;
+uniform vec2 u_tanHalfFov; // x: horizontal, y: vertical
+uniform bool u_useDepthMask;
+
+shared uint s_sums[64];
+shared uint s_numDecals;
+
+void main()
+{
+    uint tileInd = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    Tile tile = b_tiles[tileInd];
+    if(tile.minDepth > tile.maxDepth) {
+        if(gl_LocalInvocationIndex == 0u)
+            b_tiles[tileInd].numDecals = 0u;
+        return;
+    }
+
+    // planes of the tile frustum in view space, through the origin and pointing inwards
+    vec2 ndc0 = 2.0 * vec2(gl_WorkGroupID.xy * TILE_SIZE) / vec2(u_viewSize) - 1.0;
+    vec2 ndc1 = min(2.0 * vec2((gl_WorkGroupID.xy + 1u) * TILE_SIZE) / vec2(u_viewSize) - 1.0, vec2(1));
+    vec3 planes[4] = vec3[4](
+        normalize(vec3(1, 0, ndc0.x * u_tanHalfFov.x)),
+        normalize(vec3(-1, 0, -ndc1.x * u_tanHalfFov.x)),
+        normalize(vec3(0, 1, ndc0.y * u_tanHalfFov.y)),
+        normalize(vec3(0, -1, -ndc1.y * u_tanHalfFov.y)));
+    float zMin = tile.minDepth;
+    float zMax = tile.maxDepth;
+
+    if(gl_LocalInvocationIndex == 0u)
+        s_numDecals = 0u;
+    barrier();
+
+    uint numInstances = b_cmd.instanceCount;
+    uint lane = gl_LocalInvocationIndex;
+    for(uint base = 0u; base < numInstances; base += 64u) {
+        uint i = base + lane;
+        bool hit = false;
+        if(i < numInstances) {
+            vec4 sphere = b_instances[i].sphere;
+            vec3 c = (u_view * vec4(sphere.xyz, 1)).xyz;
+            float r = sphere.w;
+            hit = u_useDepthMask ? tileDepthOverlaps(tile, -c.z - r, -c.z + r) : -c.z + r >= zMin && -c.z - r <= zMax;
+            for(int p = 0; p < 4; p++)
+                hit = hit && dot(planes[p], c) >= -r;
+        }
+
+        // inclusive prefix sum of the hits
+        s_sums[lane] = hit ? 1u : 0u;
+        barrier();
+        for(uint offset = 1u; offset < 64u; offset *= 2u) {
+            uint v = lane >= offset ? s_sums[lane - offset] : 0u;
+            barrier();
+            s_sums[lane] += v;
+            barrier();
+        }
+        uint dst = s_numDecals + s_sums[lane] - 1u;
+        if(hit && dst < MAX_DECALS_PER_TILE)
+            b_tileDecals[tileInd * MAX_DECALS_PER_TILE + dst] = i;
+        barrier();
+        if(lane == 63u)
+            s_numDecals += s_sums[63];
+        barrier();
+    }
+
+    if(gl_LocalInvocationIndex == 0u) {
+        b_tiles[tileInd].numDecals = s_numDecals;
+        if(s_numDecals > MAX_DECALS_PER_TILE) {
+            atomicAdd(b_overflowTiles, 1u);
+            atomicAdd(b_droppedDecals, s_numDecals - MAX_DECALS_PER_TILE);
+        }
+    }
+}
+)GLSL";
+
+// One workgroup per tile. The decals of the tile are loaded into shared memory in chunks, and each pixel blends the ones that touch it
+// The output is the decal color (premultiplied) and the transmittance, to be composited as scene * transmittance + color
+ConstStr tile_resolve_comp = R"GLSL(
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+layout(std430, binding = 0) readonly buffer Instances {
+    Instance b_instances[];
 };
-static Camera camera = {
-    .pos = {0.873904645, 1.38394725, 2.47491980},
-    .heading = 0.277831912,
-    .pitch = -0.481122792,
+layout(std430, binding = 4) readonly buffer TileDecals {
+    uint b_tileDecals[];
 };
+layout(rgba16f, binding = 0) writeonly uniform image2D u_outImg;
 
-struct Sphere {
-    u32 vao, vbo, ebo;
-    u32 instancingVbo;
-    u32 numInds;
+uniform sampler2D u_depthTex;
+uniform mat4 u_invViewProj;
+// TILE_HEATMAP is defined by the shader variant: color the tiles by number of decals
+
+#define CHUNK_SIZE (TILE_SIZE * TILE_SIZE)
+shared vec4 s_spheres[CHUNK_SIZE];
+shared vec4 s_rotations[CHUNK_SIZE];
+shared vec4 s_fadeIntensityMaterial[CHUNK_SIZE]; // w: noise octaves
+shared vec4 s_shapes[CHUNK_SIZE]; // xyz: extents, w: shape
+
+void main()
+{
+    ivec2 px = ivec2(gl_GlobalInvocationID.xy);
+    bool inside = all(lessThan(px, u_viewSize));
+    float depth = inside ? texelFetch(u_depthTex, px, 0).r : FAR_DEPTH;
+    vec4 p = u_invViewProj * vec4(2.0 * (vec2(px) + 0.5) / vec2(u_viewSize) - 1.0, ndcDepth(depth), 1);
+    vec3 bgPos = p.xyz / p.w;
+
+    uint tileInd = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    uint numDecals = min(b_tiles[tileInd].numDecals, MAX_DECALS_PER_TILE);
+    vec3 color = vec3(0);
+    float transmittance = 1.0;
+    for(uint base = 0u; base < numDecals; base += CHUNK_SIZE) {
+        uint j = base + gl_LocalInvocationIndex;
+        if(j < numDecals) {
+            Instance inst = b_instances[b_tileDecals[tileInd * MAX_DECALS_PER_TILE + j]];
+            vec2 params = unpackHalf2x16(inst.params);
+            float radiusScale, fade;
+            decalAnimation(inst.spawnTime, params.x, radiusScale, fade);
+            s_spheres[gl_LocalInvocationIndex] = vec4(inst.sphere.xyz, inst.sphere.w * radiusScale);
+            s_rotations[gl_LocalInvocationIndex] = instanceRotation(inst);
+            int octaves = decalOctaves(decalScreenRadius(inst.sphere));
+            s_fadeIntensityMaterial[gl_LocalInvocationIndex] = vec4(fade, params.y, uintBitsToFloat(instanceMaterial(inst)), octaves);
+            s_shapes[gl_LocalInvocationIndex] = vec4(inst.extents, uintBitsToFloat(inst.shape));
+        }
+        barrier();
+        if(depth != FAR_DEPTH) {
+            uint n = min(CHUNK_SIZE, numDecals - base);
+            for(uint k = 0u; k < n; k++) {
+                vec4 sphere = s_spheres[k];
+                vec3 toP = bgPos - sphere.xyz;
+                vec4 fim = s_fadeIntensityMaterial[k];
+                if(dot(toP, toP) > sphere.w * sphere.w || fim.x == 0.0)
+                    continue;
+                vec4 shape = s_shapes[k];
+                float falloff = decalShapeFalloff(bgPos, sphere, s_rotations[k], floatBitsToUint(shape.w), shape.xyz);
+                if(falloff < 0.0)
+                    continue;
+                uint materialInd = floatBitsToUint(fim.z);
+                float a = decalAlpha(bgPos, sphere, s_rotations[k], falloff, fim.x, fim.y, materialInd, int(fim.w));
+                color = mix(color, u_materials[materialInd].color.rgb, a);
+                transmittance *= 1.0 - a;
+            }
+        }
+        barrier();
+    }
+
+#if TILE_HEATMAP
+    // with all the binned decals, the tiles that dropped some are white
+    numDecals = b_tiles[tileInd].numDecals;
+    float t = clamp(float(numDecals) / 64.0, 0.0, 1.0);
+    color = 0.5 * mix(vec3(0, 0, 1), vec3(1, 0, 0), t) * float(numDecals > 0u);
+    if(numDecals > MAX_DECALS_PER_TILE)
+        color = vec3(0.5);
+    transmittance = numDecals > 0u ? 0.5 : 1.0;
+#endif
+    if(inside)
+        imageStore(u_outImg, px, vec4(color, transmittance));
+}
+)GLSL";
+
+// Bakes decals into a page of the scorch atlas: the static meshes are rasterized with their lightmap UVs as positions, so each texel
+// of the page gets the world position of its surface. The decals are listed in the instance buffer, they are all grown and don't fade
+// Blended with glBlendFuncSeparate(GL_ONE, GL_SRC_ALPHA, GL_ZERO, GL_SRC_ALPHA), so they are stacked over what was already baked
+ConstStr scorch_bake_vert = R"GLSL(
+layout(location = 0)in vec3 a_pos;
+layout(location = 4)in vec2 a_lmTexel;
+
+out vec3 v_pos;
+
+uniform mat4 u_modelMtx;
+uniform vec2 u_pageOrigin; // virtual texel of the corner of the page, including the border
+
+void main()
+{
+    v_pos = (u_modelMtx * vec4(a_pos, 1)).xyz;
+    gl_Position = vec4(2.0 * (a_lmTexel - u_pageOrigin) / float(SCORCH_PAGE_SIZE + 2 * SCORCH_PAGE_BORDER) - 1.0, 0, 1);
+}
+)GLSL";
+
+ConstStr scorch_bake_frag = R"GLSL(
+layout(location = 0) out vec4 o_color;
+
+layout(std430, binding = 0) readonly buffer Instances {
+    Instance b_instances[];
+};
+
+in vec3 v_pos;
+
+uniform uint u_firstDecal;
+uniform uint u_numDecals;
+
+void main()
+{
+    vec3 color = vec3(0);
+    float transmittance = 1.0;
+    for(uint i = u_firstDecal; i < u_firstDecal + u_numDecals; i++) {
+        Instance inst = b_instances[i];
+        vec3 toP = v_pos - inst.sphere.xyz;
+        if(dot(toP, toP) > inst.sphere.w * inst.sphere.w)
+            continue;
+        vec4 rotation = instanceRotation(inst);
+        float falloff = decalShapeFalloff(v_pos, inst.sphere, rotation, inst.shape, inst.extents);
+        if(falloff < 0.0)
+            continue;
+        uint materialInd = instanceMaterial(inst);
+        float a = decalAlpha(v_pos, inst.sphere, rotation, falloff, 1.0, unpackHalf2x16(inst.params).y, materialInd, 4);
+        color = mix(color, u_materials[materialInd].color.rgb, a);
+        transmittance *= 1.0 - a;
+    }
+    o_color = vec4(color, transmittance);
+}
+)GLSL";
+
+ConstStr fullscreen_vert = R"GLSL(
+void main()
+{
+    // a triangle that covers the screen
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(2.0 * p - 1.0, 0, 1);
+}
+)GLSL";
+
+// The decal layer (rgb: decal color, a: transmittance) is blended with glBlendFunc(GL_ONE, GL_SRC_ALPHA): scene * transmittance + color
+ConstStr decal_composite_frag = R"GLSL(
+layout(location = 0) out vec4 o_color;
+uniform sampler2D u_tex;
+void main()
+{
+    o_color = texelFetch(u_tex, ivec2(gl_FragCoord.xy), 0);
+}
+)GLSL";
+
+// Downsamples the depth for the low resolution decal pass. Each texel takes the min or the max depth of its block, in a checkerboard pattern,
+// so both sides of the geometry edges are represented and the upsample can find a sample on the same surface
+// The layer size is rounded up, so the blocks are not exactly u_factor pixels apart
+ConstStr decal_depth_downsample_frag = R"GLSL(
+uniform sampler2D u_depthTex; // full resolution
+uniform int u_factor;
+uniform ivec2 u_layerSize;
+void main()
+{
+    ivec2 px = ivec2(gl_FragCoord.xy);
+    ivec2 screenSize = textureSize(u_depthTex, 0);
+    ivec2 base = ivec2(vec2(px) * vec2(screenSize) / vec2(u_layerSize));
+    float minDepth = 1.0, maxDepth = 0.0;
+    for(int y = 0; y < u_factor; y++)
+    for(int x = 0; x < u_factor; x++) {
+        float depth = texelFetch(u_depthTex, min(base + ivec2(x, y), screenSize - 1), 0).r;
+        minDepth = min(minDepth, depth);
+        maxDepth = max(maxDepth, depth);
+    }
+    gl_FragDepth = ((px.x + px.y) & 1) == 0 ? minDepth : maxDepth;
+}
+)GLSL";
+
+// Composites the low resolution decal layer. Bilinear, but the weights of the samples that are on a different surface than the pixel
+// are reduced, so the decals don't bleed over the geometry edges
+ConstStr decal_upsample_frag = R"GLSL(
+layout(location = 0) out vec4 o_color;
+uniform sampler2D u_layerTex;
+uniform sampler2D u_layerDepthTex;
+uniform sampler2D u_depthTex; // full resolution
+uniform ivec2 u_layerSize;
+
+void main()
+{
+    ivec2 px = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(u_depthTex, px, 0).r;
+    if(depth == FAR_DEPTH)
+        discard; // background, no decals
+    float z = linearDepth(depth);
+
+    vec2 layerPos = (vec2(px) + 0.5) * vec2(u_layerSize) / vec2(textureSize(u_depthTex, 0)) - 0.5;
+    ivec2 p0 = ivec2(floor(layerPos));
+    vec2 f = layerPos - vec2(p0);
+    vec4 sum = vec4(0);
+    float weightSum = 0.0;
+    vec4 closest = vec4(0, 0, 0, 1);
+    float closestDiff = 1e9;
+    for(int i = 0; i < 4; i++) {
+        ivec2 o = ivec2(i & 1, i >> 1);
+        ivec2 p = clamp(p0 + o, ivec2(0), u_layerSize - 1);
+        vec4 layer = texelFetch(u_layerTex, p, 0);
+        float diff = abs(linearDepth(texelFetch(u_layerDepthTex, p, 0).r) - z) / z;
+        vec2 bilinear = mix(1.0 - f, f, vec2(o));
+        float weight = bilinear.x * bilinear.y / (diff + 0.01);
+        sum += weight * layer;
+        weightSum += weight;
+        if(diff < closestDiff) {
+            closestDiff = diff;
+            closest = layer;
+        }
+    }
+    // when none of the samples are on the same surface, blurring would create halos. Take the closest in depth instead
+    o_color = closestDiff > 0.05 ? closest : sum / max(weightSum, 1e-6);
+}
+)GLSL";
+
+}
+
+static u32 fbo;
+static u32 fb_colorRbo, fb_depthTex;
+
+struct GltfGpuResources {
+    std::vector<u32> buffers;
+    std::vector<u32> textures;
+    std::vector<std::vector<u32>> vaos; //[meshInd][primitiveInd]
+};
+
+GltfGpuResources modelResources;
+
+struct SceneShader {
+    u32 prog;
+    struct Locs {
+        u32 modelMtx,
+            modelView,
+            modelViewProj,
+            tex,
+            scorchAtlas,
+            scorchPageTable,
+            roughness;
+    } locs;
+};
+
+// uniforms of lod_common
+struct LodLocs {
+    u32 pixelScale,
+        minPixels,
+        meshPixels,
+        octavePixels;
+};
+static LodLocs getLodLocs(u32 prog)
+{
+    return {
+        .pixelScale = u32(glGetUniformLocation(prog, "u_lodPixelScale")),
+        .minPixels = u32(glGetUniformLocation(prog, "u_lodMinPixels")),
+        .meshPixels = u32(glGetUniformLocation(prog, "u_lodMeshPixels")),
+        .octavePixels = u32(glGetUniformLocation(prog, "u_lodOctavePixels")),
+    };
+}
+
+// the shader features are selected with #defines instead of branching on uniforms at runtime
+struct ShaderDefine {
+    const char* name;
+    int value;
+};
+// to be inserted right after shader_srcs::header
+static std::string makeDefinesSrc(std::span<const ShaderDefine> defines)
+{
+    std::string src;
+    for (const ShaderDefine& define : defines)
+        src += "#define " + std::string(define.name) + " " + std::to_string(define.value) + "\n";
+    return src;
+}
+
+// the variants of a shader are compiled the first time they are used, and cached by a key that packs the features
+template <typename Shader>
+struct ShaderVariants {
+    const char* name;
+    u32 numPossible; // number of different keys
+    void (*build)(Shader& shader, u32 key);
+    std::unordered_map<u32, Shader> cache;
+    float compileMs = 0; // of all the compiled variants
+};
+
+template <typename Shader>
+static const Shader& getShaderVariant(ShaderVariants<Shader>& variants, u32 key)
+{
+    auto it = variants.cache.find(key);
+    if (it != variants.cache.end())
+        return it->second;
+    const double startTime = glfwGetTime();
+    Shader& shader = variants.cache[key];
+    variants.build(shader, key);
+    const float ms = 1000 * (glfwGetTime() - startTime);
+    variants.compileMs += ms;
+    printf("Compiled %s variant 0x%x in %.1fms (%zu/%u variants)\n", variants.name, key, ms, variants.cache.size(), variants.numPossible);
+    return shader;
+}
+
+// bits of the decal shader keys
+constexpr u32 DECAL_KEY_DISPLAY_MODE_SHIFT = 0; // 3 bits, EDisplayMode
+constexpr u32 DECAL_KEY_NOISE_BACKEND_SHIFT = 3; // 2 bits, ENoiseBackend
+constexpr u32 DECAL_KEY_LOD_BIT = 1u << 5;
+constexpr u32 DECAL_KEY_VIEW_RAYS_BIT = 1u << 6;
+constexpr u32 DECAL_KEY_SCREEN_QUAD_BIT = 1u << 7;
+constexpr u32 DECAL_KEY_HEATMAP_BIT = 1u << 8; // only for the tiled resolve
+constexpr u32 DECAL_KEY_REVERSE_Z_BIT = 1u << 9;
+constexpr u32 DECAL_KEY_TILE_DEPTH_REJECT_BIT = 1u << 10;
+constexpr u32 DECAL_KEY_DEFERRED_BIT = 1u << 11; // only for the instanced path
+constexpr u32 DECAL_KEY_MSAA_BIT = 1u << 12; // only for the instanced path
+constexpr u32 DECAL_KEY_STENCIL_VOLUMES_BIT = 1u << 13; // only for the instanced path
+
+static std::string makeDecalDefinesSrc(u32 key)
+{
+    const ShaderDefine defines[] = {
+        { "DISPLAY_MODE", int((key >> DECAL_KEY_DISPLAY_MODE_SHIFT) & 7) },
+        { "NOISE_BACKEND", int((key >> DECAL_KEY_NOISE_BACKEND_SHIFT) & 3) },
+        { "DECAL_LOD", (key & DECAL_KEY_LOD_BIT) != 0 },
+        { "VIEW_RAYS", (key & DECAL_KEY_VIEW_RAYS_BIT) != 0 },
+        { "SCREEN_QUAD_PROXY", (key & DECAL_KEY_SCREEN_QUAD_BIT) != 0 },
+        { "TILE_HEATMAP", (key & DECAL_KEY_HEATMAP_BIT) != 0 },
+        { "REVERSE_Z", (key & DECAL_KEY_REVERSE_Z_BIT) != 0 },
+        { "TILE_DEPTH_REJECT", (key & DECAL_KEY_TILE_DEPTH_REJECT_BIT) != 0 },
+        { "DEFERRED", (key & DECAL_KEY_DEFERRED_BIT) != 0 },
+        { "MSAA", (key & DECAL_KEY_MSAA_BIT) != 0 },
+        { "STENCIL_VOLUMES", (key & DECAL_KEY_STENCIL_VOLUMES_BIT) != 0 },
+    };
+    return makeDefinesSrc(defines);
+}
+
+struct DecalShader {
+    u32 prog;
+    struct Locs {
+        u32 invScreenSize,
+            invViewProj,
+            viewProj,
+            time,
+            growDuration,
+            growStart,
+            fadeDuration,
+            depthTex,
+            materialOverride,
+            noiseCubes,
+            view,
+            proj,
+            linearDepthTex,
+            camPos,
+            viewRay00,
+            viewRayDx,
+            viewRayDy,
+            viewSize;
+        LodLocs lod;
+    } locs;
+};
+static void buildDecalShader(DecalShader& shader, u32 key)
+{
+    const std::string defines = makeDecalDefinesSrc(key);
+    const char* vertSrcs[] = { defines.c_str(), shader_srcs::decal_common, shader_srcs::lod_common, shader_srcs::decal_vert };
+    const char* fragSrcs[] = { defines.c_str(), shader_srcs::decal_common, shader_srcs::depth_common, shader_srcs::view_ray_common, shader_srcs::tile_common, shader_srcs::decal_frag };
+    shader.prog = easyCreateShaderProg("decal", vertSrcs, fragSrcs);
+    shader.locs.invScreenSize = glGetUniformLocation(shader.prog, "u_invScreenSize");
+    shader.locs.invViewProj = glGetUniformLocation(shader.prog, "u_invViewProj");
+    shader.locs.viewProj = glGetUniformLocation(shader.prog, "u_viewProj");
+    shader.locs.view = glGetUniformLocation(shader.prog, "u_view");
+    shader.locs.proj = glGetUniformLocation(shader.prog, "u_proj");
+    shader.locs.time = glGetUniformLocation(shader.prog, "u_time");
+    shader.locs.growDuration = glGetUniformLocation(shader.prog, "u_growDuration");
+    shader.locs.growStart = glGetUniformLocation(shader.prog, "u_growStart");
+    shader.locs.fadeDuration = glGetUniformLocation(shader.prog, "u_fadeDuration");
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.materialOverride = glGetUniformLocation(shader.prog, "u_materialOverride");
+    shader.locs.noiseCubes = glGetUniformLocation(shader.prog, "u_noiseCubes");
+    shader.locs.lod = getLodLocs(shader.prog);
+    shader.locs.linearDepthTex = glGetUniformLocation(shader.prog, "u_linearDepthTex");
+    shader.locs.camPos = glGetUniformLocation(shader.prog, "u_camPos");
+    shader.locs.viewRay00 = glGetUniformLocation(shader.prog, "u_viewRay00");
+    shader.locs.viewRayDx = glGetUniformLocation(shader.prog, "u_viewRayDx");
+    shader.locs.viewRayDy = glGetUniformLocation(shader.prog, "u_viewRayDy");
+    shader.locs.viewSize = glGetUniformLocation(shader.prog, "u_viewSize");
+}
+// 5 display modes * 3 noise backends * LOD * view rays * screen quad * reverse Z * tile depth reject * deferred * MSAA * stencil volumes
+static ShaderVariants<DecalShader> decalShaderVariants = { .name = "decal", .numPossible = 5 * 3 * 2 * 2 * 2 * 2 * 2 * 2 * 2 * 2, .build = buildDecalShader };
+
+struct DecalStencilShader {
+    u32 prog;
+    struct Locs {
+        u32 viewProj,
+            time,
+            growDuration,
+            growStart,
+            fadeDuration;
+        LodLocs lod;
+    } locs;
+};
+static void buildDecalStencilShader(DecalStencilShader& shader, u32 key)
+{
+    const std::string defines = makeDecalDefinesSrc(key);
+    const char* vertSrcs[] = { defines.c_str(), shader_srcs::decal_common, shader_srcs::lod_common, shader_srcs::decal_vert };
+    const char* fragSrcs[] = { shader_srcs::decal_stencil_frag };
+    shader.prog = easyCreateShaderProg("decal_stencil", vertSrcs, fragSrcs);
+    shader.locs.viewProj = glGetUniformLocation(shader.prog, "u_viewProj");
+    shader.locs.time = glGetUniformLocation(shader.prog, "u_time");
+    shader.locs.growDuration = glGetUniformLocation(shader.prog, "u_growDuration");
+    shader.locs.growStart = glGetUniformLocation(shader.prog, "u_growStart");
+    shader.locs.fadeDuration = glGetUniformLocation(shader.prog, "u_fadeDuration");
+    shader.locs.lod = getLodLocs(shader.prog);
+}
+// only the LOD changes the vertex shader of the mesh proxies
+static ShaderVariants<DecalStencilShader> decalStencilShaderVariants = { .name = "decal_stencil", .numPossible = 2, .build = buildDecalStencilShader };
+
+struct CullShader {
+    static constexpr u32 WORKGROUP_SIZE = 64;
+    u32 prog;
+    struct Locs {
+        u32 pass,
+            frustumPlanes,
+            numInstances,
+            viewProj,
+            meshLods,
+            tileDepthReject,
+            viewSize;
+        LodLocs lod;
+    } locs;
+};
+static CullShader cullShader;
+
+struct DrawElementsIndirectCommand {
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
+};
+
+// GPU culling of the instanceBuffer (see cull_comp)
+struct GpuCulling {
+    u32 visibleBo = 0; // compacted visible instances, grouped by mesh LOD
+    u32 capacity = 0; // in instances
+    u32 indirectBo = 0; // DrawElementsIndirectCommand, one per mesh LOD
+    u32 instanceLodsBo = 0; // u32 per instance, see cull_comp
+    u32 groupOffsetsBo = 0; // DECAL_MESH_LODS u32 per workgroup of cull_comp
+};
+static GpuCulling gpuCulling;
+
+// the programs that read the depth buffer, besides the decal ones, only have the REVERSE_Z variants. Their key is 0 or 1
+static std::string makeDepthDefinesSrc(u32 reverseZ)
+{
+    const ShaderDefine defines[] = { { "REVERSE_Z", int(reverseZ) } };
+    return makeDefinesSrc(defines);
+}
+
+struct TileDepthShader {
+    u32 prog;
+    struct Locs {
+        u32 depthTex,
+            viewSize,
+            near,
+            far;
+    } locs;
+};
+static void buildTileDepthShader(TileDepthShader& shader, u32 reverseZ)
+{
+    const std::string defines = makeDepthDefinesSrc(reverseZ);
+    const char* srcs[] = { defines.c_str(), shader_srcs::depth_common, shader_srcs::tile_common, shader_srcs::tile_depth_comp };
+    shader.prog = easyCreateComputeProg("tile_depth", srcs);
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.viewSize = glGetUniformLocation(shader.prog, "u_viewSize");
+    shader.locs.near = glGetUniformLocation(shader.prog, "u_near");
+    shader.locs.far = glGetUniformLocation(shader.prog, "u_far");
+}
+static ShaderVariants<TileDepthShader> tileDepthShaderVariants = { .name = "tile_depth", .numPossible = 2, .build = buildTileDepthShader };
+
+struct TileBinShader {
+    u32 prog;
+    struct Locs {
+        u32 view,
+            tanHalfFov,
+            viewSize,
+            useDepthMask;
+    } locs;
+};
+static TileBinShader tileBinShader;
+
+struct TileResolveShader {
+    u32 prog;
+    struct Locs {
+        u32 depthTex,
+            viewSize,
+            invViewProj,
+            time,
+            growDuration,
+            growStart,
+            fadeDuration,
+            noiseCubes,
+            viewProj;
+        LodLocs lod;
+    } locs;
+};
+static void buildTileResolveShader(TileResolveShader& shader, u32 key)
+{
+    const std::string defines = makeDecalDefinesSrc(key);
+    const char* srcs[] = { defines.c_str(), shader_srcs::decal_common, shader_srcs::lod_common, shader_srcs::instance_common, shader_srcs::depth_common, shader_srcs::tile_common, shader_srcs::tile_resolve_comp };
+    shader.prog = easyCreateComputeProg("tile_resolve", srcs);
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.viewSize = glGetUniformLocation(shader.prog, "u_viewSize");
+    shader.locs.invViewProj = glGetUniformLocation(shader.prog, "u_invViewProj");
+    shader.locs.time = glGetUniformLocation(shader.prog, "u_time");
+    shader.locs.growDuration = glGetUniformLocation(shader.prog, "u_growDuration");
+    shader.locs.growStart = glGetUniformLocation(shader.prog, "u_growStart");
+    shader.locs.fadeDuration = glGetUniformLocation(shader.prog, "u_fadeDuration");
+    shader.locs.noiseCubes = glGetUniformLocation(shader.prog, "u_noiseCubes");
+    shader.locs.viewProj = glGetUniformLocation(shader.prog, "u_viewProj");
+    shader.locs.lod = getLodLocs(shader.prog);
+}
+// 3 noise backends * LOD * heatmap * reverse Z
+static ShaderVariants<TileResolveShader> tileResolveShaderVariants = { .name = "tile_resolve", .numPossible = 3 * 2 * 2 * 2, .build = buildTileResolveShader };
+
+struct DecalCompositeShader {
+    u32 prog;
+    struct Locs {
+        u32 tex;
+    } locs;
+};
+static DecalCompositeShader decalCompositeShader;
+
+struct DepthDownsampleShader {
+    u32 prog;
+    struct Locs {
+        u32 depthTex,
+            factor,
+            layerSize;
+    } locs;
+};
+static DepthDownsampleShader depthDownsampleShader;
+
+struct DecalUpsampleShader {
+    u32 prog;
+    struct Locs {
+        u32 layerTex,
+            layerDepthTex,
+            depthTex,
+            layerSize,
+            near,
+            far;
+    } locs;
+};
+static void buildDecalUpsampleShader(DecalUpsampleShader& shader, u32 reverseZ)
+{
+    const std::string defines = makeDepthDefinesSrc(reverseZ);
+    const char* fragSrcs[] = { defines.c_str(), shader_srcs::depth_common, shader_srcs::decal_upsample_frag };
+    const char* vertSrcs[] = { shader_srcs::fullscreen_vert };
+    shader.prog = easyCreateShaderProg("decal_upsample", vertSrcs, fragSrcs);
+    shader.locs.layerTex = glGetUniformLocation(shader.prog, "u_layerTex");
+    shader.locs.layerDepthTex = glGetUniformLocation(shader.prog, "u_layerDepthTex");
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.layerSize = glGetUniformLocation(shader.prog, "u_layerSize");
+    shader.locs.near = glGetUniformLocation(shader.prog, "u_near");
+    shader.locs.far = glGetUniformLocation(shader.prog, "u_far");
+}
+static ShaderVariants<DecalUpsampleShader> decalUpsampleShaderVariants = { .name = "decal_upsample", .numPossible = 2, .build = buildDecalUpsampleShader };
+
+struct LinearDepthShader {
+    u32 prog;
+    struct Locs {
+        u32 depthTex,
+            near,
+            far;
+    } locs;
+};
+static void buildLinearDepthShader(LinearDepthShader& shader, u32 reverseZ)
+{
+    const std::string defines = makeDepthDefinesSrc(reverseZ);
+    const char* fragSrcs[] = { defines.c_str(), shader_srcs::depth_common, shader_srcs::linear_depth_frag };
+    const char* vertSrcs[] = { shader_srcs::fullscreen_vert };
+    shader.prog = easyCreateShaderProg("linear_depth", vertSrcs, fragSrcs);
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.near = glGetUniformLocation(shader.prog, "u_near");
+    shader.locs.far = glGetUniformLocation(shader.prog, "u_far");
+}
+static ShaderVariants<LinearDepthShader> linearDepthShaderVariants = { .name = "linear_depth", .numPossible = 2, .build = buildLinearDepthShader };
+
+struct DeferredLightShader {
+    u32 prog;
+    struct Locs {
+        u32 albedoTex,
+            normalTex,
+            roughnessTex,
+            depthTex,
+            invViewProj,
+            camPos;
+    } locs;
+};
+static void buildDeferredLightShader(DeferredLightShader& shader, u32 reverseZ)
+{
+    const std::string defines = makeDepthDefinesSrc(reverseZ);
+    const char* fragSrcs[] = { defines.c_str(), shader_srcs::depth_common, shader_srcs::lighting_common, shader_srcs::deferred_light_frag };
+    const char* vertSrcs[] = { shader_srcs::fullscreen_vert };
+    shader.prog = easyCreateShaderProg("deferred_light", vertSrcs, fragSrcs);
+    shader.locs.albedoTex = glGetUniformLocation(shader.prog, "u_albedoTex");
+    shader.locs.normalTex = glGetUniformLocation(shader.prog, "u_normalTex");
+    shader.locs.roughnessTex = glGetUniformLocation(shader.prog, "u_roughnessTex");
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.invViewProj = glGetUniformLocation(shader.prog, "u_invViewProj");
+    shader.locs.camPos = glGetUniformLocation(shader.prog, "u_camPos");
+    glUseProgram(shader.prog);
+    glUniform1i(shader.locs.depthTex, 1);
+    glUniform1i(shader.locs.albedoTex, 8);
+    glUniform1i(shader.locs.normalTex, 9);
+    glUniform1i(shader.locs.roughnessTex, 10);
+}
+static ShaderVariants<DeferredLightShader> deferredLightShaderVariants = { .name = "deferred_light", .numPossible = 2, .build = buildDeferredLightShader };
+
+struct MsaaEdgeShader {
+    u32 prog;
+    struct Locs {
+        u32 depthTex,
+            numSamples,
+            near,
+            far;
+    } locs;
+};
+static void buildMsaaEdgeShader(MsaaEdgeShader& shader, u32 reverseZ)
+{
+    const std::string defines = makeDepthDefinesSrc(reverseZ);
+    const char* fragSrcs[] = { defines.c_str(), shader_srcs::depth_common, shader_srcs::msaa_edge_frag };
+    const char* vertSrcs[] = { shader_srcs::fullscreen_vert };
+    shader.prog = easyCreateShaderProg("msaa_edge", vertSrcs, fragSrcs);
+    shader.locs.depthTex = glGetUniformLocation(shader.prog, "u_depthTex");
+    shader.locs.numSamples = glGetUniformLocation(shader.prog, "u_numSamples");
+    shader.locs.near = glGetUniformLocation(shader.prog, "u_near");
+    shader.locs.far = glGetUniformLocation(shader.prog, "u_far");
+    glUseProgram(shader.prog);
+    glUniform1i(shader.locs.depthTex, 1);
+}
+static ShaderVariants<MsaaEdgeShader> msaaEdgeShaderVariants = { .name = "msaa_edge", .numPossible = 2, .build = buildMsaaEdgeShader };
+
+constexpr u32 SCENE_KEY_SCORCH_ATLAS_BIT = 1u << 0;
+constexpr u32 SCENE_KEY_DEFERRED_BIT = 1u << 1; // write the G-buffer instead of lighting
+static std::string makeSceneDefinesSrc(u32 key)
+{
+    const ShaderDefine defines[] = {
+        { "SCORCH_ATLAS", (key & SCENE_KEY_SCORCH_ATLAS_BIT) != 0 },
+        { "DEFERRED", (key & SCENE_KEY_DEFERRED_BIT) != 0 },
+        { "SCORCH_PAGE_SIZE", int(SCORCH_PAGE_SIZE) },
+        { "SCORCH_PAGE_BORDER", int(SCORCH_PAGE_BORDER) },
+    };
+    return makeDefinesSrc(defines);
+}
+
+static void buildSceneShader(SceneShader& shader, u32 key)
+{
+    const std::string defines = makeSceneDefinesSrc(key);
+    const char* vertSrcs[] = { defines.c_str(), shader_srcs::scene_vert };
+    const char* fragSrcs[] = { defines.c_str(), shader_srcs::lighting_common, shader_srcs::scene_frag };
+    shader.prog = easyCreateShaderProg("pbr", vertSrcs, fragSrcs);
+    shader.locs.modelMtx = glGetUniformLocation(shader.prog, "u_modelMtx");
+    shader.locs.modelView = glGetUniformLocation(shader.prog, "u_modelView");
+    shader.locs.modelViewProj = glGetUniformLocation(shader.prog, "u_modelViewProj");
+    shader.locs.tex = glGetUniformLocation(shader.prog, "u_tex");
+    shader.locs.scorchAtlas = glGetUniformLocation(shader.prog, "u_scorchAtlas");
+    shader.locs.scorchPageTable = glGetUniformLocation(shader.prog, "u_scorchPageTable");
+    shader.locs.roughness = glGetUniformLocation(shader.prog, "u_roughness");
+    glUseProgram(shader.prog);
+    glUniform1i(shader.locs.tex, 0);
+    glUniform1i(shader.locs.scorchAtlas, 6);
+    glUniform1i(shader.locs.scorchPageTable, 7);
+}
+static ShaderVariants<SceneShader> sceneShaderVariants = { .name = "scene", .numPossible = 4, .build = buildSceneShader };
+
+struct ScorchBakeShader {
+    u32 prog;
+    struct Locs {
+        u32 modelMtx,
+            pageOrigin,
+            firstDecal,
+            numDecals;
+    } locs;
+};
+static ScorchBakeShader scorchBakeShader;
+
+struct NoiseBakeShader {
+    u32 prog;
+    struct Locs {
+        u32 layer;
+    } locs;
+};
+static NoiseBakeShader noiseBakeShader;
+
+// Buffers of the tiled path (see tile_common). They depend on the screen size, so they are resized in resizeFbo
+constexpr u32 TILE_SIZE = 16; // keep in sync with tile_common
+constexpr u32 MAX_DECALS_PER_TILE = 512;
+struct DecalTiles {
+    u32 tilesBo = 0; // Tile
+    u32 tileDecalsBo = 0; // indices into gpuCulling.visibleBo, MAX_DECALS_PER_TILE per tile
+    u32 numTilesX = 0, numTilesY = 0; // at full resolution, the buffers are sized for this
+    int viewW = 0, viewH = 0; // size of the depth the tiles were last computed from (computeTileDepths)
+    // the tiles that had more than MAX_DECALS_PER_TILE decals, and the decals dropped from them. Copied to a second buffer after the
+    // binning, which the CPU reads once its fence is signaled, so it doesn't wait for the GPU
+    u32 overflowBo = 0; // 2 u32, see tile_bin_comp
+    u32 overflowReadbackBo = 0;
+    GLsync overflowFence = nullptr;
+    u32 overflowTiles = 0, droppedDecals = 0; // latest result
+};
+static DecalTiles decalTiles;
+
+// The decals drawn in a separate target (rgb: decal color, a: transmittance) and then composited over the scene
+// Used by the tiled path and by the low resolution decal pass. The textures have the size of the screen, at low resolution only the bottom left corner is used
+struct DecalLayer {
+    u32 fbo = 0;
+    u32 colorTex = 0;
+    u32 depthTex = 0; // downsampled depth (and stencil), for the low resolution pass
+};
+static DecalLayer decalLayer;
+
+// View space depth of the frame, written by writeLinearDepth and bound to texture unit 5 for any screen space pass that wants it (see view_ray_common)
+// Screen sized, at low resolution only the bottom left corner is used, like the decal layer
+struct LinearDepth {
+    u32 fbo = 0;
+    u32 tex = 0; // R32F
+};
+static LinearDepth linearDepth;
+static u32 emptyVao; // for the fullscreen triangles
+
+// Material of the surfaces for the deferred path (see deferredShading). Screen sized, shares the depth of the main framebuffer
+// The decals blend into the albedo and the roughness, and then deferred_light_frag lights the result into the main framebuffer
+// Bound to the texture units 8 (albedo), 9 (normal) and 10 (roughness) for the lighting pass
+struct GBuffer {
+    u32 fbo = 0;
+    u32 albedoTex = 0; // SRGB8_ALPHA8
+    u32 normalTex = 0; // RGB10_A2, n * 0.5 + 0.5
+    u32 roughnessTex = 0; // R8
+};
+static GBuffer gbuffer;
+
+// Multisampled scene target for the instanced path at full resolution (see msaaSamples). The room and the decals are drawn into it,
+// and then it's resolved into the main framebuffer. The stencil flags the edge pixels for MSAA_DECAL_SHADING_EDGES
+// The depth is a texture, bound to the texture unit 1 (GL_TEXTURE_2D_MULTISAMPLE) for the decals
+struct MsaaTarget {
+    u32 fbo = 0;
+    u32 colorRbo = 0; // SRGB8_ALPHA8, like the main framebuffer
+    u32 depthTex = 0; // same format as fb_depthTex
+    u32 samples = 1; // of the storage, allocated in resizeFbo. 1 when there's none
+    int maxSamples = 1; // supported by both the color and the depth
+};
+static MsaaTarget msaaTarget;
+
+// GPU side of the scorch atlas (see scorch_atlas.hpp). The atlas texture has a layer per physical page, the page table maps the virtual pages to them
+// Bound to the texture units 6 (atlas) and 7 (page table) while drawing the room
+constexpr u32 SCORCH_PHYSICAL_PAGES = 64;
+constexpr u32 SCORCH_LAYER_SIZE = SCORCH_PAGE_SIZE + 2 * SCORCH_PAGE_BORDER;
+constexpr float SCORCH_TEXELS_PER_METER = 128;
+constexpr u32 MAX_SCORCH_BAKES_PER_FRAME = 256; // decals
+// a primitive of a node of the room, with its own lightmap UVs
+struct ScorchMeshInstance {
+    const cgltf_primitive* primitive;
+    u32 vao;
+    mat4 modelMtx;
+    u32 uvBo;
+};
+struct ScorchAtlasGl {
+    u32 atlasTex = 0; // RGBA8 2D array. rgb: decal color, a: transmittance
+    u32 pageTableTex = 0; // R16UI, SCORCH_VIRTUAL_PAGES^2. Physical page + 1, 0 if not resident
+    u32 fbo = 0; // the layer being baked is attached to it
+    u32 decalsBo = 0; // InstancingData of the decals being baked, grouped by page
+    std::vector<ScorchMeshInstance> instances;
+    std::vector<std::vector<u32>> uvBos; // [nodeInd][primitiveInd], 0 for the primitives that have no lightmap UVs
+    u32 numBaked = 0; // decals, since the start
+    u32 numUnfitCharts = 0;
+};
+static ScorchAtlas scorchAtlas;
+static ScorchAtlasGl scorchAtlasGl;
+
+struct Camera {
+    vec3 pos;
+    float heading, pitch;
+};
+static Camera camera = {
+    .pos = {0.873904645, 1.38394725, 2.47491980},
+    .heading = 0.277831912,
+    .pitch = -0.481122792,
+};
+
+struct Sphere {
+    u32 vao, vbo, ebo;
+    u32 instancingVbo;
+    u32 numInds;
+};
+static Sphere sphere;
+
+enum EDecalProxy : int { // keep in sync with decal_vert
+    DECAL_PROXY_ICOSPHERE, // 320 triangles
+    DECAL_PROXY_BOX, // 12 triangles, bounding box of the sphere
+    DECAL_PROXY_SCREEN_QUAD, // 2 triangles, screen space bounding rectangle computed in the vertex shader
+    DECAL_PROXY_COUNT
+};
+constexpr u32 DECAL_MESH_LODS = 3; // keep in sync with lod_common
+// The proxies are drawn with the vao of the sphere, they only replace its vertex buffer (binding 0) and index buffer
+struct ProxyMesh {
+    u32 vbo, ebo;
+    u32 numInds; // of the most detailed level
+    // the icosphere has less subdivided levels after the first one, in the same buffers. The other proxies have only one
+    struct Lod {
+        u32 firstInd, numInds;
+        i32 baseVertex;
+    } lods[DECAL_MESH_LODS];
+    u32 numLods;
+};
+static ProxyMesh proxyMeshes[DECAL_PROXY_COUNT];
+
+static void createProxyMesh(ProxyMesh& mesh, std::span<const vec3> verts, std::span<const u32> inds)
+{
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, verts.size_bytes(), verts.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &mesh.ebo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mesh.ebo); // not GL_ELEMENT_ARRAY_BUFFER, that would change the bound vao
+    glBufferData(GL_COPY_WRITE_BUFFER, inds.size_bytes(), inds.data(), GL_STATIC_DRAW);
+    mesh.numInds = inds.size();
+    mesh.lods[0] = { 0, mesh.numInds, 0 };
+    mesh.numLods = 1;
+}
+
+static void createProxyMeshes()
+{
+    {
+        // subdivisions 2, 1 and 0 (320, 80 and 20 triangles)
+        std::vector<vec3> verts;
+        std::vector<u32> inds;
+        ProxyMesh::Lod lods[DECAL_MESH_LODS];
+        for (u32 lod = 0; lod < DECAL_MESH_LODS; lod++) {
+            u32 numVerts, numInds;
+            createIcoSphereMeshData(numVerts, numInds, nullptr, nullptr, 2 - lod);
+            lods[lod] = { u32(inds.size()), numInds, i32(verts.size()) };
+            verts.resize(verts.size() + numVerts);
+            inds.resize(inds.size() + numInds);
+            createIcoSphereMeshData(numVerts, numInds, verts.data() + lods[lod].baseVertex, inds.data() + lods[lod].firstInd, 2 - lod);
+            // the vertices are on the unit sphere, so the faces cut into it (the icosahedron only reaches 0.795 of the radius)
+            // scaled by 1 / inradius, the mesh encloses the sphere and the decals are not clipped to a polygon
+            vec3* lodVerts = verts.data() + lods[lod].baseVertex;
+            const u32* lodInds = inds.data() + lods[lod].firstInd;
+            float inradius = 1;
+            for (u32 i = 0; i < numInds; i += 3) {
+                const vec3 a = lodVerts[lodInds[i]], b = lodVerts[lodInds[i + 1]], c = lodVerts[lodInds[i + 2]];
+                inradius = glm::min(inradius, abs(dot(normalize(cross(b - a, c - a)), a)));
+            }
+            for (u32 i = 0; i < numVerts; i++)
+                lodVerts[i] /= inradius;
+        }
+        ProxyMesh& mesh = proxyMeshes[DECAL_PROXY_ICOSPHERE];
+        createProxyMesh(mesh, verts, inds);
+        mesh.numInds = lods[0].numInds;
+        std::copy(lods, lods + DECAL_MESH_LODS, mesh.lods);
+        mesh.numLods = DECAL_MESH_LODS;
+    }
+    // the corner i is at (i & 1, (i >> 1) & 1, (i >> 2) & 1), mapped to +-1. Counter-clockwise from the outside, like the sphere
+    vec3 boxVerts[8];
+    for (u32 i = 0; i < 8; i++)
+        boxVerts[i] = vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * 2.f - 1.f;
+    const u32 boxInds[] = {
+        4, 6, 2, 4, 2, 0,   1, 3, 7, 1, 7, 5, // -x, +x
+        0, 1, 5, 0, 5, 4,   6, 7, 3, 6, 3, 2, // -y, +y
+        2, 3, 1, 2, 1, 0,   4, 5, 7, 4, 7, 6, // -z, +z
+    };
+    createProxyMesh(proxyMeshes[DECAL_PROXY_BOX], boxVerts, boxInds);
+    // only xy matters, they select the corner of the bounding rectangle. Clockwise, because the decals are drawn with the front faces culled
+    const vec3 quadVerts[] = { {-1, -1, 0}, {1, -1, 0}, {1, 1, 0}, {-1, 1, 0} };
+    const u32 quadInds[] = { 0, 2, 1, 0, 3, 2 };
+    createProxyMesh(proxyMeshes[DECAL_PROXY_SCREEN_QUAD], quadVerts, quadInds);
+}
+
+enum EInstanceUpload : int {
+    INSTANCE_UPLOAD_ORPHAN, // rebuild a std::vector and re-specify the buffer with glBufferData every frame
+    INSTANCE_UPLOAD_RING, // write directly into a mapped ring buffer, synchronized with fences
+    INSTANCE_UPLOAD_INCREMENTAL, // keep all the instances in a GPU buffer and only upload the ranges that changed
+};
+static EInstanceUpload instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+
+// The ring is split in INSTANCE_RING_FRAMES regions, one per frame in flight
+// Before writing to a region we wait for the fence that was placed after the last draw that read it
+constexpr u32 INSTANCE_RING_FRAMES = 3;
+struct InstanceRing {
+    u32 bo = 0;
+    u32 capacity = 0; // in instances, per region
+    InstancingData* mappedPtr = nullptr; // persistent mapping (when glBufferStorage is available)
+    GLsync fences[INSTANCE_RING_FRAMES] = {};
+    u32 region = 0;
+};
+static InstanceRing instanceRing;
+
+// Mirror of the decal pool in GPU memory, indexed like the pool. Kept up to date with the pool's dirty ranges
+struct InstanceBuffer {
+    u32 bo = 0;
+    u32 capacity = 0; // in instances
+    bool valid = false; // false when the contents are stale and everything needs to be uploaded
+};
+static InstanceBuffer instanceBuffer;
+static std::vector<DecalRange> dirtyRanges;
+
+struct InstanceUploadStats {
+    float cpuMs = 0; // smoothed CPU time spent building and uploading the instancing data
+    u32 stalls = 0; // times the CPU had to wait for the GPU to release a ring region
+    u32 uploadedBytes = 0; // bytes sent to the GPU in the last frame
+    u32 uploadedRanges = 0; // number of upload calls in the last frame
+};
+static InstanceUploadStats instanceUploadStats;
+
+// Samples drawn by the decal pass, measured with occlusion queries that are read a couple of frames later so we never wait for them
+constexpr u32 DECAL_SAMPLES_QUERIES = 2;
+struct DecalSamplesStats {
+    u32 queries[DECAL_SAMPLES_QUERIES] = {};
+    u32 frame = 0;
+    u64 samples = 0;
+};
+static DecalSamplesStats decalSamplesStats;
+
+// GL_TIME_ELAPSED queries in a ring. Like the samples queries, they are read a few frames later so we never wait for the GPU
+constexpr u32 GPU_TIMER_QUERIES = 4;
+struct GpuTimer {
+    u32 queries[GPU_TIMER_QUERIES] = {};
+    u32 frame = 0;
+    float ms = 0; // latest result
+};
+static GpuTimer decalPassTimer;
+static GpuTimer scenePassTimer; // drawing the room (into the G-buffer, in the deferred path)
+static GpuTimer lightingPassTimer; // only in the deferred path
+
+static void createGpuTimer(GpuTimer& timer)
+{
+    glGenQueries(GPU_TIMER_QUERIES, timer.queries);
+}
+
+static void beginGpuTimer(GpuTimer& timer)
+{
+    const u32 query = timer.queries[timer.frame % GPU_TIMER_QUERIES];
+    if (timer.frame >= GPU_TIMER_QUERIES) {
+        u32 available;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            u64 ns;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+            timer.ms = 1e-6f * ns;
+        }
+    }
+    timer.frame++;
+    glBeginQuery(GL_TIME_ELAPSED, query);
+}
+
+static void endGpuTimer()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+// Same as GpuTimer, for the pipeline statistics queries. Does nothing when they are not supported (queries[0] == 0)
+struct GpuCounter {
+    GLenum target = 0;
+    u32 queries[GPU_TIMER_QUERIES] = {};
+    u32 frame = 0;
+    u64 value = 0; // latest result
+};
+static GpuCounter decalShadeInvocations; // fragment shader invocations of the shading pass
+static GpuCounter decalMarkInvocations; // fragment shader invocations of the stencil marking pass
+static GpuCounter decalVertexInvocations; // vertex shader invocations of the shading pass
+
+static void createGpuCounter(GpuCounter& counter, GLenum target)
+{
+    counter.target = target;
+    if (glHasPipelineStatistics)
+        glGenQueries(GPU_TIMER_QUERIES, counter.queries);
+}
+
+static void beginGpuCounter(GpuCounter& counter)
+{
+    if (!counter.queries[0])
+        return;
+    const u32 query = counter.queries[counter.frame % GPU_TIMER_QUERIES];
+    if (counter.frame >= GPU_TIMER_QUERIES) {
+        u32 available;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &counter.value);
+    }
+    counter.frame++;
+    glBeginQuery(counter.target, query);
+}
+
+static void endGpuCounter(const GpuCounter& counter)
+{
+    if (counter.queries[0])
+        glEndQuery(counter.target);
+}
+
+struct FrameStats {
+    float frameMs = 0; // CPU time between the last two frames
+    u32 decalDrawCalls = 0;
+};
+static FrameStats frameStats;
+
+// Renders a number of frames with each configuration and averages the timings
+struct BenchmarkResult {
+    std::string config;
+    float frameMs;
+    float decalGpuMs;
+    float decalDrawCalls;
+    std::string notes;
+};
+struct Benchmark {
+    std::vector<std::string> configs;
+    std::function<void(int config)> apply; // sets up a configuration. Called with -1 at the end, to restore the state
+    std::function<std::string(int config)> report; // optional, called after the last measured frame of each config. Goes to the notes column
+    int warmupFrames = 10; // frames skipped after applying a config, the GPU timers lag behind
+    int measuredFrames = 60;
+
+    int config = -1; // the config being measured, -1 when not running
+    int frame = 0;
+    double frameMsSum = 0, decalGpuMsSum = 0, decalDrawCallsSum = 0;
+    std::vector<BenchmarkResult> results;
+};
+static Benchmark* runningBenchmark = nullptr;
+
+static void startBenchmark(Benchmark& b)
+{
+    assert(!runningBenchmark);
+    runningBenchmark = &b;
+    b.results.clear();
+    b.config = 0;
+    b.frame = 0;
+    b.frameMsSum = b.decalGpuMsSum = b.decalDrawCallsSum = 0;
+    b.apply(0);
+    glfwSwapInterval(0); // with vsync, every config faster than the refresh rate would take the same frame time
+}
+
+// call at the end of every frame
+static void updateBenchmark()
+{
+    if (!runningBenchmark)
+        return;
+    Benchmark& b = *runningBenchmark;
+    b.frame++;
+    if (b.frame > b.warmupFrames) {
+        b.frameMsSum += frameStats.frameMs;
+        b.decalGpuMsSum += decalPassTimer.ms;
+        b.decalDrawCallsSum += frameStats.decalDrawCalls;
+    }
+    if (b.frame < b.warmupFrames + b.measuredFrames)
+        return;
+
+    const double n = b.measuredFrames;
+    b.results.push_back({ b.configs[b.config], float(b.frameMsSum / n), float(b.decalGpuMsSum / n), float(b.decalDrawCallsSum / n) });
+    BenchmarkResult& r = b.results.back();
+    if (b.report)
+        r.notes = b.report(b.config);
+    printf("%-40s frame: %7.3fms, decal pass GPU: %7.3fms, decal draw calls: %.0f %s\n", r.config.c_str(), r.frameMs, r.decalGpuMs, r.decalDrawCalls, r.notes.c_str());
+    b.config++;
+    b.frame = 0;
+    b.frameMsSum = b.decalGpuMsSum = b.decalDrawCallsSum = 0;
+    if (b.config < int(b.configs.size())) {
+        b.apply(b.config);
+    }
+    else {
+        b.config = -1;
+        b.apply(-1);
+        runningBenchmark = nullptr;
+        glfwSwapInterval(1);
+    }
+}
+
+static void drawBenchmarkUi(const char* id, Benchmark& b)
+{
+    ImGui::PushID(id);
+    ImGui::BeginDisabled(runningBenchmark != nullptr);
+    if (ImGui::Button("run benchmark"))
+        startBenchmark(b);
+    ImGui::EndDisabled();
+    if (b.config >= 0) {
+        ImGui::SameLine();
+        ImGui::Text("running %d/%zu...", b.config + 1, b.configs.size());
+    }
+    if (b.results.size() && ImGui::BeginTable("results", b.report ? 5 : 4, ImGuiTableFlags_Borders)) {
+        ImGui::TableSetupColumn("config");
+        ImGui::TableSetupColumn("frame ms");
+        ImGui::TableSetupColumn("decal GPU ms");
+        ImGui::TableSetupColumn("draw calls");
+        if (b.report)
+            ImGui::TableSetupColumn("notes");
+        ImGui::TableHeadersRow();
+        for (const auto& r : b.results) {
+            ImGui::TableNextColumn(); ImGui::TextUnformatted(r.config.c_str());
+            ImGui::TableNextColumn(); ImGui::Text("%.3f", r.frameMs);
+            ImGui::TableNextColumn(); ImGui::Text("%.3f", r.decalGpuMs);
+            ImGui::TableNextColumn(); ImGui::Text("%.0f", r.decalDrawCalls);
+            if (b.report) {
+                ImGui::TableNextColumn(); ImGui::TextUnformatted(r.notes.c_str());
+            }
+        }
+        ImGui::EndTable();
+    }
+    ImGui::PopID();
+}
+
+enum EDecalPath : int {
+    DECAL_PATH_INSTANCED, // rasterize a sphere per decal
+    DECAL_PATH_TILED, // bin the decals into screen tiles and resolve them in a compute pass
+};
+
+enum EDecalResolution : int {
+    DECAL_RESOLUTION_FULL,
+    DECAL_RESOLUTION_HALF,
+    DECAL_RESOLUTION_QUARTER,
+};
+
+// how often the decal shader runs in the multisampled target (see MsaaTarget)
+enum EMsaaDecalShading : int {
+    MSAA_DECAL_SHADING_PIXEL, // once per pixel, the color goes to all the covered samples
+    MSAA_DECAL_SHADING_EDGES, // per sample on the edge pixels (msaa_edge_frag), per pixel elsewhere
+    MSAA_DECAL_SHADING_SAMPLE, // per sample everywhere
+};
+
+enum ENoiseBackend : int { // keep in sync with decal_common
+    NOISE_BACKEND_ALU, // simplex noise with the sin based hash, evaluated per pixel. The reference
+    NOISE_BACKEND_ALU_INT_HASH, // same, with an integer hash
+    NOISE_BACKEND_CUBEMAP, // baked into a cubemap per material
+};
+
+enum EDisplayMode : int {
+    DISPLAY_MODE_DEFAULT,
+    DISPLAY_MODE_CIRCLE,
+    DISPLAY_MODE_SPHERE,
+    DISPLAY_MODE_SPHERE_NOISE,
+    DISPLAY_MODE_LOD, // green to red as the LOD drops
+};
+
+struct Params {
+    bool frustumCulling; // on the GPU for INSTANCE_UPLOAD_INCREMENTAL, on the CPU for the other modes
+    float sphereRad;
+    float lifetime;
+    float growDuration;
+    float growStart;
+    float fadeDuration;
+    int material; // of the new decals, -1 means random
+    EDecalShape shape; // of the new decals
+    vec3 shapeProportions; // of the new decals, see fitDecalShapeExtents()
+    bool drawPerMaterial; // one draw call per material instead of using the palette (for the CPU upload paths)
+    EDisplayMode displayMode;
+    EDecalPath decalPath;
+    ENoiseBackend noiseBackend;
+    EDecalResolution decalResolution; // the decals are drawn at 1 / (1 << decalResolution) of the screen resolution
+    EDecalProxy decalProxy; // geometry rasterized for each decal (instanced path)
+    bool viewRays; // the decals reconstruct the positions from a linear depth prepass and the frustum corner rays (instanced path)
+    bool stencilVolumes; // mark the pixels whose surface is inside of a sphere in the stencil first, and only shade those (instanced path)
+    bool tileDepthMask; // also reject the decals that fall in the gaps between the surfaces of a tile
+    bool tileHeatmap;
+    // screen size LOD, the thresholds are screen radiuses in pixels (see lod_common)
+    bool lod;
+    float lodMinPixels;
+    vec2 lodMeshPixels;
+    float lodOctavePixels;
+    bool reverseZ; // float depth buffer, 1 at the near plane and 0 at the far plane. Needs glClipControl
+    bool scorchAtlas; // bake the settled decals into the scorch atlas and remove them from the pool (see scorch_atlas.hpp). Turning it off only
+                      // stops the baking, the baked ones are drawn while the atlas has resident pages
+    float scorchBakeDelay; // seconds since a decal finished growing until it's baked
+    bool frameCache; // only redraw what changed since the last frame (see FrameCache)
+    bool tileDepthReject; // skip the decals and the decal fragments where the surfaces of the screen tiles are out of the sphere's depth range (instanced path)
+    bool deferred; // the room writes a G-buffer, the decals modify it and then it's lit once (instanced path at full resolution, see deferredShading)
+    int msaaSamples; // 1 is no MSAA (instanced path at full resolution, see msaaSamples())
+    EMsaaDecalShading msaaDecalShading;
+
+    bool operator==(const Params&) const = default;
+};
+// The palette is in a UBO and each instance has an index into it, so decals with different materials can be drawn in the same call
+constexpr u32 MAX_DECAL_MATERIALS = 16; // keep in sync with decal_frag
+struct DecalMaterial {
+    float noiseFreq;
+    float centerBase; // base darkness so the decal is not too dim, specially at the center
+    float exponent; // exponent for the distance attenuation
+    float roughness; // that the decal leaves on the surface, only in the deferred path
+    vec4 color; // rgb: color of the burn
+};
+static_assert(sizeof(DecalMaterial) == 32); // std140
+static DecalMaterial decalMaterials[MAX_DECAL_MATERIALS];
+static u32 decalMaterialsUbo;
+static char decalMaterialNames[MAX_DECAL_MATERIALS][16] = { "default", "grenade", "rocket", "scorch" };
+
+static void initDecalMaterials()
+{
+    decalMaterials[0] = { .noiseFreq = 7, .centerBase = 1.5, .exponent = 1.5, .roughness = 1, .color = vec4(0, 0, 0, 1) };
+    decalMaterials[1] = { .noiseFreq = 10, .centerBase = 1.2, .exponent = 2, .roughness = 0.9, .color = vec4(0.06, 0.05, 0.04, 1) };
+    decalMaterials[2] = { .noiseFreq = 4, .centerBase = 1.8, .exponent = 1.1, .roughness = 0.7, .color = vec4(0.1, 0.04, 0.01, 1) };
+    decalMaterials[3] = { .noiseFreq = 14, .centerBase = 1, .exponent = 2.5, .roughness = 1, .color = vec4(0.15, 0.12, 0.1, 1) };
+    // the rest are variations, so there's something to look at when benchmarking many materials
+    for (u32 i = 4; i < MAX_DECAL_MATERIALS; i++) {
+        const float t = float(i - 4) / (MAX_DECAL_MATERIALS - 5);
+        decalMaterials[i] = {
+            .noiseFreq = glm::mix(3.f, 15.f, glm::fract(0.618f * i)),
+            .centerBase = glm::mix(1.f, 2.f, t),
+            .exponent = glm::mix(1.f, 3.f, glm::fract(0.382f * i)),
+            .roughness = glm::mix(0.6f, 1.f, t),
+            .color = vec4(0.12f * t, 0.06f * t, 0.03f * glm::fract(0.5f * i), 1),
+        };
+        snprintf(decalMaterialNames[i], sizeof(decalMaterialNames[i]), "material %u", i);
+    }
+}
+
+// Noise of each material baked into a cubemap array, for NOISE_BACKEND_CUBEMAP
+// The layers are (re)baked when they are first needed or when the frequency of the material changes
+constexpr u32 NOISE_CUBE_SIZE = 256;
+struct NoiseCubes {
+    u32 tex = 0;
+    float bakedFreqs[MAX_DECAL_MATERIALS]; // negative: not baked yet
+    u32 numBaked = 0; // layers baked since the start, for the UI
+};
+static NoiseCubes noiseCubes;
+
+static void createNoiseCubes()
+{
+    glGenTextures(1, &noiseCubes.tex);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, noiseCubes.tex);
+    glTexStorage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 1, GL_R16F, NOISE_CUBE_SIZE, NOISE_CUBE_SIZE, 6 * MAX_DECAL_MATERIALS);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    for (float& freq : noiseCubes.bakedFreqs)
+        freq = -1;
+}
+
+// expects the materials UBO to be up to date and bound
+static void updateNoiseCubes()
+{
+    bool baked = false;
+    for (u32 i = 0; i < MAX_DECAL_MATERIALS; i++) {
+        if (noiseCubes.bakedFreqs[i] == decalMaterials[i].noiseFreq)
+            continue;
+        if (!baked) {
+            glUseProgram(noiseBakeShader.prog);
+            glBindImageTexture(0, noiseCubes.tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16F);
+        }
+        glUniform1ui(noiseBakeShader.locs.layer, i);
+        glDispatchCompute(NOISE_CUBE_SIZE / 8, NOISE_CUBE_SIZE / 8, 6);
+        noiseCubes.bakedFreqs[i] = decalMaterials[i].noiseFreq;
+        noiseCubes.numBaked++;
+        baked = true;
+    }
+    if (baked)
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+static Params params = {
+    .frustumCulling = true,
+    .sphereRad = 0.5,
+    .lifetime = 0,
+    .growDuration = 0.15,
+    .growStart = 0.3,
+    .fadeDuration = 2,
+    .material = 0,
+    .shape = DECAL_SHAPE_SPHERE,
+    .shapeProportions = { 1, 0.4, 0.4 },
+    .drawPerMaterial = false,
+    .displayMode = DISPLAY_MODE_DEFAULT,
+    .decalPath = DECAL_PATH_INSTANCED,
+    .noiseBackend = NOISE_BACKEND_ALU,
+    .decalResolution = DECAL_RESOLUTION_FULL,
+    .decalProxy = DECAL_PROXY_ICOSPHERE,
+    .viewRays = false,
+    .stencilVolumes = false,
+    .tileDepthMask = true,
+    .tileHeatmap = false,
+    .lod = false,
+    .lodMinPixels = 1,
+    .lodMeshPixels = { 48, 12 },
+    .lodOctavePixels = 64,
+    .reverseZ = false,
+    .scorchAtlas = false,
+    .scorchBakeDelay = 1,
+    .frameCache = true,
+    .tileDepthReject = false,
+    .deferred = false,
+    .msaaSamples = 1,
+    .msaaDecalShading = MSAA_DECAL_SHADING_EDGES,
+};
+
+// screen radius in pixels of a sphere of radius 1 at distance 1, for the frame being drawn. 0 when the LOD is disabled
+static float lodPixelScale = 0;
+
+static void setLodUniforms(const LodLocs& locs)
+{
+    glUniform1f(locs.pixelScale, lodPixelScale);
+    glUniform1f(locs.minPixels, params.lodMinPixels);
+    glUniform2fv(locs.meshPixels, 1, &params.lodMeshPixels[0]);
+    glUniform1f(locs.octavePixels, params.lodOctavePixels);
+}
+
+// params.deferred only applies to the instanced path at full resolution, the others composite a decal layer over the lit scene
+static bool deferredShading()
+{
+    return params.deferred && params.decalPath == DECAL_PATH_INSTANCED && params.decalResolution == DECAL_RESOLUTION_FULL;
+}
+
+// samples of the scene target. The decal passes that read the depth as a single sample texture (view rays, tile depths) are skipped with MSAA,
+// and the deferred path has its own single sample G-buffer. The stencil volumes work per sample, but not with MSAA_DECAL_SHADING_EDGES (see useStencilVolumes)
+static u32 msaaSamples()
+{
+    if (params.decalPath != DECAL_PATH_INSTANCED || params.decalResolution != DECAL_RESOLUTION_FULL || deferredShading())
+        return 1;
+    return u32(glm::clamp(params.msaaSamples, 1, msaaTarget.maxSamples));
+}
+
+// the stencil marked sphere volumes of the instanced path. They need closed proxies, so not the screen quads
+// With MSAA they are marked per sample, except with the edge shading, which flags the edge pixels in the same stencil
+static bool useStencilVolumes()
+{
+    return params.stencilVolumes && params.decalPath == DECAL_PATH_INSTANCED && params.displayMode == DISPLAY_MODE_DEFAULT &&
+        params.decalProxy != DECAL_PROXY_SCREEN_QUAD && (msaaSamples() == 1 || params.msaaDecalShading != MSAA_DECAL_SHADING_EDGES);
+}
+
+// the decal shader variant for the current params (see DECAL_KEY_*)
+static u32 decalShaderKey()
+{
+    u32 key = (u32(params.displayMode) << DECAL_KEY_DISPLAY_MODE_SHIFT) | (u32(params.noiseBackend) << DECAL_KEY_NOISE_BACKEND_SHIFT);
+    if (params.lod)
+        key |= DECAL_KEY_LOD_BIT;
+    if (params.viewRays && msaaSamples() == 1)
+        key |= DECAL_KEY_VIEW_RAYS_BIT;
+    if (params.decalProxy == DECAL_PROXY_SCREEN_QUAD)
+        key |= DECAL_KEY_SCREEN_QUAD_BIT;
+    if (params.reverseZ)
+        key |= DECAL_KEY_REVERSE_Z_BIT;
+    if (params.tileDepthReject && msaaSamples() == 1)
+        key |= DECAL_KEY_TILE_DEPTH_REJECT_BIT;
+    if (deferredShading())
+        key |= DECAL_KEY_DEFERRED_BIT;
+    if (msaaSamples() > 1)
+        key |= DECAL_KEY_MSAA_BIT;
+    if (useStencilVolumes())
+        key |= DECAL_KEY_STENCIL_VOLUMES_BIT;
+    return key;
+}
+
+// with reverse Z the closer surfaces have the greater depths, so the depth tests are flipped
+static GLenum depthFuncCloser()
+{
+    return params.reverseZ ? GL_GREATER : GL_LESS;
+}
+static GLenum depthFuncFarther()
+{
+    return params.reverseZ ? GL_LESS : GL_GREATER;
+}
+
+static mat4 makeProjMtx(float aspectRatio)
+{
+    // the near and far planes are swapped, with the depth from 0 to 1 (see glClipControl in the main loop)
+    if (params.reverseZ)
+        return glm::perspectiveRH_ZO(1.f, aspectRatio, CAMERA_FAR_DIST, CAMERA_NEAR_DIST);
+    return glm::perspective(1.f, aspectRatio, CAMERA_NEAR_DIST, CAMERA_FAR_DIST);
+}
+
+// same as decalScreenRadius in lod_common
+static float decalScreenRadius(const mat4& viewProj, vec3 pos, float radius)
+{
+    const float w = viewProj[0][3] * pos.x + viewProj[1][3] * pos.y + viewProj[2][3] * pos.z + viewProj[3][3];
+    return lodPixelScale * radius / glm::max(w - radius, 1e-4f);
+}
+
+static Decals decals;
+static DecalHandle selectedDecal = INVALID_DECAL_HANDLE; // picked with the right mouse button, edited with the gizmo
+static std::vector<u32> visibleSlots, visibleInds; // result of the CPU frustum culling
+
+// gameplay threads send decal commands through this queue. It's drained once per frame, before building the instancing data
+static MpscQueue<DecalCommand> decalCommands(1 << 16);
+
+struct DecalCommandStats {
+    u32 drained = 0; // commands executed in the last frame
+    float drainMs = 0;
+    float avgLatencyMs = 0, maxLatencyMs = 0; // time from push to execution, for the commands drained in the last frame
+    u64 totalDrained = 0;
+};
+static DecalCommandStats decalCommandStats;
+
+// Spawns decals from several producer threads as fast as possible (or at a fixed rate), to stress the command queue
+struct SpawnStress {
+    int numThreads = 4;
+    int spawnsPerSecond = 10000; // per thread, 0 means unlimited
+    float removeChance = 0.1f; // probability of sending a remove command (with a random, probably stale, handle) instead of a spawn
+    float lifetime = 2;
+    std::vector<std::thread> threads;
+    std::atomic<bool> running = false;
+    std::atomic<u64> pushed = 0, rejected = 0; // rejected: the queue was full
+    // throughput, measured from the main thread
+    double lastMeasureTime = 0;
+    u64 lastPushed = 0;
+    float pushesPerSecond = 0;
+};
+static SpawnStress spawnStress;
+
+static void drainDecalCommands()
+{
+    const double startTime = glfwGetTime();
+    DecalCommandStats& stats = decalCommandStats;
+    stats.drained = 0;
+    double latencySum = 0, latencyMax = 0;
+    DecalCommand cmd;
+    // commands pushed while draining wait for the next frame, so the producers can't keep us here forever
+    while (stats.drained < decalCommands.capacity() && decalCommands.tryPop(cmd)) {
+        decals.execute(cmd);
+        const double latency = startTime - cmd.pushTime;
+        latencySum += latency;
+        latencyMax = glm::max(latencyMax, latency);
+        stats.drained++;
+    }
+    stats.totalDrained += stats.drained;
+    stats.avgLatencyMs = stats.drained ? 1000 * latencySum / stats.drained : 0;
+    stats.maxLatencyMs = 1000 * latencyMax;
+    stats.drainMs = 1000 * (glfwGetTime() - startTime);
+}
+
+static void spawnStressProducer(u32 seed)
+{
+    std::minstd_rand rng(seed);
+    std::uniform_real_distribution<float> u01(0, 1);
+    u64 pushed = 0, rejected = 0;
+    const double period = spawnStress.spawnsPerSecond ? 1.0 / spawnStress.spawnsPerSecond : 0;
+    double nextTime = glfwGetTime();
+    while (spawnStress.running.load(std::memory_order_relaxed)) {
+        if (period) {
+            // rate limited: sleep until the next command is due
+            const double t = glfwGetTime();
+            if (t < nextTime) {
+                std::this_thread::sleep_for(std::chrono::duration<double>(nextTime - t));
+                continue;
+            }
+            nextTime += period;
+        }
+
+        DecalCommand cmd = {};
+        if (u01(rng) < spawnStress.removeChance) {
+            cmd.type = DECAL_COMMAND_REMOVE;
+            cmd.handle = { u32(rng() % 0x10000), u32(rng() % 4) };
+        }
+        else {
+            cmd.type = DECAL_COMMAND_SPAWN;
+            cmd.spawn = {
+                .pos = vec3(glm::mix(-2.4f, +2.4f, u01(rng)), 0.045, glm::mix(-2.4f, +2.4f, u01(rng))),
+                .rot = glm::quat_cast(randRotMtx({ u01(rng), u01(rng), u01(rng) })),
+                .radius = glm::mix(0.1f, 0.4f, u01(rng)),
+                .lifetime = spawnStress.lifetime,
+            };
+        }
+        cmd.pushTime = glfwGetTime();
+        if (decalCommands.tryPush(cmd))
+            pushed++;
+        else {
+            rejected++;
+            std::this_thread::yield();
+        }
+
+        // flush the counters from time to time, so the producers don't fight over the cache line
+        if (((pushed + rejected) & 255) == 0) {
+            spawnStress.pushed += pushed;
+            spawnStress.rejected += rejected;
+            pushed = rejected = 0;
+        }
+    }
+    spawnStress.pushed += pushed;
+    spawnStress.rejected += rejected;
+}
+
+static void startSpawnStress()
+{
+    spawnStress.running = true;
+    for (int i = 0; i < spawnStress.numThreads; i++)
+        spawnStress.threads.emplace_back(spawnStressProducer, 1234 + i);
+}
+
+static void stopSpawnStress()
+{
+    spawnStress.running = false;
+    for (auto& thread : spawnStress.threads)
+        thread.join();
+    spawnStress.threads.clear();
+}
+
+static void glfwErrorCallback(int error, const char* description)
+{
+    fprintf(stderr, "Glfw Error %d: %s\n", error, description);
+}
+
+static bool fbReverseZ = false; // the depth format of the textures created in resizeFbo
+
+// Static frame cache: the room is only redrawn when the camera or the scene change. Otherwise its color is restored from a copy, and
+// only the decals are drawn over it (the depth is still the room's, the decals don't write it). When the decals didn't change either,
+// the fbo still has the last frame, so it's just blitted to the window again
+// In the deferred path the decals are blended into the G-buffer before the lighting, and with MSAA they are resolved together with the room,
+// so any change to them redraws everything
+enum EFrameRedraw : int {
+    FRAME_REDRAW_NONE,
+    FRAME_REDRAW_DECALS,
+    FRAME_REDRAW_ALL,
+};
+struct FrameCache {
+    u32 sceneColorTex = 0; // the fbo color after drawing the room, before the decals. Same format and size as the fbo
+    bool sceneValid = false; // cleared by resizeFbo
+    bool sceneDirty = false; // set by the code that changes the room, like the scorch atlas
+    mat4 viewMtx, projMtx;
+    Params params;
+    DecalMaterial materials[MAX_DECAL_MATERIALS];
+    EInstanceUpload instanceUpload;
+    u32 decalChanges = 0; // Decals::numChanges at the last frame
+    float decalsChangeTime = 0; // decals.time when they last changed. The new decals grow during params.growDuration
+    bool deferred = false; // deferredShading() at the last frame
+    u32 numFrames[3] = {}; // per EFrameRedraw, for the UI
+};
+static FrameCache frameCache;
+
+// decides what has to be redrawn this frame, and updates the cached state
+static EFrameRedraw updateFrameCache(const mat4& viewMtx, const mat4& projMtx)
+{
+    const bool sceneChanged = !frameCache.sceneValid || frameCache.sceneDirty ||
+        viewMtx != frameCache.viewMtx || projMtx != frameCache.projMtx ||
+        params.reverseZ != frameCache.params.reverseZ ||
+        deferredShading() != frameCache.deferred;
+    if (decals.numChanges != frameCache.decalChanges)
+        frameCache.decalsChangeTime = decals.time;
+    // the decals are animated on the GPU: they grow after spawning and fade before expiring
+    const bool decalsAnimated = decals.time <= frameCache.decalsChangeTime + params.growDuration ||
+        (decals.expiries.size() && decals.expiries[0].time - params.fadeDuration <= decals.time);
+    const bool decalsChanged = decals.numChanges != frameCache.decalChanges || decalsAnimated || !(params == frameCache.params) ||
+        memcmp(decalMaterials, frameCache.materials, sizeof(decalMaterials)) != 0 || instanceUpload != frameCache.instanceUpload;
+
+    EFrameRedraw redraw = FRAME_REDRAW_NONE;
+    if (!params.frameCache || runningBenchmark || sceneChanged || (decalsChanged && (deferredShading() || msaaSamples() > 1)))
+        redraw = FRAME_REDRAW_ALL;
+    else if (decalsChanged)
+        redraw = FRAME_REDRAW_DECALS;
+    frameCache.sceneValid = true;
+    frameCache.sceneDirty = false;
+    frameCache.viewMtx = viewMtx;
+    frameCache.projMtx = projMtx;
+    frameCache.params = params;
+    memcpy(frameCache.materials, decalMaterials, sizeof(decalMaterials));
+    frameCache.instanceUpload = instanceUpload;
+    frameCache.decalChanges = decals.numChanges;
+    frameCache.deferred = deferredShading();
+    frameCache.numFrames[redraw]++;
+    return redraw;
+}
+
+static void resizeFbo(int w, int h)
+{
+    glBindRenderbuffer(GL_RENDERBUFFER, fb_colorRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_SRGB8_ALPHA8, w, h);
+    glBindTexture(GL_TEXTURE_2D, frameCache.sceneColorTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    frameCache.sceneValid = false;
+
+    // reverse Z only pays off with a float depth: the float precision grows towards 0, which cancels the 1/z distribution of the depth
+    fbReverseZ = params.reverseZ;
+    const GLenum depthFormat = fbReverseZ ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8;
+    const GLenum depthType = fbReverseZ ? GL_FLOAT_32_UNSIGNED_INT_24_8_REV : GL_UNSIGNED_INT_24_8;
+    glBindTexture(GL_TEXTURE_2D, fb_depthTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, depthFormat, w, h, 0, GL_DEPTH_STENCIL, depthType, nullptr);
+
+    decalTiles.numTilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    decalTiles.numTilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+    const u32 numTiles = decalTiles.numTilesX * decalTiles.numTilesY;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, decalTiles.tilesBo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, numTiles * 4 * sizeof(u32), nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, decalTiles.tileDecalsBo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, numTiles * MAX_DECALS_PER_TILE * sizeof(u32), nullptr, GL_DYNAMIC_COPY);
+    glBindTexture(GL_TEXTURE_2D, decalLayer.colorTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, decalLayer.depthTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, depthFormat, w, h, 0, GL_DEPTH_STENCIL, depthType, nullptr);
+    glBindTexture(GL_TEXTURE_2D, linearDepth.tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, w, h, 0, GL_RED, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, gbuffer.albedoTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, gbuffer.normalTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB10_A2, w, h, 0, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, nullptr);
+    glBindTexture(GL_TEXTURE_2D, gbuffer.roughnessTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    msaaTarget.samples = msaaSamples();
+    if (msaaTarget.samples > 1) {
+        glBindRenderbuffer(GL_RENDERBUFFER, msaaTarget.colorRbo);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, msaaTarget.samples, GL_SRGB8_ALPHA8, w, h);
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, msaaTarget.depthTex);
+        glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, msaaTarget.samples, depthFormat, w, h, GL_TRUE);
+        glBindFramebuffer(GL_FRAMEBUFFER, msaaTarget.fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, msaaTarget.colorRbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, msaaTarget.depthTex, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    }
+
+    glViewport(0, 0, w, h);
+    glScissor(0, 0, w, h);
+}
+
+// the lightmap UVs of each mesh instance are in their own buffer, so they are bound to the vao (location 4, TEXCOORD_1) before each draw
+static void bindLightmapUvs(u32 uvBo)
+{
+    if (uvBo) {
+        glBindBuffer(GL_ARRAY_BUFFER, uvBo);
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    }
+    else {
+        glDisableVertexAttribArray(4);
+        glVertexAttrib2f(4, -1, -1); // no scorch
+    }
+}
+
+// expects the vao of the primitive to be bound
+static void drawPrimitive(const cgltf_primitive& primitive)
+{
+    const auto primitiveType = toGl(primitive.type);
+    if (primitive.indices) {
+        const auto& indices = *primitive.indices;
+        const GLenum intType = toGl(indices.component_type);
+        const size_t offset = indices.offset + indices.buffer_view->offset;
+        glDrawElements(primitiveType, primitive.indices->count, intType, (void*)offset);
+    }
+    else {
+        const size_t numVerts = primitive.attributes[0].data->count;
+        glDrawArrays(primitiveType, 0, numVerts);
+    }
+}
+
+static void drawMesh(const cgltf_data& data, const cgltf_node& node,
+    const mat4& viewMtx, const mat4& viewProjMtx, const mat4& modelMtx)
+{
+    const cgltf_mesh& mesh = *node.mesh;
+    const size_t meshInd = &mesh - data.meshes;
+    const size_t nodeInd = &node - data.nodes;
+    const auto modelView = viewMtx * modelMtx;
+    const auto modelViewProj = viewProjMtx * modelMtx;
+    u32 sceneKey = 0;
+    if (scorchAtlas.numResident) // the baked decals are only in the atlas, so it's read even when no more are being baked
+        sceneKey |= SCENE_KEY_SCORCH_ATLAS_BIT;
+    if (deferredShading())
+        sceneKey |= SCENE_KEY_DEFERRED_BIT;
+    const SceneShader& sceneShader = getShaderVariant(sceneShaderVariants, sceneKey);
+
+    for (size_t primitiveInd = 0; primitiveInd < mesh.primitives_count; primitiveInd++) {
+        const auto& primitive = mesh.primitives[primitiveInd];
+        if(primitive.material->double_sided)
+            glDisable(GL_CULL_FACE);
+        else
+            glEnable(GL_CULL_FACE);
+        assert(primitive.material->has_pbr_metallic_roughness);
+        const auto& mr = primitive.material->pbr_metallic_roughness;
+        glUseProgram(sceneShader.prog);
+        glUniformMatrix4fv(sceneShader.locs.modelMtx, 1, GL_FALSE, &modelMtx[0][0]);
+        glUniformMatrix4fv(sceneShader.locs.modelView, 1, GL_FALSE, &modelView[0][0]);
+        glUniformMatrix4fv(sceneShader.locs.modelViewProj, 1, GL_FALSE, &modelViewProj[0][0]);
+        glUniform1f(sceneShader.locs.roughness, mr.roughness_factor);
+        const size_t albedoTexInd = mr.base_color_texture.texture - data.textures;
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, modelResources.textures[albedoTexInd]);
+        const u32 vao = modelResources.vaos[meshInd][primitiveInd];
+        glBindVertexArray(vao);
+        bindLightmapUvs(scorchAtlasGl.uvBos[nodeInd][primitiveInd]);
+        drawPrimitive(primitive);
+    }
+}
+
+static void drawNodeRecursive(const cgltf_data& data, const cgltf_node& node,
+    const mat4& viewMtx, const mat4& viewProjMtx, const mat4& parentModelMtx = mat4(1))
+{
+    mat4 modelMtx;
+    cgltf_node_transform_local(&node, &modelMtx[0][0]);
+    modelMtx = parentModelMtx * modelMtx;
+    
+    if (node.mesh)
+        drawMesh(data, node, viewMtx, viewProjMtx, modelMtx);
+    for (size_t childInd = 0; childInd < node.children_count; childInd++)
+        drawNodeRecursive(data, *node.children[childInd], viewMtx, viewProjMtx, modelMtx);
+}
+
+static void destroyInstanceRing()
+{
+    for (GLsync& fence : instanceRing.fences) {
+        if (fence) {
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+    if (instanceRing.bo) {
+        if (instanceRing.mappedPtr) {
+            glBindBuffer(GL_ARRAY_BUFFER, instanceRing.bo);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        glDeleteBuffers(1, &instanceRing.bo);
+    }
+    instanceRing = {};
+}
+
+static void createInstanceRing(u32 capacity)
+{
+    destroyInstanceRing();
+    instanceRing.capacity = capacity;
+    const size_t size = INSTANCE_RING_FRAMES * capacity * sizeof(InstancingData);
+    glGenBuffers(1, &instanceRing.bo);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceRing.bo);
+    if (glBufferStorage) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        instanceRing.mappedPtr = (InstancingData*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    }
+    else {
+        // fallback for GL 4.3 drivers: the regions get mapped unsynchronized every frame, the fences still protect them
+        glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+}
+
+// returns where to write the instancing data for this frame. The ring grows if needed
+static InstancingData* beginInstanceRingRegion(u32 numInstances, size_t& offset)
+{
+    if (numInstances > instanceRing.capacity)
+        createInstanceRing(glm::max(2 * instanceRing.capacity, numInstances));
+
+    const u32 region = instanceRing.region;
+    if (GLsync& fence = instanceRing.fences[region]) {
+        GLenum res = glClientWaitSync(fence, 0, 0);
+        if (res == GL_TIMEOUT_EXPIRED) {
+            instanceUploadStats.stalls++;
+            res = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        }
+        assert(res != GL_WAIT_FAILED);
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    offset = region * instanceRing.capacity * sizeof(InstancingData);
+    if (instanceRing.mappedPtr)
+        return instanceRing.mappedPtr + region * instanceRing.capacity;
+    glBindBuffer(GL_ARRAY_BUFFER, instanceRing.bo);
+    return (InstancingData*)glMapBufferRange(GL_ARRAY_BUFFER, offset, glm::max(numInstances, 1u) * sizeof(InstancingData),
+        GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+static void endInstanceRingRegion()
+{
+    if (!instanceRing.mappedPtr) {
+        glBindBuffer(GL_ARRAY_BUFFER, instanceRing.bo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+}
+
+// call after the draw calls that read the current region have been issued
+static void fenceInstanceRingRegion()
+{
+    instanceRing.fences[instanceRing.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    instanceRing.region = (instanceRing.region + 1) % INSTANCE_RING_FRAMES;
+}
+
+static InstancingData makeInstancingData(u32 i)
+{
+    const glm::quat q = decals.rotations[i].w < 0 ? -decals.rotations[i] : decals.rotations[i];
+    return {
+        .pos = decals.positions[i],
+        .radius = decals.radiuses[i],
+        .rot = { i16(glm::packSnorm1x16(q.x)), i16(glm::packSnorm1x16(q.y)), i16(glm::packSnorm1x16(q.z)) },
+        .material = decals.materials[i],
+        .spawnTime = decals.spawnTimes[i],
+        .params = { glm::packHalf1x16(decals.lifetimes[i]), glm::packHalf1x16(decals.intensities[i]) },
+        .extents = decals.extents[i],
+        .shape = decals.shapes[i],
+    };
+}
+
+// writes the instancing data of the decals [begin, end) to dst[0, end - begin)
+static void writeInstancingData(InstancingData* dst, u32 begin, u32 end)
+{
+    for (u32 i = begin; i < end; i++)
+        dst[i - begin] = makeInstancingData(i);
+}
+
+static void writeInstancingData(InstancingData* dst, std::span<const u32> inds)
+{
+    for (size_t i = 0; i < inds.size(); i++)
+        dst[i] = makeInstancingData(inds[i]);
+}
+
+static std::vector<u32> materialSortedInds;
+static u32 materialInstanceOffsets[MAX_DECAL_MATERIALS + 1]; // the instances of material m are [offsets[m], offsets[m + 1]) in materialSortedInds
+
+// counting sort of the decals (or of the visible ones) by material, for drawing each material separately
+static void sortDecalsByMaterial(bool onlyVisible)
+{
+    const u32 n = onlyVisible ? visibleInds.size() : decals.size();
+    auto indAt = [&](u32 i) { return onlyVisible ? visibleInds[i] : i; };
+    u32 counts[MAX_DECAL_MATERIALS] = {};
+    for (u32 i = 0; i < n; i++)
+        counts[decals.materials[indAt(i)]]++;
+    materialInstanceOffsets[0] = 0;
+    for (u32 m = 0; m < MAX_DECAL_MATERIALS; m++)
+        materialInstanceOffsets[m + 1] = materialInstanceOffsets[m] + counts[m];
+    materialSortedInds.resize(n);
+    u32 cursors[MAX_DECAL_MATERIALS];
+    std::copy(materialInstanceOffsets, materialInstanceOffsets + MAX_DECAL_MATERIALS, cursors);
+    for (u32 i = 0; i < n; i++)
+        materialSortedInds[cursors[decals.materials[indAt(i)]]++] = indAt(i);
+}
+
+static void cullDecals(const Frustum& frustum)
+{
+    visibleSlots.clear();
+    decals.grid.queryFrustum(frustum, visibleSlots);
+    // sort them so the instancing data is written in (roughly) the same order as the pool
+    visibleInds.resize(visibleSlots.size());
+    for (size_t i = 0; i < visibleSlots.size(); i++)
+        visibleInds[i] = decals.slotToDense[visibleSlots[i]];
+    std::sort(visibleInds.begin(), visibleInds.end());
+}
+
+// after cullDecals: drops the decals that are too small and, if meshLods, groups visibleInds by mesh LOD. Same as cull_comp
+// The grouping is stable: within a LOD the decals keep the input order, like the GPU culled ones, so the overlapping decals of the same LOD
+// blend in the same order with both. Across LODs the order changes, a decal of LOD 0 is drawn before the ones of LOD 1 that overlap it
+static u32 lodInstanceOffsets[DECAL_MESH_LODS + 1]; // the decals of the LOD i are in [lodInstanceOffsets[i], lodInstanceOffsets[i + 1])
+static void selectDecalLods(const mat4& viewProj, bool meshLods)
+{
+    static std::vector<u32> lodInds[DECAL_MESH_LODS];
+    for (auto& inds : lodInds)
+        inds.clear();
+    for (u32 i : visibleInds) {
+        const float screenRadius = decalScreenRadius(viewProj, decals.positions[i], decals.radiuses[i]);
+        if (screenRadius < params.lodMinPixels)
+            continue;
+        u32 lod = 0;
+        if (meshLods)
+            lod = screenRadius < params.lodMeshPixels.y ? 2 : screenRadius < params.lodMeshPixels.x ? 1 : 0;
+        lodInds[lod].push_back(i);
+    }
+    visibleInds.clear();
+    for (u32 lod = 0; lod < DECAL_MESH_LODS; lod++) {
+        lodInstanceOffsets[lod] = visibleInds.size();
+        visibleInds.insert(visibleInds.end(), lodInds[lod].begin(), lodInds[lod].end());
+    }
+    lodInstanceOffsets[DECAL_MESH_LODS] = visibleInds.size();
+}
+
+// Unwraps the primitives of all the nodes of the room into the virtual scorch texture, each node gets its own charts
+// The UVs are uploaded to a buffer per primitive instance, and the triangles give the world bounds of the virtual pages
+static void createScorchLightmaps(const cgltf_data& data)
+{
+    struct PrimitiveData {
+        std::vector<vec3> positions; // world space
+        std::vector<u32> indices;
+        size_t nodeInd, primitiveInd;
+    };
+    std::vector<PrimitiveData> primitiveDatas;
+    scorchAtlasGl.uvBos.resize(data.nodes_count);
+    for (size_t nodeInd = 0; nodeInd < data.nodes_count; nodeInd++) {
+        const cgltf_node& node = data.nodes[nodeInd];
+        if (!node.mesh)
+            continue;
+        scorchAtlasGl.uvBos[nodeInd].resize(node.mesh->primitives_count, 0);
+        mat4 modelMtx;
+        cgltf_node_transform_world(&node, &modelMtx[0][0]);
+        for (size_t primitiveInd = 0; primitiveInd < node.mesh->primitives_count; primitiveInd++) {
+            const cgltf_primitive& primitive = node.mesh->primitives[primitiveInd];
+            const cgltf_accessor* positionsAccessor = nullptr;
+            for (size_t attribInd = 0; attribInd < primitive.attributes_count; attribInd++) {
+                if (primitive.attributes[attribInd].type == cgltf_attribute_type_position)
+                    positionsAccessor = primitive.attributes[attribInd].data;
+            }
+            if (primitive.type != cgltf_primitive_type_triangles || !positionsAccessor)
+                continue;
+            PrimitiveData& primData = primitiveDatas.emplace_back();
+            primData.nodeInd = nodeInd;
+            primData.primitiveInd = primitiveInd;
+            primData.positions.resize(positionsAccessor->count);
+            for (size_t i = 0; i < positionsAccessor->count; i++) {
+                vec3 p;
+                cgltf_accessor_read_float(positionsAccessor, i, &p[0], 3);
+                primData.positions[i] = vec3(modelMtx * vec4(p, 1));
+            }
+            if (primitive.indices) {
+                primData.indices.resize(primitive.indices->count);
+                for (size_t i = 0; i < primitive.indices->count; i++)
+                    primData.indices[i] = cgltf_accessor_read_index(primitive.indices, i);
+            }
+            else {
+                primData.indices.resize(positionsAccessor->count);
+                std::iota(primData.indices.begin(), primData.indices.end(), 0u);
+            }
+            const u32 vao = modelResources.vaos[node.mesh - data.meshes][primitiveInd];
+            scorchAtlasGl.instances.push_back({ .primitive = &primitive, .vao = vao, .modelMtx = modelMtx });
+        }
+    }
+
+    std::vector<LightmapMesh> meshes(primitiveDatas.size());
+    for (size_t i = 0; i < meshes.size(); i++)
+        meshes[i] = { .positions = primitiveDatas[i].positions, .indices = primitiveDatas[i].indices };
+    scorchAtlasGl.numUnfitCharts = generateLightmapUvs(meshes, SCORCH_TEXELS_PER_METER);
+    if (scorchAtlasGl.numUnfitCharts)
+        printf("Scorch atlas: %u charts didn't fit in the virtual texture\n", scorchAtlasGl.numUnfitCharts);
+
+    for (size_t i = 0; i < meshes.size(); i++) {
+        const LightmapMesh& mesh = meshes[i];
+        ScorchMeshInstance& inst = scorchAtlasGl.instances[i];
+        glGenBuffers(1, &inst.uvBo);
+        glBindBuffer(GL_ARRAY_BUFFER, inst.uvBo);
+        glBufferData(GL_ARRAY_BUFFER, mesh.uvs.size() * sizeof(vec2), mesh.uvs.data(), GL_STATIC_DRAW);
+        scorchAtlasGl.uvBos[primitiveDatas[i].nodeInd][primitiveDatas[i].primitiveInd] = inst.uvBo;
+        for (size_t t = 0; t + 2 < mesh.indices.size(); t += 3) {
+            const vec3 positions[3] = { mesh.positions[mesh.indices[t]], mesh.positions[mesh.indices[t + 1]], mesh.positions[mesh.indices[t + 2]] };
+            const vec2 uvs[3] = { mesh.uvs[mesh.indices[t]], mesh.uvs[mesh.indices[t + 1]], mesh.uvs[mesh.indices[t + 2]] };
+            scorchAtlas.addTriangle(positions, uvs);
+        }
+    }
+    printf("Scorch atlas: %zu mesh instances, %zu virtual pages with surfaces, %u physical pages\n",
+        scorchAtlasGl.instances.size(), scorchAtlas.surfacePages.size(), SCORCH_PHYSICAL_PAGES);
+}
+
+static void updateScorchPageTable()
+{
+    static u16 table[SCORCH_VIRTUAL_PAGES * SCORCH_VIRTUAL_PAGES];
+    for (u32 i = 0; i < std::size(table); i++) {
+        const u32 physical = scorchAtlas.pages[i].physical;
+        table[i] = physical == INVALID_SCORCH_PAGE ? 0 : u16(physical + 1);
+    }
+    glBindTexture(GL_TEXTURE_2D, scorchAtlasGl.pageTableTex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCORCH_VIRTUAL_PAGES, SCORCH_VIRTUAL_PAGES, GL_RED_INTEGER, GL_UNSIGNED_SHORT, table);
+}
+
+static void clearScorchAtlas()
+{
+    scorchAtlas.clear();
+    updateScorchPageTable();
+    frameCache.sceneDirty = true;
+}
+
+// Bakes the decals that settled (infinite lifetime, grown for params.scorchBakeDelay) into the scorch atlas, and removes them from the pool
+// The decals that would need more pages than the atlas can give without evicting visible ones stay in the pool, they are retried next frame
+// The selected decal is not baked, so it can still be edited. Expects the materials UBO to be up to date and bound
+// returns whether some decal was baked
+static bool bakeSettledDecals(const Frustum& frustum, int screenW, int screenH)
+{
+    scorchAtlas.nextFrame();
+    scorchAtlas.touchVisiblePages(frustum);
+
+    struct PageDecal {
+        u32 page; // virtual
+        u32 decal; // dense index
+    };
+    static std::vector<PageDecal> pageDecals;
+    static std::vector<u32> decalPages, allocatedPages;
+    static std::vector<DecalHandle> baked;
+    pageDecals.clear();
+    allocatedPages.clear();
+    baked.clear();
+    const u32 selected = decals.indexOf(selectedDecal);
+    const float settleTime = params.growDuration + params.scorchBakeDelay;
+    for (u32 i = 0; i < decals.size() && baked.size() < MAX_SCORCH_BAKES_PER_FRAME; i++) {
+        if (decals.lifetimes[i] != 0 || decals.time - decals.spawnTimes[i] < settleTime || i == selected)
+            continue;
+        decalPages.clear();
+        scorchAtlas.queryPages(decals.positions[i], decals.radiuses[i], decalPages);
+        if (decalPages.empty() || !scorchAtlas.canAcquirePages(decalPages))
+            continue;
+        for (u32 page : decalPages) {
+            bool allocated;
+            u32 evicted;
+            scorchAtlas.acquirePage(page, allocated, evicted);
+            if (allocated)
+                allocatedPages.push_back(page);
+            pageDecals.push_back({ page, i });
+        }
+        baked.push_back(decals.handleAt(i));
+    }
+    if (baked.empty())
+        return false;
+
+    // the pages that were evicted are not in the page table anymore, and the allocated ones are
+    if (allocatedPages.size())
+        updateScorchPageTable();
+    std::sort(pageDecals.begin(), pageDecals.end(), [](const PageDecal& a, const PageDecal& b) { return a.page < b.page || (a.page == b.page && a.decal < b.decal); });
+    static std::vector<InstancingData> instances;
+    instances.resize(pageDecals.size());
+    for (size_t i = 0; i < pageDecals.size(); i++)
+        instances[i] = makeInstancingData(pageDecals[i].decal);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scorchAtlasGl.decalsBo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(InstancingData), instances.data(), GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, scorchAtlasGl.decalsBo);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, scorchAtlasGl.fbo);
+    glViewport(0, 0, SCORCH_LAYER_SIZE, SCORCH_LAYER_SIZE);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glBlendFuncSeparate(GL_ONE, GL_SRC_ALPHA, GL_ZERO, GL_SRC_ALPHA);
+    glUseProgram(scorchBakeShader.prog);
+    for (size_t begin = 0; begin < pageDecals.size(); ) {
+        const u32 page = pageDecals[begin].page;
+        size_t end = begin + 1;
+        while (end < pageDecals.size() && pageDecals[end].page == page)
+            end++;
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, scorchAtlasGl.atlasTex, 0, scorchAtlas.pages[page].physical);
+        if (std::find(allocatedPages.begin(), allocatedPages.end(), page) != allocatedPages.end()) {
+            const float noScorch[] = { 0, 0, 0, 1 };
+            glClearBufferfv(GL_COLOR, 0, noScorch);
+        }
+        const vec2 pageOrigin = vec2(page % SCORCH_VIRTUAL_PAGES, page / SCORCH_VIRTUAL_PAGES) * float(SCORCH_PAGE_SIZE) - float(SCORCH_PAGE_BORDER);
+        glUniform2fv(scorchBakeShader.locs.pageOrigin, 1, &pageOrigin[0]);
+        glUniform1ui(scorchBakeShader.locs.firstDecal, begin);
+        glUniform1ui(scorchBakeShader.locs.numDecals, end - begin);
+        for (const ScorchMeshInstance& inst : scorchAtlasGl.instances) {
+            glUniformMatrix4fv(scorchBakeShader.locs.modelMtx, 1, GL_FALSE, &inst.modelMtx[0][0]);
+            glBindVertexArray(inst.vao);
+            bindLightmapUvs(inst.uvBo);
+            drawPrimitive(*inst.primitive);
+        }
+        begin = end;
+    }
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, screenW, screenH);
+
+    decals.remove(baked);
+    scorchAtlasGl.numBaked += baked.size();
+    return true;
+}
+
+struct SpatialBenchResult {
+    u32 numDecals;
+    float buildMs;
+    // average time per query, in microseconds
+    float radiusGridUs, radiusBruteUs;
+    float frustumGridUs, frustumBruteUs;
+    float rayGridUs, rayBruteUs;
+    bool mismatch; // the grid and the brute force didn't agree
+};
+static std::vector<SpatialBenchResult> spatialBenchResults;
+
+// state that the benchmarks override, so it can be restored at the end
+static struct {
+    Decals decals;
+    Params params;
+    EInstanceUpload instanceUpload;
+} benchmarkSavedState;
+
+static void saveBenchmarkState()
+{
+    benchmarkSavedState = { decals, params, instanceUpload };
+    params.scorchAtlas = false; // the decals of the benchmark would stay in the atlas
+}
+
+static void restoreBenchmarkState()
+{
+    decals = benchmarkSavedState.decals;
+    params = benchmarkSavedState.params;
+    instanceUpload = benchmarkSavedState.instanceUpload;
+    benchmarkSavedState.decals = {};
+    instanceBuffer.valid = false;
+}
+
+// spawns decals spread over the floor of the room, for the benchmarks
+// with mixedShapes, the decals cycle through all the shapes, with random proportions. The spheres are the same either way
+static void spawnBenchmarkDecals(u32 count, float minRadius, float maxRadius, u32 numMaterials, bool mixedShapes = false)
+{
+    decals.clear();
+    decals.coalescing.enabled = false;
+    std::minstd_rand rng(0);
+    std::minstd_rand shapeRng(1); // separate, so the spheres don't depend on mixedShapes
+    std::uniform_real_distribution<float> u01(0, 1);
+    for (u32 i = 0; i < count; i++) {
+        DecalSpawn spawn = {
+            .pos = vec3(glm::mix(-2.4f, +2.4f, u01(rng)), 0.045, glm::mix(-2.4f, +2.4f, u01(rng))),
+            .rot = glm::quat_cast(randRotMtx({ u01(rng), u01(rng), u01(rng) })),
+            .radius = glm::mix(minRadius, maxRadius, u01(rng)),
+            .material = u16(i % numMaterials),
+        };
+        if (mixedShapes) {
+            const vec3 proportions = vec3(1, glm::mix(0.2f, 1.f, u01(shapeRng)), glm::mix(0.2f, 1.f, u01(shapeRng)));
+            spawn.shape = EDecalShape(i % DECAL_SHAPE_COUNT);
+            spawn.extents = fitDecalShapeExtents(spawn.shape, proportions);
+        }
+        decals.spawn(spawn);
+    }
+}
+
+// 16 materials mixed: one instanced draw with the palette vs one draw per material, like we would need with per-material uniforms
+// Both configs use the ring upload path, so the only difference is the draw calls
+static Benchmark materialBenchmark = {
+    .configs = { "palette, 1 draw call", "uniforms, 1 draw call per material" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(2000, 0.1f, 0.4f, MAX_DECAL_MATERIALS);
+            instanceUpload = INSTANCE_UPLOAD_RING;
+            params.frustumCulling = false;
+        }
+        if (config >= 0)
+            params.drawPerMaterial = config == 1;
+        else
+            restoreBenchmarkState();
+    },
+};
+
+// Instanced spheres vs tiled compute, sweeping the number of decals and their size (the bigger, the more they overlap)
+// Both paths use the incremental upload with GPU frustum culling
+static const u32 decalPathBenchCounts[] = { 500, 2000, 8000 };
+static const float decalPathBenchRadiuses[] = { 0.15f, 0.6f };
+static Benchmark decalPathBenchmark = {
+    .configs = [] {
+        std::vector<std::string> configs;
+        for (u32 count : decalPathBenchCounts)
+        for (float radius : decalPathBenchRadiuses)
+        for (const char* path : { "instanced", "tiled" }) {
+            char name[64];
+            snprintf(name, sizeof(name), "%u decals, radius %.2f, %s", count, radius, path);
+            configs.push_back(name);
+        }
+        return configs;
+    }(),
+    .apply = [](int config) {
+        if (config < 0) {
+            restoreBenchmarkState();
+            return;
+        }
+        if (config == 0)
+            saveBenchmarkState();
+        if (config % 2 == 0) {
+            const u32 count = decalPathBenchCounts[config / 4];
+            const float radius = decalPathBenchRadiuses[(config / 2) % 2];
+            spawnBenchmarkDecals(count, 0.75f * radius, 1.25f * radius, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.frustumCulling = true;
+        }
+        params.decalPath = config % 2 ? DECAL_PATH_TILED : DECAL_PATH_INSTANCED;
+    },
+};
+
+static void readFboPixels(std::vector<u8>& pixels)
+{
+    i32 viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    pixels.resize(4 * viewport[2] * viewport[3]);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glReadPixels(0, 0, viewport[2], viewport[3], GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+}
+
+// reads the fbo and compares it to a reference image read with readFboPixels. For the benchmark reports
+static std::string diffFboPixels(const std::vector<u8>& reference)
+{
+    static std::vector<u8> pixels;
+    readFboPixels(pixels);
+    if (pixels.size() != reference.size())
+        return "resized, can't compare";
+    u32 maxDiff = 0, numDiffering = 0;
+    u64 diffSum = 0;
+    for (size_t i = 0; i < pixels.size(); i += 4) {
+        u32 pixelDiff = 0;
+        for (size_t c = 0; c < 3; c++) {
+            const u32 diff = abs(int(pixels[i + c]) - int(reference[i + c]));
+            pixelDiff = glm::max(pixelDiff, diff);
+            diffSum += diff;
+        }
+        maxDiff = glm::max(maxDiff, pixelDiff);
+        numDiffering += pixelDiff > 8 ? 1 : 0;
+    }
+    const size_t numPixels = pixels.size() / 4;
+    char str[128];
+    snprintf(str, sizeof(str), "diff max: %u, mean: %.3f, > 8: %.2f%% px", maxDiff, double(diffSum) / (3 * numPixels), 100. * numDiffering / numPixels);
+    return str;
+}
+
+// The noise backends on the same scene. The image of each backend is compared to the one of the reference (NOISE_BACKEND_ALU)
+static std::vector<u8> noiseBenchReference;
+static Benchmark noiseBenchmark = {
+    .configs = { "ALU, sin hash (reference)", "ALU, integer hash", "cubemap" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(1000, 0.2f, 0.5f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+        }
+        if (config >= 0)
+            params.noiseBackend = ENoiseBackend(config);
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        if (config == 0) {
+            readFboPixels(noiseBenchReference);
+            return "reference";
+        }
+        return diffFboPixels(noiseBenchReference);
+    },
+};
+
+// Full, half and quarter resolution decals, with both decal paths. The images are compared to the full resolution one of the same path
+static std::vector<u8> resolutionBenchReference;
+static Benchmark resolutionBenchmark = {
+    .configs = {
+        "full, instanced", "half, instanced", "quarter, instanced",
+        "full, tiled", "half, tiled", "quarter, tiled",
+    },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(400, 0.2f, 0.4f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.frustumCulling = true;
+        }
+        if (config >= 0) {
+            params.decalPath = config < 3 ? DECAL_PATH_INSTANCED : DECAL_PATH_TILED;
+            params.decalResolution = EDecalResolution(config % 3);
+        }
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        if (config % 3 == 0) {
+            readFboPixels(resolutionBenchReference);
+            return "reference";
+        }
+        return diffFboPixels(resolutionBenchReference);
+    },
+};
+
+// The instanced path with and without the stencil marked sphere volumes. Big decals, so most of the sphere pixels are in the air
+static Benchmark stencilBenchmark = {
+    .configs = { "no stencil", "stencil volumes" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(300, 0.6f, 1.2f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.decalResolution = DECAL_RESOLUTION_FULL;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+        }
+        if (config >= 0)
+            params.stencilVolumes = config == 1;
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        if (!glHasPipelineStatistics)
+            return "no pipeline statistics";
+        char str[128];
+        if (config == 0) // there's no marking pass, decalMarkInvocations still has the result of an older frame
+            snprintf(str, sizeof(str), "FS invocations shade: %llu", (unsigned long long)decalShadeInvocations.value);
+        else {
+            snprintf(str, sizeof(str), "FS invocations shade: %llu, mark: %llu",
+                (unsigned long long)decalShadeInvocations.value, (unsigned long long)decalMarkInvocations.value);
+        }
+        return str;
+    },
+};
+
+// The proxy geometries, sweeping the number of decals and their size. Small decals are dominated by the vertex cost of the sphere,
+// big ones by the fragments the proxy covers outside of the sphere
+static const u32 proxyBenchCounts[] = { 500, 4000 };
+static const float proxyBenchRadiuses[] = { 0.05f, 0.5f };
+static Benchmark proxyBenchmark = {
+    .configs = [] {
+        std::vector<std::string> configs;
+        for (u32 count : proxyBenchCounts)
+        for (float radius : proxyBenchRadiuses)
+        for (const char* proxy : { "icosphere", "box", "screen quad" }) {
+            char name[64];
+            snprintf(name, sizeof(name), "%u decals, radius %.2f, %s", count, radius, proxy);
+            configs.push_back(name);
+        }
+        return configs;
+    }(),
+    .apply = [](int config) {
+        if (config < 0) {
+            restoreBenchmarkState();
+            return;
+        }
+        if (config == 0)
+            saveBenchmarkState();
+        if (config % 3 == 0) {
+            const float radius = proxyBenchRadiuses[(config / 3) % 2];
+            spawnBenchmarkDecals(proxyBenchCounts[config / 6], 0.75f * radius, 1.25f * radius, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.decalResolution = DECAL_RESOLUTION_FULL;
+            params.stencilVolumes = false;
+        }
+        params.decalProxy = EDecalProxy(config % 3);
+    },
+    .report = [](int config) -> std::string {
+        if (!glHasPipelineStatistics)
+            return "no pipeline statistics";
+        char str[128];
+        snprintf(str, sizeof(str), "VS invocations: %llu, FS invocations: %llu",
+            (unsigned long long)decalVertexInvocations.value, (unsigned long long)decalShadeInvocations.value);
+        return str;
+    },
+};
+
+// The screen size LOD on a scene with many small decals. The image with the LOD is compared to the one without it
+static std::vector<u8> lodBenchReference;
+// The last two configs force the coarsest mesh on large decals, with the rest of the LOD off: the image must not change,
+// which catches proxy meshes that don't enclose the sphere
+static Benchmark lodBenchmark = {
+    .configs = { "no LOD (reference)", "LOD", "no LOD, large decals (reference)", "coarsest mesh, large decals" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(4000, 0.03f, 0.15f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.frustumCulling = true;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.decalProxy = DECAL_PROXY_ICOSPHERE;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+        }
+        if (config == 2) {
+            spawnBenchmarkDecals(500, 0.3f, 0.6f, 4);
+            params.lodMinPixels = 0;
+            params.lodMeshPixels = vec2(FLT_MAX);
+            params.lodOctavePixels = 0;
+        }
+        if (config >= 0)
+            params.lod = config % 2 == 1;
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        std::string report;
+        if (glHasPipelineStatistics) {
+            char str[128];
+            snprintf(str, sizeof(str), "VS: %llu, FS: %llu, ",
+                (unsigned long long)decalVertexInvocations.value, (unsigned long long)decalShadeInvocations.value);
+            report = str;
+        }
+        if (config % 2 == 0) {
+            readFboPixels(lodBenchReference);
+            return report + "reference";
+        }
+        return report + diffFboPixels(lodBenchReference);
+    },
+};
+
+// Position reconstruction with the inverse view projection vs the linear depth prepass and view rays, with a lot of overlap
+static std::vector<u8> viewRaysBenchReference;
+static Benchmark viewRaysBenchmark = {
+    .configs = { "inverse view projection (reference)", "linear depth + view rays" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(2000, 0.3f, 0.6f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+        }
+        if (config >= 0)
+            params.viewRays = config == 1;
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        if (config == 0) {
+            readFboPixels(viewRaysBenchReference);
+            return "reference";
+        }
+        return diffFboPixels(viewRaysBenchReference);
+    },
+};
+
+static std::vector<u8> reverseZBenchReference;
+static Benchmark reverseZBenchmark = {
+    .configs = { "24 bit depth (reference)", "reverse Z, 32 bit float depth" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(2000, 0.3f, 0.6f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+        }
+        if (config >= 0)
+            params.reverseZ = config == 1;
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        if (config == 0) {
+            readFboPixels(reverseZBenchReference);
+            return "reference";
+        }
+        return diffFboPixels(reverseZBenchReference);
+    },
 };
-static Sphere sphere;
 
-enum EDisplayMode : int {
-    DISPLAY_MODE_DEFAULT,
-    DISPLAY_MODE_CIRCLE,
-    DISPLAY_MODE_SPHERE,
-    DISPLAY_MODE_SPHERE_NOISE,
+// The same settled decals drawn by the decal pass or baked into the scorch atlas. The atlas is cleared before and after
+static std::vector<u8> scorchBenchReference;
+static Benchmark scorchBenchmark = {
+    .configs = { "live decals (reference)", "baked into the scorch atlas" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(2000, 0.3f, 0.6f, 4);
+            for (float& spawnTime : decals.spawnTimes)
+                spawnTime -= params.growDuration; // already grown, so they look the same in both configs
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+            params.scorchBakeDelay = 0;
+            clearScorchAtlas();
+        }
+        if (config >= 0)
+            params.scorchAtlas = config == 1;
+        else {
+            restoreBenchmarkState();
+            clearScorchAtlas();
+        }
+    },
+    .report = [](int config) -> std::string {
+        if (config == 0) {
+            readFboPixels(scorchBenchReference);
+            return "reference";
+        }
+        char pages[96];
+        snprintf(pages, sizeof(pages), "%zu live decals, %u pages, ", decals.size(), scorchAtlas.numResident);
+        return pages + diffFboPixels(scorchBenchReference);
+    },
 };
 
-struct Params {
-    float sphereRad;
-    float noiseFreq;
-    float centerBase;
-    float exponent;
-    EDisplayMode displayMode;
+// Decals scattered through the volume of the room and around it, so a lot of them are behind the floor, the walls or the crate.
+// The proxies only depth test their back faces, so the surfaces in front of the spheres are not rejected by the depth test
+// The image with the tile rejection is compared to the one without it
+static std::vector<u8> tileRejectBenchReference;
+static Benchmark tileRejectBenchmark = {
+    .configs = { "no tile rejection (reference)", "tile min/max depth rejection" },
+    .apply = [](int config) {
+        if (config == 0) {
+            saveBenchmarkState();
+            decals.clear();
+            decals.coalescing.enabled = false;
+            std::minstd_rand rng(0);
+            std::uniform_real_distribution<float> u01(0, 1);
+            for (u32 i = 0; i < 4000; i++) {
+                decals.spawn({
+                    .pos = vec3(glm::mix(-4.f, +4.f, u01(rng)), glm::mix(-1.5f, 2.f, u01(rng)), glm::mix(-4.f, +4.f, u01(rng))),
+                    .rot = glm::quat_cast(randRotMtx({ u01(rng), u01(rng), u01(rng) })),
+                    .radius = glm::mix(0.1f, 0.4f, u01(rng)),
+                    .material = u16(i % 4),
+                });
+            }
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.frustumCulling = true;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.decalResolution = DECAL_RESOLUTION_FULL;
+            params.decalProxy = DECAL_PROXY_ICOSPHERE;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+            params.stencilVolumes = false;
+        }
+        if (config >= 0)
+            params.tileDepthReject = config == 1;
+        else
+            restoreBenchmarkState();
+    },
+    .report = [](int config) -> std::string {
+        std::string report;
+        if (glHasPipelineStatistics) {
+            char str[128];
+            snprintf(str, sizeof(str), "VS: %llu, FS: %llu, ",
+                (unsigned long long)decalVertexInvocations.value, (unsigned long long)decalShadeInvocations.value);
+            report = str;
+        }
+        if (config == 0) {
+            readFboPixels(tileRejectBenchReference);
+            return report + "reference";
+        }
+        return report + diffFboPixels(tileRejectBenchReference);
+    },
 };
-static Params params = {
-    .sphereRad = 0.5,
-    .noiseFreq = 7,
-    .centerBase = 1.5,
-    .exponent = 1.5,
-    .displayMode = DISPLAY_MODE_DEFAULT,
+
+// All the shapes share the proxy mesh and the instanced draw, so mixing them only changes the fragment cost of the shape test
+// (and the shapes cover less than their spheres). Same bounding spheres in both configs
+static Benchmark shapeBenchmark = {
+    .configs = { "spheres", "mixed shapes" },
+    .apply = [](int config) {
+        if (config < 0) {
+            restoreBenchmarkState();
+            return;
+        }
+        if (config == 0)
+            saveBenchmarkState();
+        spawnBenchmarkDecals(2000, 0.2f, 0.5f, 4, config == 1);
+        instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+        params.decalPath = DECAL_PATH_INSTANCED;
+        params.displayMode = DISPLAY_MODE_DEFAULT;
+    },
 };
 
-struct Decals {
-    std::vector<vec3> positions;
-    std::vector<mat3> rotations;
-    //std::vector<float> radiuses;
+// Forward vs deferred with few and many overlapping decals. In the forward path the decals blend their material color over the lit scene,
+// in the deferred one they blend the albedo and roughness into the G-buffer, and a fullscreen pass does the lighting afterwards
+// That pass is the extra cost of the deferred path, and it should be the same with 500 and 4000 decals
+static Benchmark deferredBenchmark = {
+    .configs = { "forward, 500 decals", "deferred, 500 decals", "forward, 4000 decals", "deferred, 4000 decals" },
+    .apply = [](int config) {
+        if (config < 0) {
+            restoreBenchmarkState();
+            return;
+        }
+        if (config == 0)
+            saveBenchmarkState();
+        if (config % 2 == 0)
+            spawnBenchmarkDecals(config < 2 ? 500 : 4000, 0.3f, 0.6f, 4);
+        instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+        params.decalPath = DECAL_PATH_INSTANCED;
+        params.decalResolution = DECAL_RESOLUTION_FULL;
+        params.displayMode = DISPLAY_MODE_DEFAULT;
+        params.deferred = config % 2 == 1;
+    },
+    .report = [](int config) -> std::string {
+        char str[96];
+        if (config % 2 == 1)
+            snprintf(str, sizeof(str), "scene %.3fms, lighting %.3fms", scenePassTimer.ms, lightingPassTimer.ms);
+        else
+            snprintf(str, sizeof(str), "scene %.3fms", scenePassTimer.ms);
+        return str;
+    },
 };
-Decals decals = {
-    .positions = {vec3(0, 0.045, 0)},
-    .rotations = {mat3(1)},
-    //.radiuses = {0.5},
+
+// Per pixel, per sample on the edges and per sample decal shading, at each MSAA level. The per sample image is the reference for the other two
+// Per sample multiplies the fragment invocations by the number of samples, on the edges it should only add a small fraction
+static std::vector<u8> msaaBenchReference;
+static Benchmark msaaBenchmark = {
+    .configs = {
+        "2x, per sample (reference)", "2x, per pixel", "2x, per sample on edges",
+        "4x, per sample (reference)", "4x, per pixel", "4x, per sample on edges",
+        "8x, per sample (reference)", "8x, per pixel", "8x, per sample on edges",
+    },
+    .apply = [](int config) {
+        if (config < 0) {
+            restoreBenchmarkState();
+            return;
+        }
+        if (config == 0) {
+            saveBenchmarkState();
+            spawnBenchmarkDecals(2000, 0.3f, 0.6f, 4);
+            instanceUpload = INSTANCE_UPLOAD_INCREMENTAL;
+            params.decalPath = DECAL_PATH_INSTANCED;
+            params.decalResolution = DECAL_RESOLUTION_FULL;
+            params.displayMode = DISPLAY_MODE_DEFAULT;
+            params.deferred = false;
+        }
+        const EMsaaDecalShading shadings[] = { MSAA_DECAL_SHADING_SAMPLE, MSAA_DECAL_SHADING_PIXEL, MSAA_DECAL_SHADING_EDGES };
+        params.msaaSamples = 2 << (config / 3);
+        params.msaaDecalShading = shadings[config % 3];
+    },
+    .report = [](int config) -> std::string {
+        std::string report;
+        if (msaaSamples() != u32(params.msaaSamples)) {
+            char str[32];
+            snprintf(str, sizeof(str), "clamped to %ux, ", msaaSamples());
+            report = str;
+        }
+        if (glHasPipelineStatistics) {
+            char str[64];
+            snprintf(str, sizeof(str), "FS: %llu, ", (unsigned long long)decalShadeInvocations.value);
+            report += str;
+        }
+        if (config % 3 == 0) {
+            readFboPixels(msaaBenchReference);
+            return report + "reference";
+        }
+        return report + diffFboPixels(msaaBenchReference);
+    },
 };
 
-static void glfwErrorCallback(int error, const char* description)
+// compares the spatial index against brute force, with the same density of decals at every size
+static void runSpatialIndexBenchmark()
 {
-    fprintf(stderr, "Glfw Error %d: %s\n", error, description);
+    spatialBenchResults.clear();
+    printf("%10s %10s %22s %22s %22s\n", "decals", "build ms", "radius us grid/brute", "frustum us grid/brute", "ray us grid/brute");
+    for (u32 numDecals : { 10'000u, 100'000u, 1'000'000u }) {
+        std::minstd_rand rng(numDecals);
+        std::uniform_real_distribution<float> u01(0, 1);
+        const float side = sqrtf(numDecals / 50.f); // 50 decals per square meter
+        auto randPos = [&]() { return vec3(side * (u01(rng) - 0.5f), 2 * u01(rng), side * (u01(rng) - 0.5f)); };
+
+        SpatialBenchResult res = { .numDecals = numDecals };
+        Decals bd;
+        double t = glfwGetTime();
+        bd.reserve(numDecals);
+        for (u32 i = 0; i < numDecals; i++)
+            bd.spawn({ .pos = randPos(), .rot = glm::quat(1, 0, 0, 0), .radius = glm::mix(0.1f, 0.5f, u01(rng)) });
+        res.buildMs = 1000 * (glfwGetTime() - t);
+
+        std::vector<u32> result;
+        auto timeQueries = [&](int numQueries, auto&& gridQuery, auto&& bruteQuery, float& gridUs, float& bruteUs) {
+            const u32 seed = rng();
+            size_t gridCount = 0, bruteCount = 0;
+            rng.seed(seed);
+            t = glfwGetTime();
+            for (int q = 0; q < numQueries; q++)
+                gridCount += gridQuery();
+            gridUs = 1e6 * (glfwGetTime() - t) / numQueries;
+            rng.seed(seed);
+            t = glfwGetTime();
+            for (int q = 0; q < numQueries; q++)
+                bruteCount += bruteQuery();
+            bruteUs = 1e6 * (glfwGetTime() - t) / numQueries;
+            res.mismatch |= gridCount != bruteCount;
+        };
+
+        timeQueries(200,
+            [&]() { result.clear(); bd.grid.queryRadius(randPos(), 1, result); return result.size(); },
+            [&]() {
+                const vec3 c = randPos();
+                size_t n = 0;
+                for (size_t i = 0; i < bd.size(); i++)
+                    n += distance2(c, bd.positions[i]) <= (1 + bd.radiuses[i]) * (1 + bd.radiuses[i]);
+                return n;
+            },
+            res.radiusGridUs, res.radiusBruteUs);
+
+        auto randFrustum = [&]() {
+            const vec3 eye = randPos() + vec3(0, 1, 0);
+            const mat4 view = glm::lookAt(eye, eye + vec3(u01(rng) - 0.5f, -0.3f, u01(rng) - 0.5f), vec3(0, 1, 0));
+            return makeFrustum(glm::perspective(1.f, 16.f / 9, CAMERA_NEAR_DIST, 20.f) * view);
+        };
+        timeQueries(20,
+            [&]() { result.clear(); bd.grid.queryFrustum(randFrustum(), result); return result.size(); },
+            [&]() {
+                const Frustum frustum = randFrustum();
+                size_t n = 0;
+                for (size_t i = 0; i < bd.size(); i++)
+                    n += sphereInFrustum(frustum, bd.positions[i], bd.radiuses[i]);
+                return n;
+            },
+            res.frustumGridUs, res.frustumBruteUs);
+
+        auto randRay = [&](vec3& o, vec3& d) {
+            o = randPos() + vec3(0, 2, 0);
+            d = normalize(vec3(u01(rng) - 0.5f, -1, u01(rng) - 0.5f));
+        };
+        timeQueries(200,
+            [&]() {
+                vec3 o, d;
+                randRay(o, d);
+                return size_t(bd.grid.raycast(o, d, CAMERA_FAR_DIST));
+            },
+            [&]() {
+                vec3 o, d;
+                randRay(o, d);
+                u32 best = INVALID_DECAL_INDEX;
+                float bestDist = CAMERA_FAR_DIST;
+                for (size_t i = 0; i < bd.size(); i++) {
+                    const float dist = raySphereIntersection(o, d, bd.positions[i], bd.radiuses[i]);
+                    if (dist >= 0 && dist < bestDist) {
+                        bestDist = dist;
+                        best = bd.slots[i];
+                    }
+                }
+                return size_t(best);
+            },
+            res.rayGridUs, res.rayBruteUs);
+
+        printf("%10u %10.1f %10.1f/%-11.1f %10.1f/%-11.1f %10.1f/%-11.1f%s\n", numDecals, res.buildMs,
+            res.radiusGridUs, res.radiusBruteUs, res.frustumGridUs, res.frustumBruteUs, res.rayGridUs, res.rayBruteUs,
+            res.mismatch ? " MISMATCH" : "");
+        spatialBenchResults.push_back(res);
+    }
 }
 
-static void resizeFbo(int w, int h)
+// culls the instanceBuffer into gpuCulling.visibleBo and writes the draw commands to gpuCulling.indirectBo, one per LOD of the mesh.
+// With meshLods false everything goes to the first command, which is what the tiled path reads
+// with tileDepthReject, the decals that can't touch the surfaces of the tiles they cover are culled too. Call computeTileDepths() first
+static void cullInstancesOnGpu(const Frustum& frustum, const mat4& viewProj, const ProxyMesh& mesh, bool meshLods, bool tileDepthReject)
 {
-    glBindRenderbuffer(GL_RENDERBUFFER, fb_colorRbo);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_SRGB8_ALPHA8, w, h);
+    if (instanceBuffer.capacity > gpuCulling.capacity) {
+        gpuCulling.capacity = instanceBuffer.capacity;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.visibleBo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, gpuCulling.capacity * sizeof(InstancingData), nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.instanceLodsBo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, gpuCulling.capacity * sizeof(u32), nullptr, GL_DYNAMIC_COPY);
+        const u32 maxGroups = (gpuCulling.capacity + CullShader::WORKGROUP_SIZE - 1) / CullShader::WORKGROUP_SIZE;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.groupOffsetsBo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, DECAL_MESH_LODS * maxGroups * sizeof(u32), nullptr, GL_DYNAMIC_COPY);
+    }
+    DrawElementsIndirectCommand cmds[DECAL_MESH_LODS];
+    for (u32 lod = 0; lod < DECAL_MESH_LODS; lod++) {
+        const ProxyMesh::Lod& meshLod = mesh.lods[glm::min(lod, mesh.numLods - 1)];
+        cmds[lod] = {
+            .count = meshLod.numInds,
+            .firstIndex = meshLod.firstInd,
+            .baseVertex = meshLod.baseVertex,
+            // instanceCount and baseInstance are written by cull_comp
+        };
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCulling.indirectBo);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(cmds), cmds);
 
-    glBindTexture(GL_TEXTURE_2D, fb_depthTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, w, h, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+    glUseProgram(cullShader.prog);
+    glUniform4fv(cullShader.locs.frustumPlanes, 6, &frustum.planes[0][0]);
+    glUniform1ui(cullShader.locs.numInstances, decals.size());
+    glUniformMatrix4fv(cullShader.locs.viewProj, 1, GL_FALSE, &viewProj[0][0]);
+    glUniform1i(cullShader.locs.meshLods, meshLods && mesh.numLods > 1);
+    glUniform1i(cullShader.locs.tileDepthReject, tileDepthReject);
+    glUniform2i(cullShader.locs.viewSize, decalTiles.viewW, decalTiles.viewH);
+    setLodUniforms(cullShader.locs.lod);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, decalTiles.tilesBo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instanceBuffer.bo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpuCulling.visibleBo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpuCulling.indirectBo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, gpuCulling.instanceLodsBo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, gpuCulling.groupOffsetsBo);
+    const u32 numGroups = (decals.size() + CullShader::WORKGROUP_SIZE - 1) / CullShader::WORKGROUP_SIZE;
+    glUniform1i(cullShader.locs.pass, 0); // CULL_PASS_COUNT
+    glDispatchCompute(numGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUniform1i(cullShader.locs.pass, 1); // CULL_PASS_SCAN
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUniform1i(cullShader.locs.pass, 2); // CULL_PASS_WRITE
+    glDispatchCompute(numGroups, 1, 1);
+    glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+static void uploadDirtyInstances()
+{
+    if (decals.size() > instanceBuffer.capacity) {
+        instanceBuffer.capacity = glm::max(2 * instanceBuffer.capacity, u32(decals.size()));
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer.bo);
+        glBufferData(GL_ARRAY_BUFFER, instanceBuffer.capacity * sizeof(InstancingData), nullptr, GL_DYNAMIC_DRAW);
+        instanceBuffer.valid = false;
+    }
+    if (!instanceBuffer.valid)
+        decals.markAllDirty();
+    instanceBuffer.valid = true;
+
+    decals.popDirtyRanges(dirtyRanges);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer.bo);
+    auto scratch = bufferSpan<InstancingData>();
+    for (DecalRange range : dirtyRanges) {
+        // ranges larger than the scratch buffer are uploaded in pieces
+        for (u32 begin = range.begin; begin < range.end; begin += scratch.size()) {
+            const u32 end = glm::min(range.end, begin + u32(scratch.size()));
+            writeInstancingData(scratch.data(), begin, end);
+            glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(InstancingData), (end - begin) * sizeof(InstancingData), scratch.data());
+            instanceUploadStats.uploadedBytes += (end - begin) * sizeof(InstancingData);
+            instanceUploadStats.uploadedRanges++;
+        }
+    }
+}
 
+// renders the downsampled depth of the scene into decalLayer.depthTex and leaves decalLayer ready to draw the decals at low resolution:
+// bound, cleared, with its viewport and its depth in texture unit 1. Expects the depth of the scene in texture unit 1 and the decal pass state
+static void beginLowResDecalLayer(int layerW, int layerH, u32 factor)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, decalLayer.fbo);
+    glViewport(0, 0, layerW, layerH);
+    glUseProgram(depthDownsampleShader.prog);
+    glUniform1i(depthDownsampleShader.locs.depthTex, 1);
+    glUniform1i(depthDownsampleShader.locs.factor, factor);
+    glUniform2i(depthDownsampleShader.locs.layerSize, layerW, layerH);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_TRUE);
+    glDepthFunc(GL_ALWAYS);
+    glDisable(GL_CULL_FACE);
+    glBindVertexArray(emptyVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_CULL_FACE);
+    glDepthFunc(depthFuncFarther());
+    glDepthMask(GL_FALSE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+    const float clearColor[] = { 0, 0, 0, 1 }; // no decal color, full transmittance
+    glClearBufferfv(GL_COLOR, 0, clearColor);
+    glClear(GL_STENCIL_BUFFER_BIT);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, decalLayer.depthTex);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// converts the depth in texture unit 1 (w x h) to view space depth into linearDepth.tex, and binds it to texture unit 5
+// returns to drawing to targetFbo
+static void writeLinearDepth(int w, int h, u32 targetFbo)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, linearDepth.fbo);
     glViewport(0, 0, w, h);
-    glScissor(0, 0, w, h);
+    const LinearDepthShader& linearDepthShader = getShaderVariant(linearDepthShaderVariants, params.reverseZ);
+    glUseProgram(linearDepthShader.prog);
+    glUniform1i(linearDepthShader.locs.depthTex, 1);
+    glUniform1f(linearDepthShader.locs.near, CAMERA_NEAR_DIST);
+    glUniform1f(linearDepthShader.locs.far, CAMERA_FAR_DIST);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    glBindVertexArray(emptyVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_BLEND);
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFbo);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, linearDepth.tex);
+    glActiveTexture(GL_TEXTURE0);
 }
 
-static void drawMesh(const cgltf_data& data, const cgltf_mesh& mesh,
-    const mat4& viewMtx, const mat4& viewProjMtx, const mat4& modelMtx)
+// world space rays through the corners of the screen, scaled so their view space depth is 1. See view_ray_common
+struct ViewRays {
+    vec3 camPos;
+    vec3 ray00, dx, dy;
+};
+static ViewRays calcViewRays(const mat4& viewMtx, const mat4& projMtx)
 {
-    const size_t meshInd = &mesh - data.meshes;
-    const auto modelView = viewMtx * modelMtx;
-    const auto modelViewProj = viewProjMtx * modelMtx;
+    const mat4 invProj = glm::inverse(projMtx);
+    const mat3 invViewRot = glm::transpose(mat3(viewMtx));
+    auto cornerRay = [&](float x, float y) {
+        const vec4 p = invProj * vec4(x, y, 0, 1);
+        const vec3 v = vec3(p) / p.w;
+        return invViewRot * (v / -v.z);
+    };
+    const vec3 ray00 = cornerRay(-1, -1);
+    return { -(invViewRot * vec3(viewMtx[3])), ray00, cornerRay(1, -1) - ray00, cornerRay(-1, 1) - ray00 };
+}
 
-    for (size_t primitiveInd = 0; primitiveInd < mesh.primitives_count; primitiveInd++) {
-        const auto& primitive = mesh.primitives[primitiveInd];
-        if(primitive.material->double_sided)
-            glDisable(GL_CULL_FACE);
-        else
-            glEnable(GL_CULL_FACE);
-        assert(primitive.material->has_pbr_metallic_roughness);
-        const auto& mr = primitive.material->pbr_metallic_roughness;
-        glUseProgram(sceneShader.prog);
-        glUniformMatrix4fv(sceneShader.locs.modelMtx, 1, GL_FALSE, &modelMtx[0][0]);
-        glUniformMatrix4fv(sceneShader.locs.modelView, 1, GL_FALSE, &modelView[0][0]);
-        glUniformMatrix4fv(sceneShader.locs.modelViewProj, 1, GL_FALSE, &modelViewProj[0][0]);
-        const size_t albedoTexInd = mr.base_color_texture.texture - data.textures;
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, modelResources.textures[albedoTexInd]);
-        const u32 vao = modelResources.vaos[meshInd][primitiveInd];
-        glBindVertexArray(vao);
-        const auto primitiveType = toGl(primitive.type);
-        if (primitive.indices) {
-            const auto& indices = *primitive.indices;
-            const GLenum intType = toGl(indices.component_type);
-            const size_t offset = indices.offset + indices.buffer_view->offset;
-            glDrawElements(primitiveType, primitive.indices->count, intType, (void*)offset);
-        }
-        else {
-            const size_t numVerts = primitive.attributes[0].data->count;
-            glDrawArrays(primitiveType, 0, numVerts);
-        }
+// blends the decal layer over the scene, with a depth aware upsample when it's at low resolution
+// the scene's fbo must be bound. Rebinds the depth of the scene to texture unit 1
+static void compositeDecalLayer(int screenW, int screenH, int layerW, int layerH)
+{
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, fb_depthTex);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, decalLayer.colorTex);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, decalLayer.depthTex);
+    glActiveTexture(GL_TEXTURE0);
+    if (layerW == screenW && layerH == screenH) {
+        glUseProgram(decalCompositeShader.prog);
+        glUniform1i(decalCompositeShader.locs.tex, 2);
     }
+    else {
+        const DecalUpsampleShader& decalUpsampleShader = getShaderVariant(decalUpsampleShaderVariants, params.reverseZ);
+        glUseProgram(decalUpsampleShader.prog);
+        glUniform1i(decalUpsampleShader.locs.layerTex, 2);
+        glUniform1i(decalUpsampleShader.locs.layerDepthTex, 4);
+        glUniform1i(decalUpsampleShader.locs.depthTex, 1);
+        glUniform2i(decalUpsampleShader.locs.layerSize, layerW, layerH);
+        glUniform1f(decalUpsampleShader.locs.near, CAMERA_NEAR_DIST);
+        glUniform1f(decalUpsampleShader.locs.far, CAMERA_FAR_DIST);
+    }
+    // scene * transmittance + color
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glBlendFunc(GL_ONE, GL_SRC_ALPHA);
+    glBindVertexArray(emptyVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+    frameStats.decalDrawCalls++;
 }
 
-static void drawNodeRecursive(const cgltf_data& data, const cgltf_node& node,
-    const mat4& viewMtx, const mat4& viewProjMtx, const mat4& parentModelMtx = mat4(1))
+// min/max depth (and depth slices) of the screen tiles into decalTiles.tilesBo, which is left bound to SSBO binding 3
+// from the depth in texture unit 1, viewW x viewH
+static void computeTileDepths(int viewW, int viewH)
 {
-    mat4 modelMtx;
-    cgltf_node_transform_local(&node, &modelMtx[0][0]);
-    modelMtx = parentModelMtx * modelMtx;
-    
-    if (node.mesh) {
-        auto& mesh = *node.mesh;
-        drawMesh(data, mesh, viewMtx, viewProjMtx, modelMtx);
+    decalTiles.viewW = viewW;
+    decalTiles.viewH = viewH;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, decalTiles.tilesBo);
+    const TileDepthShader& tileDepthShader = getShaderVariant(tileDepthShaderVariants, params.reverseZ);
+    glUseProgram(tileDepthShader.prog);
+    glUniform1i(tileDepthShader.locs.depthTex, 1);
+    glUniform2i(tileDepthShader.locs.viewSize, viewW, viewH);
+    glUniform1f(tileDepthShader.locs.near, CAMERA_NEAR_DIST);
+    glUniform1f(tileDepthShader.locs.far, CAMERA_FAR_DIST);
+    glDispatchCompute((viewW + TILE_SIZE - 1) / TILE_SIZE, (viewH + TILE_SIZE - 1) / TILE_SIZE, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// the tiled path: the visible decals are binned into the screen tiles, then resolved in a compute pass into decalLayer.colorTex
+// expects the depth in texture unit 1 (viewW x viewH, smaller than the screen at low resolution), the noise cubemaps in unit 3 and the materials UBO bound
+// returns false if there was nothing to resolve
+static bool resolveDecalsTiled(const mat4& viewMtx, const mat4& projMtx, int viewW, int viewH)
+{
+    uploadDirtyInstances();
+    if (decals.size() == 0)
+        return false;
+    const mat4 viewProjMtx = projMtx * viewMtx;
+    cullInstancesOnGpu(makeFrustum(viewProjMtx, params.reverseZ), viewProjMtx, proxyMeshes[DECAL_PROXY_ICOSPHERE], false, false);
+    computeTileDepths(viewW, viewH);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpuCulling.visibleBo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpuCulling.indirectBo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, decalTiles.tileDecalsBo);
+    const u32 numTilesX = (viewW + TILE_SIZE - 1) / TILE_SIZE;
+    const u32 numTilesY = (viewH + TILE_SIZE - 1) / TILE_SIZE;
+
+    glUseProgram(tileBinShader.prog);
+    glUniformMatrix4fv(tileBinShader.locs.view, 1, GL_FALSE, &viewMtx[0][0]);
+    glUniform2f(tileBinShader.locs.tanHalfFov, 1 / projMtx[0][0], 1 / projMtx[1][1]);
+    glUniform2i(tileBinShader.locs.viewSize, viewW, viewH);
+    glUniform1i(tileBinShader.locs.useDepthMask, params.tileDepthMask);
+    if (decalTiles.overflowFence && glClientWaitSync(decalTiles.overflowFence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+        u32 overflow[2];
+        glBindBuffer(GL_COPY_READ_BUFFER, decalTiles.overflowReadbackBo);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(overflow), overflow);
+        decalTiles.overflowTiles = overflow[0];
+        decalTiles.droppedDecals = overflow[1];
+        glDeleteSync(decalTiles.overflowFence);
+        decalTiles.overflowFence = nullptr;
     }
-    for (size_t childInd = 0; childInd < node.children_count; childInd++)
-        drawNodeRecursive(data, *node.children[childInd], viewMtx, viewProjMtx, modelMtx);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, decalTiles.overflowBo);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, decalTiles.overflowBo);
+    glDispatchCompute(numTilesX, numTilesY, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT); // the resolve reads the tiles, the copy the overflow counters
+    if (!decalTiles.overflowFence) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, decalTiles.overflowReadbackBo);
+        glCopyBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, 2 * sizeof(u32));
+        decalTiles.overflowFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    const mat4 invViewProj = glm::inverse(viewProjMtx);
+    u32 resolveKey = u32(params.noiseBackend) << DECAL_KEY_NOISE_BACKEND_SHIFT;
+    if (params.lod)
+        resolveKey |= DECAL_KEY_LOD_BIT;
+    if (params.tileHeatmap)
+        resolveKey |= DECAL_KEY_HEATMAP_BIT;
+    if (params.reverseZ)
+        resolveKey |= DECAL_KEY_REVERSE_Z_BIT;
+    const TileResolveShader& tileResolveShader = getShaderVariant(tileResolveShaderVariants, resolveKey);
+    glUseProgram(tileResolveShader.prog);
+    glUniform1i(tileResolveShader.locs.depthTex, 1);
+    glUniform2i(tileResolveShader.locs.viewSize, viewW, viewH);
+    glUniformMatrix4fv(tileResolveShader.locs.invViewProj, 1, GL_FALSE, &invViewProj[0][0]);
+    glUniformMatrix4fv(tileResolveShader.locs.viewProj, 1, GL_FALSE, &viewProjMtx[0][0]);
+    setLodUniforms(tileResolveShader.locs.lod);
+    glUniform1f(tileResolveShader.locs.time, decals.time);
+    glUniform1f(tileResolveShader.locs.growDuration, params.growDuration);
+    glUniform1f(tileResolveShader.locs.growStart, params.growStart);
+    glUniform1f(tileResolveShader.locs.fadeDuration, params.fadeDuration);
+    glUniform1i(tileResolveShader.locs.noiseCubes, 3);
+    glBindImageTexture(0, decalLayer.colorTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    glDispatchCompute(numTilesX, numTilesY, 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    return true;
 }
 
 int main()
@@ -414,6 +4055,7 @@ int main()
         return 1;
     }
     glad_set_post_callback(glErrorCallback);
+    loadGlExtensions((GLADloadproc)glfwGetProcAddress, glfwExtensionSupported);
 
     glfwSetFramebufferSizeCallback(window, [](GLFWwindow* window, int w, int h) { resizeFbo(w, h); });
     glfwSetMouseButtonCallback(window, [](GLFWwindow* window, int button, int action, int mods) {} );
@@ -443,41 +4085,207 @@ int main()
         glGenFramebuffers(1, &fbo);
         glBindFramebuffer(GL_FRAMEBUFFER, fbo);
         glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, fb_colorRbo);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, fb_depthTex, 0);
-    }
-
-    sceneShader.prog = easyCreateShaderProg("pbr", shader_srcs::scene_vert, shader_srcs::scene_frag);
-    sceneShader.locs.modelMtx = glGetUniformLocation(sceneShader.prog, "u_modelMtx");
-    sceneShader.locs.modelView = glGetUniformLocation(sceneShader.prog, "u_modelView");
-    sceneShader.locs.modelViewProj = glGetUniformLocation(sceneShader.prog, "u_modelViewProj");
-    sceneShader.locs.tex = glGetUniformLocation(sceneShader.prog, "u_tex");
-    glUseProgram(sceneShader.prog);
-    glUniform1i(sceneShader.locs.tex, 0);
-
-    decalShader.prog = easyCreateShaderProg("decal", shader_srcs::decal_vert, shader_srcs::decal_frag);
-    decalShader.locs.invScreenSize = glGetUniformLocation(decalShader.prog, "u_invScreenSize");
-    decalShader.locs.invViewProj = glGetUniformLocation(decalShader.prog, "u_invViewProj");
-    decalShader.locs.viewProj = glGetUniformLocation(decalShader.prog, "u_viewProj");
-    decalShader.locs.spherePos = glGetUniformLocation(decalShader.prog, "u_spherePos");
-    decalShader.locs.sphereRad = glGetUniformLocation(decalShader.prog, "u_sphereRad");
-    decalShader.locs.envRotation = glGetUniformLocation(decalShader.prog, "u_envRotation");
-    decalShader.locs.depthTex = glGetUniformLocation(decalShader.prog, "u_depthTex");
-    decalShader.locs.noiseFreq = glGetUniformLocation(decalShader.prog, "u_noiseFreq");
-    decalShader.locs.centerBase = glGetUniformLocation(decalShader.prog, "u_centerBase");
-    decalShader.locs.exponent = glGetUniformLocation(decalShader.prog, "u_exponent");
-    decalShader.locs.displayMode = glGetUniformLocation(decalShader.prog, "u_displayMode");
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, fb_depthTex, 0); // the stencil is for the sphere volumes
+
+        glGenTextures(1, &frameCache.sceneColorTex);
+        glBindTexture(GL_TEXTURE_2D, frameCache.sceneColorTex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    // the variants of the default params. The rest are compiled when they are selected
+    getShaderVariant(sceneShaderVariants, scorchAtlas.numResident ? SCENE_KEY_SCORCH_ATLAS_BIT : 0);
+    getShaderVariant(decalShaderVariants, decalShaderKey());
+    getShaderVariant(decalStencilShaderVariants, decalShaderKey() & DECAL_KEY_LOD_BIT);
+    getShaderVariant(tileResolveShaderVariants, u32(params.noiseBackend) << DECAL_KEY_NOISE_BACKEND_SHIFT);
+    getShaderVariant(tileDepthShaderVariants, params.reverseZ);
+    getShaderVariant(decalUpsampleShaderVariants, params.reverseZ);
+    getShaderVariant(linearDepthShaderVariants, params.reverseZ);
+    printf("Shader variants: decal %u, decal_stencil %u, tile_resolve %u possible. Compiled the defaults in %.1fms\n",
+        decalShaderVariants.numPossible, decalStencilShaderVariants.numPossible, tileResolveShaderVariants.numPossible,
+        decalShaderVariants.compileMs + decalStencilShaderVariants.compileMs + tileResolveShaderVariants.compileMs +
+        tileDepthShaderVariants.compileMs + decalUpsampleShaderVariants.compileMs + linearDepthShaderVariants.compileMs);
+
+    {
+        // the LOD is disabled at runtime with u_lodPixelScale = 0
+        const ShaderDefine defines[] = { { "DECAL_LOD", 1 } };
+        const std::string definesSrc = makeDefinesSrc(defines);
+        const char* srcs[] = { definesSrc.c_str(), shader_srcs::instance_common, shader_srcs::lod_common, shader_srcs::tile_common, shader_srcs::cull_comp };
+        cullShader.prog = easyCreateComputeProg("cull", srcs);
+    }
+    cullShader.locs.pass = glGetUniformLocation(cullShader.prog, "u_pass");
+    cullShader.locs.frustumPlanes = glGetUniformLocation(cullShader.prog, "u_frustumPlanes");
+    cullShader.locs.numInstances = glGetUniformLocation(cullShader.prog, "u_numInstances");
+    cullShader.locs.viewProj = glGetUniformLocation(cullShader.prog, "u_viewProj");
+    cullShader.locs.meshLods = glGetUniformLocation(cullShader.prog, "u_meshLods");
+    cullShader.locs.tileDepthReject = glGetUniformLocation(cullShader.prog, "u_tileDepthReject");
+    cullShader.locs.viewSize = glGetUniformLocation(cullShader.prog, "u_viewSize");
+    cullShader.locs.lod = getLodLocs(cullShader.prog);
+
+    {
+        const char* srcs[] = { shader_srcs::instance_common, shader_srcs::tile_common, shader_srcs::tile_bin_comp };
+        tileBinShader.prog = easyCreateComputeProg("tile_bin", srcs);
+    }
+    tileBinShader.locs.view = glGetUniformLocation(tileBinShader.prog, "u_view");
+    tileBinShader.locs.tanHalfFov = glGetUniformLocation(tileBinShader.prog, "u_tanHalfFov");
+    tileBinShader.locs.viewSize = glGetUniformLocation(tileBinShader.prog, "u_viewSize");
+    tileBinShader.locs.useDepthMask = glGetUniformLocation(tileBinShader.prog, "u_useDepthMask");
+    decalCompositeShader.prog = easyCreateShaderProg("decal_composite", shader_srcs::fullscreen_vert, shader_srcs::decal_composite_frag);
+    decalCompositeShader.locs.tex = glGetUniformLocation(decalCompositeShader.prog, "u_tex");
+    depthDownsampleShader.prog = easyCreateShaderProg("depth_downsample", shader_srcs::fullscreen_vert, shader_srcs::decal_depth_downsample_frag);
+    depthDownsampleShader.locs.depthTex = glGetUniformLocation(depthDownsampleShader.prog, "u_depthTex");
+    depthDownsampleShader.locs.factor = glGetUniformLocation(depthDownsampleShader.prog, "u_factor");
+    depthDownsampleShader.locs.layerSize = glGetUniformLocation(depthDownsampleShader.prog, "u_layerSize");
+    {
+        // the baked noise is the ALU one
+        const std::string definesSrc = makeDecalDefinesSrc(NOISE_BACKEND_ALU << DECAL_KEY_NOISE_BACKEND_SHIFT);
+        const char* srcs[] = { definesSrc.c_str(), shader_srcs::decal_common, shader_srcs::noise_bake_comp };
+        noiseBakeShader.prog = easyCreateComputeProg("noise_bake", srcs);
+    }
+    noiseBakeShader.locs.layer = glGetUniformLocation(noiseBakeShader.prog, "u_layer");
+    {
+        // all the noise octaves with the ALU noise, the bake only happens once per decal
+        const std::string decalDefinesSrc = makeDecalDefinesSrc(NOISE_BACKEND_ALU << DECAL_KEY_NOISE_BACKEND_SHIFT);
+        const std::string sceneDefinesSrc = makeSceneDefinesSrc(SCENE_KEY_SCORCH_ATLAS_BIT);
+        const char* vertSrcs[] = { sceneDefinesSrc.c_str(), shader_srcs::scorch_bake_vert };
+        const char* fragSrcs[] = { decalDefinesSrc.c_str(), shader_srcs::decal_common, shader_srcs::instance_common, shader_srcs::scorch_bake_frag };
+        scorchBakeShader.prog = easyCreateShaderProg("scorch_bake", vertSrcs, fragSrcs);
+    }
+    scorchBakeShader.locs.modelMtx = glGetUniformLocation(scorchBakeShader.prog, "u_modelMtx");
+    scorchBakeShader.locs.pageOrigin = glGetUniformLocation(scorchBakeShader.prog, "u_pageOrigin");
+    scorchBakeShader.locs.firstDecal = glGetUniformLocation(scorchBakeShader.prog, "u_firstDecal");
+    scorchBakeShader.locs.numDecals = glGetUniformLocation(scorchBakeShader.prog, "u_numDecals");
 
     createIcoSphereMesh(sphere.vao, sphere.vbo, sphere.ebo, sphere.numInds, 2);
+    createProxyMeshes();
     {
         glGenBuffers(1, &sphere.instancingVbo);
-        glBindBuffer(GL_ARRAY_BUFFER, sphere.instancingVbo);
-        
-        // modelMtx
-        for (int i = 0; i < 4; i++) {
-            glEnableVertexAttribArray(2 + i);
-            glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void*)(i * sizeof(vec4)) );
-            glVertexAttribDivisor(2 + i, 1);
+
+        // the instancing attributes read from binding 1, so we can switch between the instancing buffers with glBindVertexBuffer
+        glEnableVertexAttribArray(2); // sphere
+        glVertexAttribFormat(2, 4, GL_FLOAT, GL_FALSE, offsetof(InstancingData, pos));
+        glVertexAttribBinding(2, 1);
+        glEnableVertexAttribArray(3); // rot
+        glVertexAttribFormat(3, 3, GL_SHORT, GL_TRUE, offsetof(InstancingData, rot));
+        glVertexAttribBinding(3, 1);
+        glEnableVertexAttribArray(6); // material
+        glVertexAttribIFormat(6, 1, GL_UNSIGNED_SHORT, offsetof(InstancingData, material));
+        glVertexAttribBinding(6, 1);
+        glEnableVertexAttribArray(4); // spawnTime
+        glVertexAttribFormat(4, 1, GL_FLOAT, GL_FALSE, offsetof(InstancingData, spawnTime));
+        glVertexAttribBinding(4, 1);
+        glEnableVertexAttribArray(5); // params
+        glVertexAttribFormat(5, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(InstancingData, params));
+        glVertexAttribBinding(5, 1);
+        glEnableVertexAttribArray(7); // extents
+        glVertexAttribFormat(7, 3, GL_FLOAT, GL_FALSE, offsetof(InstancingData, extents));
+        glVertexAttribBinding(7, 1);
+        glEnableVertexAttribArray(8); // shape
+        glVertexAttribIFormat(8, 1, GL_UNSIGNED_INT, offsetof(InstancingData, shape));
+        glVertexAttribBinding(8, 1);
+        glVertexBindingDivisor(1, 1);
+        createInstanceRing(1024);
+        glGenBuffers(1, &instanceBuffer.bo);
+        glGenQueries(DECAL_SAMPLES_QUERIES, decalSamplesStats.queries);
+        createGpuTimer(decalPassTimer);
+        createGpuTimer(scenePassTimer);
+        createGpuTimer(lightingPassTimer);
+        createGpuCounter(decalShadeInvocations, GL_FRAGMENT_SHADER_INVOCATIONS);
+        createGpuCounter(decalMarkInvocations, GL_FRAGMENT_SHADER_INVOCATIONS);
+        createGpuCounter(decalVertexInvocations, GL_VERTEX_SHADER_INVOCATIONS);
+        initDecalMaterials();
+        glGenBuffers(1, &decalMaterialsUbo);
+        glBindBuffer(GL_UNIFORM_BUFFER, decalMaterialsUbo);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(decalMaterials), decalMaterials, GL_DYNAMIC_DRAW);
+        glGenBuffers(1, &gpuCulling.visibleBo);
+        glGenBuffers(1, &gpuCulling.indirectBo);
+        glGenBuffers(1, &gpuCulling.instanceLodsBo);
+        glGenBuffers(1, &gpuCulling.groupOffsetsBo);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCulling.indirectBo);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, DECAL_MESH_LODS * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+    }
+    {
+        glGenBuffers(1, &decalTiles.tilesBo);
+        glGenBuffers(1, &decalTiles.tileDecalsBo);
+        glGenBuffers(1, &decalTiles.overflowBo);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, decalTiles.overflowBo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(u32), nullptr, GL_DYNAMIC_COPY);
+        glGenBuffers(1, &decalTiles.overflowReadbackBo);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, decalTiles.overflowReadbackBo);
+        glBufferData(GL_COPY_WRITE_BUFFER, 2 * sizeof(u32), nullptr, GL_STREAM_READ);
+        glGenVertexArrays(1, &emptyVao);
+        glGenTextures(1, &decalLayer.colorTex);
+        glBindTexture(GL_TEXTURE_2D, decalLayer.colorTex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenTextures(1, &decalLayer.depthTex);
+        glBindTexture(GL_TEXTURE_2D, decalLayer.depthTex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        // the storage is created in resizeFbo, before the first frame
+        glGenFramebuffers(1, &decalLayer.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, decalLayer.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, decalLayer.colorTex, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, decalLayer.depthTex, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    {
+        glGenTextures(1, &linearDepth.tex);
+        glBindTexture(GL_TEXTURE_2D, linearDepth.tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        // the storage is created in resizeFbo
+        glGenFramebuffers(1, &linearDepth.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, linearDepth.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, linearDepth.tex, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    {
+        for (u32* tex : { &gbuffer.albedoTex, &gbuffer.normalTex, &gbuffer.roughnessTex }) {
+            glGenTextures(1, tex);
+            glBindTexture(GL_TEXTURE_2D, *tex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         }
+        // the storage is created in resizeFbo
+        glGenFramebuffers(1, &gbuffer.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gbuffer.albedoTex, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gbuffer.normalTex, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, gbuffer.roughnessTex, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, fb_depthTex, 0);
+        const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+        glDrawBuffers(3, drawBuffers);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    {
+        int maxColorSamples, maxDepthSamples;
+        glGetIntegerv(GL_MAX_SAMPLES, &maxColorSamples);
+        glGetIntegerv(GL_MAX_DEPTH_TEXTURE_SAMPLES, &maxDepthSamples);
+        msaaTarget.maxSamples = glm::min(maxColorSamples, maxDepthSamples);
+        // the storage is created and attached in resizeFbo, when MSAA is enabled
+        glGenRenderbuffers(1, &msaaTarget.colorRbo);
+        glGenTextures(1, &msaaTarget.depthTex);
+        glGenFramebuffers(1, &msaaTarget.fbo);
+    }
+    createNoiseCubes();
+    {
+        glGenTextures(1, &scorchAtlasGl.atlasTex);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, scorchAtlasGl.atlasTex);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, SCORCH_LAYER_SIZE, SCORCH_LAYER_SIZE, SCORCH_PHYSICAL_PAGES);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glGenTextures(1, &scorchAtlasGl.pageTableTex);
+        glBindTexture(GL_TEXTURE_2D, scorchAtlasGl.pageTableTex);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_R16UI, SCORCH_VIRTUAL_PAGES, SCORCH_VIRTUAL_PAGES);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenFramebuffers(1, &scorchAtlasGl.fbo);
+        glGenBuffers(1, &scorchAtlasGl.decalsBo);
+        scorchAtlas.init(SCORCH_PHYSICAL_PAGES);
+        updateScorchPageTable();
     }
 
 
@@ -566,9 +4374,14 @@ int main()
         }
     }
 
+    createScorchLightmaps(*cgltfData);
+
+    selectedDecal = decals.spawn({ .pos = vec3(0, 0.045, 0), .rot = glm::quat(1, 0, 0, 0), .radius = params.sphereRad });
+
     glClearColor(0.4, 0.4, 0.4, 0);
 
     bool firstFrame = true;
+    double prevFrameTime = glfwGetTime();
     while (!glfwWindowShouldClose(window))
     {
         glfwPollEvents();
@@ -578,21 +4391,29 @@ int main()
             continue;
         const float aspectRatio = float(screenW) / screenH;
 
+        decals.update(glfwGetTime());
+        drainDecalCommands();
+
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
         ImGuizmo::BeginFrame();
         ImGuizmo::SetRect(0, 0, screenW, screenH);
 
-        if (firstFrame)
+        if (!glClipControl)
+            params.reverseZ = false;
+        if (firstFrame || params.reverseZ != fbReverseZ || msaaSamples() != msaaTarget.samples)
             resizeFbo(screenW, screenH);
+        if (glClipControl)
+            glClipControl(GL_LOWER_LEFT, params.reverseZ ? GL_ZERO_TO_ONE : GL_NEGATIVE_ONE_TO_ONE);
+        glClearDepth(params.reverseZ ? 0 : 1);
 
         glBindFramebuffer(GL_FRAMEBUFFER, fbo);
         glEnable(GL_DEPTH_TEST);
+        glDepthFunc(depthFuncCloser());
         glDepthMask(GL_TRUE);
         glDisable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         {
             static double prevMx = 0, prevMy = 0;
@@ -631,47 +4452,381 @@ int main()
                 glm::transpose(camRot) *
                 glm::translate(mat4(1), -camera.pos);
 
-            projMtx = glm::perspective(1.f, aspectRatio, CAMERA_NEAR_DIST, CAMERA_FAR_DIST);
+            projMtx = makeProjMtx(aspectRatio);
         }
         const auto viewProjMtx = projMtx * viewMtx;
+        const auto invViewProj = inverse(viewProjMtx);
 
-        // -- draw the room --
-        assert(cgltfData->scenes_count);
-        auto& scene = cgltfData->scenes[0];
-        for (size_t nodeInd = 0; nodeInd < scene.nodes_count; nodeInd++)
-            drawNodeRecursive(*cgltfData, *scene.nodes[nodeInd], viewMtx, viewProjMtx);
+        if (!ImGui::GetIO().WantCaptureMouse && ImGui::IsMouseClicked(ImGuiMouseButton_Right)) {
+            // pick the decal under the cursor
+            const vec2 mouse = ImGui::GetIO().MousePos;
+            const vec2 ndc(2 * mouse.x / screenW - 1, 1 - 2 * mouse.y / screenH);
+            const vec4 nearPos = invViewProj * vec4(ndc, params.reverseZ ? 1 : -1, 1);
+            const vec4 farPos = invViewProj * vec4(ndc, params.reverseZ ? 0 : 1, 1);
+            const vec3 rayOrigin = vec3(nearPos) / nearPos.w;
+            const vec3 rayDir = normalize(vec3(farPos) / farPos.w - rayOrigin);
+            const u32 slot = decals.grid.raycast(rayOrigin, rayDir, CAMERA_FAR_DIST);
+            selectedDecal = slot == INVALID_DECAL_INDEX ? INVALID_DECAL_HANDLE : DecalHandle{ slot, decals.generations[slot] };
+        }
+
+        glBindBuffer(GL_UNIFORM_BUFFER, decalMaterialsUbo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(decalMaterials), decalMaterials);
+        glBindBufferBase(GL_UNIFORM_BUFFER, 0, decalMaterialsUbo);
+
+        // -- bake the settled decals into the scorch atlas --
+        if (params.scorchAtlas) {
+            if (bakeSettledDecals(makeFrustum(viewProjMtx, params.reverseZ), screenW, screenH))
+                frameCache.sceneDirty = true;
+        }
+        if (scorchAtlas.numResident) {
+            glActiveTexture(GL_TEXTURE6);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, scorchAtlasGl.atlasTex);
+            glActiveTexture(GL_TEXTURE7);
+            glBindTexture(GL_TEXTURE_2D, scorchAtlasGl.pageTableTex);
+            glActiveTexture(GL_TEXTURE0);
+        }
+
+        const EFrameRedraw redraw = updateFrameCache(viewMtx, projMtx);
+        const bool deferred = deferredShading();
+        const bool msaa = msaaSamples() > 1;
+        if (redraw == FRAME_REDRAW_ALL) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+            // -- draw the room --
+            beginGpuTimer(scenePassTimer);
+            if (deferred) { // the lighting pass leaves the background of the fbo untouched, so it's cleared above
+                glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+                glEnable(GL_FRAMEBUFFER_SRGB); // only affects the albedo
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
+            if (msaa) {
+                glBindFramebuffer(GL_FRAMEBUFFER, msaaTarget.fbo);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+            }
+            assert(cgltfData->scenes_count);
+            auto& scene = cgltfData->scenes[0];
+            for (size_t nodeInd = 0; nodeInd < scene.nodes_count; nodeInd++)
+                drawNodeRecursive(*cgltfData, *scene.nodes[nodeInd], viewMtx, viewProjMtx);
+            endGpuTimer();
+            if (!deferred && !msaa)
+                glCopyImageSubData(fb_colorRbo, GL_RENDERBUFFER, 0, 0, 0, 0, frameCache.sceneColorTex, GL_TEXTURE_2D, 0, 0, 0, 0, screenW, screenH, 1);
+        }
+        else if (redraw == FRAME_REDRAW_DECALS) {
+            glCopyImageSubData(frameCache.sceneColorTex, GL_TEXTURE_2D, 0, 0, 0, 0, fb_colorRbo, GL_RENDERBUFFER, 0, 0, 0, 0, screenW, screenH, 1);
+            glClear(GL_STENCIL_BUFFER_BIT);
+        }
 
         // -- draw decals --
         glEnable(GL_BLEND);
         glDepthMask(GL_FALSE);
         glCullFace(GL_FRONT); // This is so the sphere doesn't get culled when the camera is inside it
-        glDepthFunc(GL_GREATER); // Depth testing optimized for spheres that are usually above the surface
-        glUseProgram(decalShader.prog);
-        const auto invViewProj = inverse(viewProjMtx);
-        glUniformMatrix4fv(decalShader.locs.viewProj, 1, GL_FALSE, &viewProjMtx[0][0]);
-        glUniformMatrix4fv(decalShader.locs.invViewProj, 1, GL_FALSE, &invViewProj[0][0]);
+        glDepthFunc(depthFuncFarther()); // Depth testing optimized for spheres that are usually above the surface
         glActiveTexture(GL_TEXTURE1);
         glBindTexture(GL_TEXTURE_2D, fb_depthTex);
+        if (msaa)
+            glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, msaaTarget.depthTex);
         glActiveTexture(GL_TEXTURE0);
-        glUniform1i(decalShader.locs.depthTex, 1);
-        glUniform1f(decalShader.locs.sphereRad, params.sphereRad);
-        glUniform1f(decalShader.locs.noiseFreq, params.noiseFreq);
-        glUniform1f(decalShader.locs.centerBase, params.centerBase);
-        glUniform1f(decalShader.locs.exponent, params.exponent);
-        glUniform1i(decalShader.locs.displayMode, params.displayMode);
-        glUniform2f(decalShader.locs.invScreenSize, 1.f / screenW, 1.f / screenH);
-        std::vector<InstancingData> instancingData;
-        for (size_t i = 0; i < decals.positions.size(); i++) {
-            mat4 modelMtx(1);
-            modelMtx = glm::translate(modelMtx, decals.positions[i]);
-            modelMtx = modelMtx * mat4(decals.rotations[i]);
-            instancingData.push_back({ modelMtx });
-        }
-        glBindVertexArray(sphere.vao);
-        glBindBuffer(GL_ARRAY_BUFFER, sphere.instancingVbo);
-        glBufferData(GL_ARRAY_BUFFER, instancingData.size() * sizeof(InstancingData), instancingData.data(), GL_STREAM_DRAW);
-        glDrawElementsInstanced(GL_TRIANGLES, sphere.numInds, GL_UNSIGNED_INT, nullptr, instancingData.size());
-        glDepthFunc(GL_LESS); // restore default depth testing
+        if (params.noiseBackend == NOISE_BACKEND_CUBEMAP)
+            updateNoiseCubes();
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, noiseCubes.tex);
+        glActiveTexture(GL_TEXTURE0);
+        // the incremental path keeps the instances on the GPU, so they are culled there. The other paths cull on the CPU as they rebuild the instancing data anyway
+        const bool tiled = params.decalPath == DECAL_PATH_TILED;
+        const bool cullOnGpu = !tiled && params.frustumCulling && instanceUpload == INSTANCE_UPLOAD_INCREMENTAL && decals.size();
+        const bool cullOnCpu = !tiled && params.frustumCulling && instanceUpload != INSTANCE_UPLOAD_INCREMENTAL;
+        const bool drawPerMaterial = !tiled && params.drawPerMaterial && instanceUpload != INSTANCE_UPLOAD_INCREMENTAL;
+        u32 numInstances = decals.size();
+        // at low resolution the decals are drawn into the decal layer, then upsampled. The tiled path always goes through the decal layer
+        const u32 resFactor = 1u << params.decalResolution;
+        const bool lowRes = resFactor > 1;
+        const int layerW = (screenW + resFactor - 1) / resFactor;
+        const int layerH = (screenH + resFactor - 1) / resFactor;
+        bool compositeLayer = lowRes;
+        lodPixelScale = params.lod ? 0.5f * layerH * projMtx[1][1] : 0.f;
+        // the mesh LOD is chosen while culling, so the paths that don't cull, or sort by material, use the most detailed one
+        const bool meshLods = params.lod && params.decalProxy == DECAL_PROXY_ICOSPHERE && (cullOnGpu || cullOnCpu) && !drawPerMaterial;
+        if (redraw != FRAME_REDRAW_NONE) {
+            frameStats.decalDrawCalls = 0;
+            beginGpuTimer(decalPassTimer);
+            if (deferred) { // the decals blend into the albedo and the roughness, the normals are left as they are
+                const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_NONE, GL_COLOR_ATTACHMENT2 };
+                glDrawBuffers(3, drawBuffers);
+            }
+            if (lowRes)
+                beginLowResDecalLayer(layerW, layerH, resFactor);
+            if (tiled) {
+                instanceUploadStats.uploadedBytes = instanceUploadStats.uploadedRanges = 0;
+                compositeLayer = resolveDecalsTiled(viewMtx, projMtx, layerW, layerH);
+            }
+            else {
+                // these read the depth as a single sample texture
+                const bool viewRays = params.viewRays && !msaa;
+                const bool tileDepthReject = params.tileDepthReject && !msaa;
+                if (viewRays)
+                    writeLinearDepth(layerW, layerH, lowRes ? decalLayer.fbo : deferred ? gbuffer.fbo : fbo);
+                if (tileDepthReject)
+                    computeTileDepths(layerW, layerH);
+                const DecalShader& decalShader = getShaderVariant(decalShaderVariants, decalShaderKey());
+                glUseProgram(decalShader.prog);
+                glUniform2i(decalShader.locs.viewSize, layerW, layerH);
+                if (viewRays) {
+                    const ViewRays rays = calcViewRays(viewMtx, projMtx);
+                    glUniform1i(decalShader.locs.linearDepthTex, 5);
+                    glUniform3fv(decalShader.locs.camPos, 1, &rays.camPos[0]);
+                    glUniform3fv(decalShader.locs.viewRay00, 1, &rays.ray00[0]);
+                    glUniform3fv(decalShader.locs.viewRayDx, 1, &rays.dx[0]);
+                    glUniform3fv(decalShader.locs.viewRayDy, 1, &rays.dy[0]);
+                }
+                glUniformMatrix4fv(decalShader.locs.viewProj, 1, GL_FALSE, &viewProjMtx[0][0]);
+                glUniformMatrix4fv(decalShader.locs.invViewProj, 1, GL_FALSE, &invViewProj[0][0]);
+                glUniform1i(decalShader.locs.depthTex, 1);
+                glUniform1i(decalShader.locs.materialOverride, -1);
+                glUniform1f(decalShader.locs.time, decals.time);
+                glUniform1f(decalShader.locs.growDuration, params.growDuration);
+                glUniform1f(decalShader.locs.growStart, params.growStart);
+                glUniform1f(decalShader.locs.fadeDuration, params.fadeDuration);
+                glUniform1i(decalShader.locs.noiseCubes, 3);
+                glUniform2f(decalShader.locs.invScreenSize, 1.f / layerW, 1.f / layerH);
+                if (lowRes) // the color is blended like in the scene, the alpha accumulates the transmittance
+                    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+                glUniformMatrix4fv(decalShader.locs.view, 1, GL_FALSE, &viewMtx[0][0]);
+                glUniformMatrix4fv(decalShader.locs.proj, 1, GL_FALSE, &projMtx[0][0]);
+                setLodUniforms(decalShader.locs.lod);
+                glBindVertexArray(sphere.vao);
+                const ProxyMesh& proxy = proxyMeshes[params.decalProxy];
+                glBindVertexBuffer(0, proxy.vbo, 0, sizeof(vec3));
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, proxy.ebo);
+                const double uploadStartTime = glfwGetTime();
+                if (cullOnCpu) {
+                    cullDecals(makeFrustum(viewProjMtx, params.reverseZ));
+                    if (params.lod)
+                        selectDecalLods(viewProjMtx, meshLods);
+                    numInstances = visibleInds.size();
+                }
+                if (drawPerMaterial)
+                    sortDecalsByMaterial(cullOnCpu);
+                // writes the instances that are going to be drawn by the CPU upload paths
+                auto writeInstances = [&](InstancingData* dst) {
+                    if (drawPerMaterial)
+                        writeInstancingData(dst, materialSortedInds);
+                    else if (cullOnCpu)
+                        writeInstancingData(dst, visibleInds);
+                    else
+                        writeInstancingData(dst, 0, decals.size());
+                };
+                instanceUploadStats.uploadedBytes = instanceUploadStats.uploadedRanges = 0;
+                if (instanceUpload == INSTANCE_UPLOAD_INCREMENTAL) {
+                    uploadDirtyInstances();
+                    if (cullOnGpu) {
+                        cullInstancesOnGpu(makeFrustum(viewProjMtx, params.reverseZ), viewProjMtx, proxy, meshLods, tileDepthReject);
+                        glUseProgram(decalShader.prog);
+                        glBindVertexBuffer(1, gpuCulling.visibleBo, 0, sizeof(InstancingData));
+                    }
+                    else
+                        glBindVertexBuffer(1, instanceBuffer.bo, 0, sizeof(InstancingData));
+                }
+                else {
+                    // these paths upload everything, so the dirty ranges are not needed. The GPU mirror becomes stale
+                    decals.dirtyInds.clear();
+                    instanceBuffer.valid = false;
+                    instanceUploadStats.uploadedBytes = numInstances * sizeof(InstancingData);
+                    instanceUploadStats.uploadedRanges = 1;
+                }
+                if (instanceUpload == INSTANCE_UPLOAD_ORPHAN) {
+                    std::vector<InstancingData> instancingData(numInstances);
+                    writeInstances(instancingData.data());
+                    glBindBuffer(GL_ARRAY_BUFFER, sphere.instancingVbo);
+                    glBufferData(GL_ARRAY_BUFFER, instancingData.size() * sizeof(InstancingData), instancingData.data(), GL_STREAM_DRAW);
+                    glBindVertexBuffer(1, sphere.instancingVbo, 0, sizeof(InstancingData));
+                }
+                else if (instanceUpload == INSTANCE_UPLOAD_RING) {
+                    size_t offset;
+                    InstancingData* dst = beginInstanceRingRegion(numInstances, offset);
+                    writeInstances(dst);
+                    endInstanceRingRegion();
+                    glBindVertexBuffer(1, instanceRing.bo, offset, sizeof(InstancingData));
+                }
+                const float uploadMs = 1000 * (glfwGetTime() - uploadStartTime);
+                instanceUploadStats.cpuMs = glm::mix(instanceUploadStats.cpuMs, uploadMs, 0.05f);
+                if (cullOnGpu)
+                    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCulling.indirectBo);
+                // all the instances, with the mesh LODs chosen by the culling. Not for drawPerMaterial
+                auto drawProxies = [&]() {
+                    if (cullOnGpu) {
+                        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, DECAL_MESH_LODS, 0);
+                        frameStats.decalDrawCalls++;
+                    }
+                    else if (meshLods) {
+                        for (u32 lod = 0; lod < DECAL_MESH_LODS; lod++) {
+                            const u32 first = lodInstanceOffsets[lod];
+                            const u32 count = lodInstanceOffsets[lod + 1] - first;
+                            if (count == 0)
+                                continue;
+                            const ProxyMesh::Lod& meshLod = proxy.lods[lod];
+                            glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, meshLod.numInds, GL_UNSIGNED_INT,
+                                (void*)(meshLod.firstInd * sizeof(u32)), count, meshLod.baseVertex, first);
+                            frameStats.decalDrawCalls++;
+                        }
+                    }
+                    else {
+                        glDrawElementsInstanced(GL_TRIANGLES, proxy.numInds, GL_UNSIGNED_INT, nullptr, numInstances);
+                        frameStats.decalDrawCalls++;
+                    }
+                };
+                // Sphere volumes, like the light volumes of deferred shading: the stencil counts the sphere faces behind the surface,
+                // +1 for the back faces and -1 for the front faces. It ends up != 0 only where the surface is inside of some sphere (also with the camera inside).
+                // The screen quads are not closed volumes, so they can't do this
+                const bool stencilVolumes = useStencilVolumes();
+                if (stencilVolumes) {
+                    const DecalStencilShader& decalStencilShader = getShaderVariant(decalStencilShaderVariants, decalShaderKey() & DECAL_KEY_LOD_BIT);
+                    glUseProgram(decalStencilShader.prog);
+                    glUniformMatrix4fv(decalStencilShader.locs.viewProj, 1, GL_FALSE, &viewProjMtx[0][0]);
+                    glUniform1f(decalStencilShader.locs.time, decals.time);
+                    glUniform1f(decalStencilShader.locs.growDuration, params.growDuration);
+                    glUniform1f(decalStencilShader.locs.growStart, params.growStart);
+                    glUniform1f(decalStencilShader.locs.fadeDuration, params.fadeDuration);
+                    setLodUniforms(decalStencilShader.locs.lod);
+                    glEnable(GL_STENCIL_TEST);
+                    glStencilFunc(GL_ALWAYS, 0, 0xFF);
+                    glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+                    glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+                    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                    glDisable(GL_CULL_FACE);
+                    glDepthFunc(depthFuncCloser());
+                    beginGpuCounter(decalMarkInvocations);
+                    drawProxies();
+                    endGpuCounter(decalMarkInvocations);
+                    glDepthFunc(depthFuncFarther());
+                    glEnable(GL_CULL_FACE);
+                    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                    glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+                    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+                    glUseProgram(decalShader.prog);
+                }
+                // MSAA edges: flag the pixels whose samples are on different surfaces in the stencil, to shade the decals per sample only there
+                const bool msaaEdges = msaa && params.msaaDecalShading == MSAA_DECAL_SHADING_EDGES;
+                if (msaaEdges) {
+                    const MsaaEdgeShader& msaaEdgeShader = getShaderVariant(msaaEdgeShaderVariants, params.reverseZ);
+                    glUseProgram(msaaEdgeShader.prog);
+                    glUniform1i(msaaEdgeShader.locs.numSamples, msaaTarget.samples);
+                    glUniform1f(msaaEdgeShader.locs.near, CAMERA_NEAR_DIST);
+                    glUniform1f(msaaEdgeShader.locs.far, CAMERA_FAR_DIST);
+                    glEnable(GL_STENCIL_TEST);
+                    glStencilFunc(GL_ALWAYS, 1, 0xFF);
+                    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+                    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                    glDisable(GL_DEPTH_TEST);
+                    glDisable(GL_CULL_FACE);
+                    glBindVertexArray(emptyVao);
+                    beginGpuCounter(decalMarkInvocations);
+                    glDrawArrays(GL_TRIANGLES, 0, 3);
+                    endGpuCounter(decalMarkInvocations);
+                    glBindVertexArray(sphere.vao);
+                    glEnable(GL_CULL_FACE);
+                    glEnable(GL_DEPTH_TEST);
+                    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+                    glUseProgram(decalShader.prog);
+                }
+                {
+                    const u32 query = decalSamplesStats.queries[decalSamplesStats.frame % DECAL_SAMPLES_QUERIES];
+                    if (decalSamplesStats.frame >= DECAL_SAMPLES_QUERIES) {
+                        u32 available;
+                        glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+                        if (available)
+                            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &decalSamplesStats.samples);
+                    }
+                    decalSamplesStats.frame++;
+                    glBeginQuery(GL_SAMPLES_PASSED, query);
+                }
+                beginGpuCounter(decalShadeInvocations);
+                beginGpuCounter(decalVertexInvocations);
+                auto drawDecals = [&]() {
+                    if (drawPerMaterial) {
+                        // what we would have to do without the palette: set the material uniforms and draw, for each material
+                        for (u32 m = 0; m < MAX_DECAL_MATERIALS; m++) {
+                            const u32 first = materialInstanceOffsets[m];
+                            const u32 count = materialInstanceOffsets[m + 1] - first;
+                            if (count == 0)
+                                continue;
+                            glUniform1i(decalShader.locs.materialOverride, m);
+                            glDrawElementsInstancedBaseInstance(GL_TRIANGLES, proxy.numInds, GL_UNSIGNED_INT, nullptr, count, first);
+                            frameStats.decalDrawCalls++;
+                        }
+                    }
+                    else
+                        drawProxies();
+                };
+                // the shader reads the depth of the first covered sample, so it's the same shader per pixel and per sample
+                if (msaaEdges)
+                    glStencilFunc(GL_EQUAL, 0, 0xFF); // the interiors first, per pixel
+                if (msaa && params.msaaDecalShading == MSAA_DECAL_SHADING_SAMPLE) {
+                    glEnable(GL_SAMPLE_SHADING);
+                    glMinSampleShading(1);
+                }
+                drawDecals();
+                if (msaaEdges) { // then the edges, per sample
+                    glStencilFunc(GL_EQUAL, 1, 0xFF);
+                    glEnable(GL_SAMPLE_SHADING);
+                    glMinSampleShading(1);
+                    drawDecals();
+                }
+                glDisable(GL_SAMPLE_SHADING);
+                endGpuCounter(decalVertexInvocations);
+                endGpuCounter(decalShadeInvocations);
+                glEndQuery(GL_SAMPLES_PASSED);
+                glDisable(GL_STENCIL_TEST);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                if (instanceUpload == INSTANCE_UPLOAD_RING)
+                    fenceInstanceRingRegion();
+            }
+            if (lowRes) {
+                glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+                glViewport(0, 0, screenW, screenH);
+            }
+            if (compositeLayer)
+                compositeDecalLayer(screenW, screenH, layerW, layerH);
+            endGpuTimer();
+
+            // -- resolve the MSAA target --
+            if (msaa) {
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, msaaTarget.fbo);
+                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+                glBlitFramebuffer(0, 0, screenW, screenH, 0, 0, screenW, screenH, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+                glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            }
+
+            // -- light the G-buffer --
+            if (deferred) {
+                const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+                glDrawBuffers(3, drawBuffers);
+                glDisable(GL_FRAMEBUFFER_SRGB);
+                glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+                beginGpuTimer(lightingPassTimer);
+                const DeferredLightShader& lightShader = getShaderVariant(deferredLightShaderVariants, params.reverseZ);
+                glUseProgram(lightShader.prog);
+                glUniformMatrix4fv(lightShader.locs.invViewProj, 1, GL_FALSE, &invViewProj[0][0]);
+                glUniform3fv(lightShader.locs.camPos, 1, &camera.pos[0]);
+                glActiveTexture(GL_TEXTURE8);
+                glBindTexture(GL_TEXTURE_2D, gbuffer.albedoTex);
+                glActiveTexture(GL_TEXTURE9);
+                glBindTexture(GL_TEXTURE_2D, gbuffer.normalTex);
+                glActiveTexture(GL_TEXTURE10);
+                glBindTexture(GL_TEXTURE_2D, gbuffer.roughnessTex);
+                glActiveTexture(GL_TEXTURE0);
+                glDisable(GL_DEPTH_TEST);
+                glDisable(GL_BLEND);
+                glDisable(GL_CULL_FACE);
+                glBindVertexArray(emptyVao);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+                glEnable(GL_CULL_FACE);
+                glEnable(GL_BLEND);
+                glEnable(GL_DEPTH_TEST);
+                endGpuTimer();
+            }
+        }
+        glDepthFunc(depthFuncCloser()); // restore default depth testing
         glCullFace(GL_BACK); // restore normal culling
 
         // -- blit from the fbo to the window --
@@ -685,58 +4840,369 @@ int main()
         //ImGui::ShowDemoWindow(nullptr);
 
         ImGui::SetNextWindowPos({ 0, 0 }, ImGuiCond_Once);
-        ImGui::SetNextWindowSize({ 400, 240 }, ImGuiCond_Once);
+        ImGui::SetNextWindowSize({ 480, 280 }, ImGuiCond_Once);
         if (ImGui::Begin("window"))
         {
-            const char* displayModes[] = { "default", "circle", "sphere", "noise" };
+            const char* displayModes[] = { "default", "circle", "sphere", "noise", "LOD" };
             ImGui::Combo("display mode", (int*)&params.displayMode, displayModes, std::size(displayModes));
-            ImGui::SliderFloat("radius", &params.sphereRad, 0, 3, "%.4f", ImGuiSliderFlags_Logarithmic);
-            ImGui::DragFloat("noise frequency", &params.noiseFreq, 0.01, 0, FLT_MAX);
-            ImGui::DragFloat("center base", &params.centerBase, 0.01, 0, FLT_MAX);
-            ImGui::DragFloat("exponent", &params.exponent, 0.01, 0, FLT_MAX);
+            const char* decalPaths[] = { "instanced spheres", "tiled compute" };
+            ImGui::Combo("decal path", (int*)&params.decalPath, decalPaths, std::size(decalPaths));
+            const char* decalResolutions[] = { "full", "half", "quarter" };
+            ImGui::Combo("decal resolution", (int*)&params.decalResolution, decalResolutions, std::size(decalResolutions));
+            const char* noiseBackends[] = { "ALU, sin hash", "ALU, integer hash", "baked cubemap" };
+            ImGui::Combo("noise backend", (int*)&params.noiseBackend, noiseBackends, std::size(noiseBackends));
+            if (params.decalPath == DECAL_PATH_INSTANCED) {
+                const char* decalProxies[] = { "icosphere", "box", "screen quad" };
+                ImGui::Combo("decal proxy", (int*)&params.decalProxy, decalProxies, std::size(decalProxies));
+                ImGui::BeginDisabled(msaaSamples() > 1); // they read the depth as a single sample texture
+                ImGui::Checkbox("linear depth prepass + view rays", &params.viewRays);
+                ImGui::Checkbox("tile min/max depth rejection", &params.tileDepthReject);
+                ImGui::EndDisabled();
+                // the MSAA edges are flagged in the stencil
+                ImGui::BeginDisabled(msaaSamples() > 1 && params.msaaDecalShading == MSAA_DECAL_SHADING_EDGES);
+                if (params.decalProxy != DECAL_PROXY_SCREEN_QUAD)
+                    ImGui::Checkbox("stencil sphere volumes", &params.stencilVolumes);
+                ImGui::EndDisabled();
+                ImGui::BeginDisabled(params.decalResolution != DECAL_RESOLUTION_FULL);
+                ImGui::Checkbox("deferred shading (G-buffer)", &params.deferred);
+                ImGui::EndDisabled();
+                ImGui::BeginDisabled(params.decalResolution != DECAL_RESOLUTION_FULL || params.deferred);
+                const char* msaaModes[] = { "off", "2x", "4x", "8x" };
+                int msaaMode = glm::findMSB(params.msaaSamples);
+                if (ImGui::Combo("MSAA", &msaaMode, msaaModes, std::size(msaaModes)))
+                    params.msaaSamples = 1 << msaaMode;
+                if (params.msaaSamples > msaaTarget.maxSamples) {
+                    ImGui::SameLine();
+                    ImGui::Text("(max %dx)", msaaTarget.maxSamples);
+                }
+                if (params.msaaSamples > 1) {
+                    const char* msaaDecalShadings[] = { "per pixel", "per sample on edges", "per sample" };
+                    ImGui::Combo("MSAA decal shading", (int*)&params.msaaDecalShading, msaaDecalShadings, std::size(msaaDecalShadings));
+                }
+                ImGui::EndDisabled();
+            }
+            if (params.decalPath == DECAL_PATH_TILED) {
+                ImGui::Checkbox("tile depth slices", &params.tileDepthMask);
+                ImGui::SameLine();
+                ImGui::Checkbox("tile heatmap", &params.tileHeatmap);
+                ImGui::Text("tiles over %u decals: %u, dropped: %u", MAX_DECALS_PER_TILE, decalTiles.overflowTiles, decalTiles.droppedDecals);
+            }
+            if (glClipControl)
+                ImGui::Checkbox("reverse Z (float depth)", &params.reverseZ);
+            ImGui::Checkbox("scorch atlas (bake the settled decals)", &params.scorchAtlas);
+            if (params.scorchAtlas)
+                ImGui::DragFloat("bake delay", &params.scorchBakeDelay, 0.1, 0, FLT_MAX, "%.1fs");
+            if (params.scorchAtlas || scorchAtlas.numResident) {
+                ImGui::Text("pages: %u/%u resident, %zu with surfaces, evicted: %u, baked decals: %u",
+                    scorchAtlas.numResident, SCORCH_PHYSICAL_PAGES, scorchAtlas.surfacePages.size(), scorchAtlas.numEvicted, scorchAtlasGl.numBaked);
+            }
+            ImGui::Checkbox("cache static frames", &params.frameCache);
+            ImGui::SameLine();
+            ImGui::Text("full: %u, decals only: %u, skipped: %u",
+                frameCache.numFrames[FRAME_REDRAW_ALL], frameCache.numFrames[FRAME_REDRAW_DECALS], frameCache.numFrames[FRAME_REDRAW_NONE]);
+            ImGui::Checkbox("screen size LOD", &params.lod);
+            if (params.lod) {
+                ImGui::SliderFloat("LOD reject (px)", &params.lodMinPixels, 0, 16);
+                ImGui::DragFloat2("LOD mesh 1, 2 (px)", &params.lodMeshPixels[0], 0.5f, 0, 1000);
+                ImGui::SliderFloat("LOD octaves (px)", &params.lodOctavePixels, 1, 512, "%.0f", ImGuiSliderFlags_Logarithmic);
+            }
+            ImGui::Text("shader variants: decal %zu/%u, tile resolve %zu/%u, compile: %.1fms",
+                decalShaderVariants.cache.size(), decalShaderVariants.numPossible, tileResolveShaderVariants.cache.size(), tileResolveShaderVariants.numPossible,
+                decalShaderVariants.compileMs + decalStencilShaderVariants.compileMs + tileResolveShaderVariants.compileMs);
+            ImGui::SliderFloat("new decal radius", &params.sphereRad, 0, 3, "%.4f", ImGuiSliderFlags_Logarithmic);
+            {
+                // item 0 is "random"
+                int item = params.material + 1;
+                auto getName = [](void*, int i, const char** outName) { *outName = i ? decalMaterialNames[i - 1] : "random"; return true; };
+                if (ImGui::Combo("new decal material", &item, getName, nullptr, MAX_DECAL_MATERIALS + 1))
+                    params.material = item - 1;
+            }
+            const char* decalShapes[] = { "sphere", "ellipsoid", "capsule", "box" };
+            int shape = params.shape; // EDecalShape is a u8
+            if (ImGui::Combo("new decal shape", &shape, decalShapes, std::size(decalShapes)))
+                params.shape = EDecalShape(shape);
+            if (params.shape != DECAL_SHAPE_SPHERE)
+                ImGui::DragFloat3("shape proportions", &params.shapeProportions[0], 0.01f, 0.05f, 10);
+            ImGui::DragFloat("new decal lifetime", &params.lifetime, 0.1, 0, FLT_MAX, params.lifetime > 0 ? "%.1fs" : "infinite");
+            ImGui::DragFloat("grow duration", &params.growDuration, 0.01, 0, FLT_MAX, "%.2fs");
+            ImGui::SliderFloat("grow start", &params.growStart, 0, 1);
+            ImGui::DragFloat("fade duration", &params.fadeDuration, 0.01, 0, FLT_MAX, "%.2fs");
+            ImGui::DragScalar("decal budget", ImGuiDataType_U32, &decals.budget, 10, nullptr, nullptr, decals.budget ? "%u" : "unlimited");
+            ImGui::Text("evicted: %u, expired: %u", decals.numEvicted, decals.numExpired);
+            ImGui::Checkbox("coalesce overlapping decals", &decals.coalescing.enabled);
+            if (decals.coalescing.enabled) {
+                ImGui::SliderFloat("max center distance", &decals.coalescing.maxDistance, 0, 1);
+                ImGui::SliderFloat("max radius ratio", &decals.coalescing.maxRadiusRatio, 1, 4);
+                ImGui::SliderFloat("max intensity", &decals.coalescing.maxIntensity, 1, 16);
+            }
+            {
+                // if the coalesced decals were drawn separately they would cost about as many samples as the decals they were merged into
+                float stacked = 0;
+                for (float intensity : decals.intensities)
+                    stacked += intensity;
+                const float savedSamples = decals.size() ? decalSamplesStats.samples * (stacked / decals.size() - 1) : 0;
+                ImGui::Text("coalesced: %u, decal samples: %llu, saved: ~%.0f", decals.numCoalesced, (unsigned long long)decalSamplesStats.samples, savedSamples);
+            }
+            const char* instanceUploads[] = { "orphan (glBufferData)", glBufferStorage ? "persistent ring" : "ring (map unsynchronized)", "incremental (dirty ranges)" };
+            ImGui::Combo("instance upload", (int*)&instanceUpload, instanceUploads, std::size(instanceUploads));
+            ImGui::Text("upload CPU: %.3fms, ring stalls: %u", instanceUploadStats.cpuMs, instanceUploadStats.stalls);
+            ImGui::Text("uploaded: %u bytes in %u ranges", instanceUploadStats.uploadedBytes, instanceUploadStats.uploadedRanges);
+            ImGui::Checkbox("frustum culling", &params.frustumCulling);
+            if (cullOnCpu) {
+                ImGui::SameLine();
+                ImGui::Text("CPU, visible: %u/%zu", numInstances, decals.size());
+            }
+            else if (tiled) {
+                ImGui::SameLine();
+                ImGui::TextUnformatted("GPU, always on for the tiled path");
+            }
+            else if (params.frustumCulling && instanceUpload == INSTANCE_UPLOAD_INCREMENTAL) {
+                ImGui::SameLine();
+                ImGui::TextUnformatted("GPU, indirect draw");
+            }
 
-            for (size_t i = 0; i < decals.positions.size(); i++)
+            if (const u32 i = decals.indexOf(selectedDecal); i != INVALID_DECAL_INDEX)
             {
-                ImGuizmo::SetID(i);
                 auto modelMtx = glm::translate(mat4(1), decals.positions[i]);
                 if (ImGuizmo::Manipulate(&viewMtx[0][0], &projMtx[0][0],
                     ImGuizmo::OPERATION::TRANSLATE, ImGuizmo::MODE::WORLD,
                     &modelMtx[0][0], NULL, NULL))
                 {
                     decals.positions[i] = vec3(modelMtx[3]);
+                    decals.markDirty(i);
+                }
+            }
+
+            if (ImGui::CollapsingHeader("spatial index benchmark"))
+            {
+                if (ImGui::Button("run (takes a while)"))
+                    runSpatialIndexBenchmark();
+                if (spatialBenchResults.size() && ImGui::BeginTable("spatialBench", 5, ImGuiTableFlags_Borders)) {
+                    ImGui::TableSetupColumn("decals");
+                    ImGui::TableSetupColumn("build ms");
+                    ImGui::TableSetupColumn("radius us grid/brute");
+                    ImGui::TableSetupColumn("frustum us grid/brute");
+                    ImGui::TableSetupColumn("ray us grid/brute");
+                    ImGui::TableHeadersRow();
+                    for (const auto& r : spatialBenchResults) {
+                        ImGui::TableNextColumn(); ImGui::Text("%u%s", r.numDecals, r.mismatch ? " (!)" : "");
+                        ImGui::TableNextColumn(); ImGui::Text("%.1f", r.buildMs);
+                        ImGui::TableNextColumn(); ImGui::Text("%.1f / %.1f", r.radiusGridUs, r.radiusBruteUs);
+                        ImGui::TableNextColumn(); ImGui::Text("%.1f / %.1f", r.frustumGridUs, r.frustumBruteUs);
+                        ImGui::TableNextColumn(); ImGui::Text("%.1f / %.1f", r.rayGridUs, r.rayBruteUs);
+                    }
+                    ImGui::EndTable();
                 }
             }
         }
 
         ImGui::SetNextItemOpen(true, ImGuiCond_Once);
-        int toDelete = -1;
+        DecalHandle toDelete = INVALID_DECAL_HANDLE;
         if (ImGui::TreeNode("decals"))
         {
-            for (size_t i = 0; i < decals.positions.size(); i++)
-            {
-                ImGui::PushID(i);
-                ImGui::DragFloat3("pos", &decals.positions[i][0], 0.1);
-                ImGui::SameLine();
-                if (ImGui::Button("delete"))
-                    toDelete = i;
-                ImGui::PopID();
+            ImGuiListClipper clipper;
+            clipper.Begin(decals.size());
+            while (clipper.Step()) {
+                for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+                {
+                    ImGui::PushID(decals.slots[i]);
+                    if (ImGui::RadioButton("##selected", decals.handleAt(i) == selectedDecal))
+                        selectedDecal = decals.handleAt(i);
+                    ImGui::SameLine();
+                    ImGui::SetNextItemWidth(200);
+                    if (ImGui::DragFloat3("pos", &decals.positions[i][0], 0.1))
+                        decals.markDirty(i);
+                    ImGui::SameLine();
+                    ImGui::SetNextItemWidth(60);
+                    if (ImGui::DragFloat("rad", &decals.radiuses[i], 0.01, 0, FLT_MAX))
+                        decals.markDirty(i);
+                    ImGui::SameLine();
+                    if (ImGui::Button("delete"))
+                        toDelete = decals.handleAt(i);
+                    ImGui::PopID();
+                }
             }
             ImGui::TreePop();
         }
-        if (toDelete >= 0) {
-            decals.positions.erase(decals.positions.begin() + toDelete);
-            decals.rotations.erase(decals.rotations.begin() + toDelete);
+        decals.remove(toDelete);
+
+        auto randFloat = []() { return float(rand()) / RAND_MAX; };
+        auto randDecalSpawn = [&]() -> DecalSpawn {
+            return {
+                .pos = vec3(glm::mix(-2.4f, +2.4f, randFloat()), 0.045, glm::mix(-2.4f, +2.4f, randFloat())),
+                .rot = glm::quat_cast(randRotMtx({ randFloat(), randFloat(), randFloat() })),
+                .radius = params.sphereRad,
+                .lifetime = params.lifetime,
+                .material = u16(params.material < 0 ? rand() % MAX_DECAL_MATERIALS : params.material),
+                .shape = params.shape,
+                .extents = fitDecalShapeExtents(params.shape, params.shapeProportions),
+            };
+        };
+        if (ImGui::Button("Add Decal")) {
+            const DecalSpawn spawn = randDecalSpawn();
+            decals.spawn(spawn);
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Add 1000"))
+        {
+            auto spawns = bufferSpan<DecalSpawn>().first(1000);
+            for (auto& s : spawns)
+                s = randDecalSpawn();
+            decals.spawn(spawns);
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Clear")) {
+            decals.clear();
+            clearScorchAtlas();
+        }
+        ImGui::Text("%zu decals", decals.size());
+
+        if (ImGui::CollapsingHeader("materials"))
+        {
+            static int editedMaterial = 0;
+            auto getName = [](void*, int i, const char** outName) { *outName = decalMaterialNames[i]; return true; };
+            ImGui::Combo("material", &editedMaterial, getName, nullptr, MAX_DECAL_MATERIALS);
+            DecalMaterial& material = decalMaterials[editedMaterial];
+            ImGui::InputText("name", decalMaterialNames[editedMaterial], sizeof(decalMaterialNames[editedMaterial]));
+            ImGui::DragFloat("noise frequency", &material.noiseFreq, 0.01, 0, FLT_MAX);
+            ImGui::DragFloat("center base", &material.centerBase, 0.01, 0, FLT_MAX);
+            ImGui::DragFloat("exponent", &material.exponent, 0.01, 0, FLT_MAX);
+            ImGui::SliderFloat("roughness", &material.roughness, 0, 1);
+            ImGui::ColorEdit3("color", &material.color[0]);
+            ImGui::Checkbox("one draw call per material (CPU upload paths)", &params.drawPerMaterial);
+            ImGui::Text("decal draw calls: %u, decal pass GPU: %.3fms", frameStats.decalDrawCalls, decalPassTimer.ms);
+            ImGui::TextUnformatted("benchmark: 2000 decals, 16 materials mixed");
+            drawBenchmarkUi("materials", materialBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("decal path benchmark"))
+        {
+            ImGui::TextUnformatted("instanced vs tiled, sweeping the decal count and radius");
+            drawBenchmarkUi("decal path", decalPathBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("noise benchmark"))
+        {
+            ImGui::Text("cubemaps: %ux%u, R16F, layers baked: %u", NOISE_CUBE_SIZE, NOISE_CUBE_SIZE, noiseCubes.numBaked);
+            ImGui::TextUnformatted("1000 decals, the image of each backend is compared to the sin hash");
+            drawBenchmarkUi("noise", noiseBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("decal resolution benchmark"))
+        {
+            ImGui::TextUnformatted("400 decals at full, half and quarter resolution, compared to full");
+            drawBenchmarkUi("resolution", resolutionBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("decal proxy benchmark"))
+        {
+            if (glHasPipelineStatistics) {
+                ImGui::Text("shader invocations, vertex: %llu, fragment: %llu",
+                    (unsigned long long)decalVertexInvocations.value, (unsigned long long)decalShadeInvocations.value);
+            }
+            else
+                ImGui::TextUnformatted("pipeline statistics queries not supported");
+            ImGui::TextUnformatted("icosphere, box and screen quad proxies, sweeping the decal count and radius");
+            drawBenchmarkUi("proxy", proxyBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("view rays benchmark"))
+        {
+            ImGui::TextUnformatted("2000 overlapping decals, position from the inverse view projection or from the linear depth");
+            drawBenchmarkUi("view rays", viewRaysBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("reverse Z benchmark"))
+        {
+            if (glClipControl) {
+                ImGui::TextUnformatted("2000 overlapping decals, with the standard depth or reverse Z");
+                drawBenchmarkUi("reverse Z", reverseZBenchmark);
+            }
+            else
+                ImGui::TextUnformatted("glClipControl not supported");
+        }
+
+        if (ImGui::CollapsingHeader("scorch atlas benchmark"))
+        {
+            ImGui::TextUnformatted("2000 settled decals, drawn every frame or baked into the scorch atlas (clears the atlas)");
+            drawBenchmarkUi("scorch atlas", scorchBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("tile depth rejection benchmark"))
+        {
+            ImGui::TextUnformatted("4000 decals all over the room, many of them hidden behind the surfaces");
+            drawBenchmarkUi("tile depth rejection", tileRejectBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("decal shapes benchmark"))
+        {
+            ImGui::TextUnformatted("2000 decals, all spheres or cycling through the shapes (one instanced draw either way)");
+            drawBenchmarkUi("shapes", shapeBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("deferred shading benchmark"))
+        {
+            ImGui::TextUnformatted("500 and 4000 overlapping decals on the floor, forward or blended into the G-buffer and lit once");
+            drawBenchmarkUi("deferred", deferredBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("MSAA benchmark"))
+        {
+            ImGui::Text("2000 decals at 2x, 4x and 8x MSAA (max %dx), compared to the per sample shading", msaaTarget.maxSamples);
+            drawBenchmarkUi("MSAA", msaaBenchmark);
+        }
+
+        if (ImGui::CollapsingHeader("LOD benchmark"))
+        {
+            ImGui::TextUnformatted("4000 small decals, with and without the screen size LOD (current thresholds)");
+            ImGui::TextUnformatted("500 large decals, with and without the coarsest mesh (must match)");
+            drawBenchmarkUi("LOD", lodBenchmark);
         }
 
-        if (ImGui::Button("Add Decal"))
+        if (ImGui::CollapsingHeader("stencil volumes benchmark"))
         {
-            auto randFloat = []() { return float(rand()) / RAND_MAX; };
+            if (glHasPipelineStatistics) {
+                ImGui::Text("fragment shader invocations, shade: %llu, stencil mark: %llu",
+                    (unsigned long long)decalShadeInvocations.value, (unsigned long long)decalMarkInvocations.value);
+            }
+            else
+                ImGui::TextUnformatted("pipeline statistics queries not supported");
+            ImGui::TextUnformatted("300 big decals, instanced path with and without the stencil marking");
+            drawBenchmarkUi("stencil", stencilBenchmark);
+        }
 
-            vec3 pos(glm::mix(-2.4f, +2.4f, randFloat()), 0.045, glm::mix(-2.4f, +2.4f, randFloat()));
-            decals.positions.push_back(pos);
+        if (ImGui::CollapsingHeader("spawn stress test"))
+        {
+            const bool running = spawnStress.running;
+            ImGui::BeginDisabled(running);
+            ImGui::SliderInt("producer threads", &spawnStress.numThreads, 1, 32);
+            ImGui::DragInt("spawns/s per thread", &spawnStress.spawnsPerSecond, 100, 0, INT_MAX, spawnStress.spawnsPerSecond ? "%d" : "unlimited");
+            ImGui::SliderFloat("remove chance", &spawnStress.removeChance, 0, 1);
+            ImGui::DragFloat("stress lifetime", &spawnStress.lifetime, 0.1, 0, FLT_MAX, "%.1fs");
+            ImGui::EndDisabled();
+            if (ImGui::Button(running ? "stop" : "start")) {
+                if (running)
+                    stopSpawnStress();
+                else
+                    startSpawnStress();
+            }
 
-            const mat3 rot = randRotMtx({ randFloat(), randFloat(), randFloat() });
-            decals.rotations.push_back(rot);
+            const double t = glfwGetTime();
+            if (t - spawnStress.lastMeasureTime >= 1) {
+                const u64 pushed = spawnStress.pushed;
+                spawnStress.pushesPerSecond = (pushed - spawnStress.lastPushed) / (t - spawnStress.lastMeasureTime);
+                spawnStress.lastPushed = pushed;
+                spawnStress.lastMeasureTime = t;
+            }
+            const DecalCommandStats& stats = decalCommandStats;
+            ImGui::Text("throughput: %.0f commands/s", spawnStress.pushesPerSecond);
+            ImGui::Text("drained: %u in %.3fms, latency avg %.2fms max %.2fms", stats.drained, stats.drainMs, stats.avgLatencyMs, stats.maxLatencyMs);
+            // once the producers are stopped and the queue is empty, every pushed command must have been drained exactly once
+            const u64 pushed = spawnStress.pushed;
+            ImGui::Text("pushed: %llu, drained: %llu, rejected (queue full): %llu",
+                (unsigned long long)pushed, (unsigned long long)stats.totalDrained, (unsigned long long)spawnStress.rejected.load());
+            if (!running && stats.drained == 0 && pushed != stats.totalDrained)
+                ImGui::TextColored({ 1, 0, 0, 1 }, "lost or duplicated commands!");
         }
 
         ImGui::End();
@@ -746,5 +5212,11 @@ int main()
 
         firstFrame = false;
         glfwSwapBuffers(window);
+
+        const double frameTime = glfwGetTime();
+        frameStats.frameMs = 1000 * (frameTime - prevFrameTime);
+        prevFrameTime = frameTime;
+        updateBenchmark();
     }
+    stopSpawnStress();
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <assert.h>
+
+// Bounded multi-producer single-consumer queue (based on Dmitry Vyukov's bounded MPMC queue)
+// Every cell has a sequence number that tells whether it's ready to be written (seq == pos) or read (seq == pos + 1)
+// Producers only contend on a CAS of the enqueue position, and the consumer doesn't need atomic RMW operations at all
+// tryPush() fails instead of blocking when the queue is full
+template <typename T>
+struct MpscQueue {
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos = 0;
+    alignas(64) size_t dequeuePos = 0; // only touched by the consumer
+
+    explicit MpscQueue(size_t capacity) // must be a power of 2
+        : cells(new Cell[capacity])
+        , mask(capacity - 1)
+    {
+        assert(capacity >= 2 && (capacity & mask) == 0);
+        for (size_t i = 0; i < capacity; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // can be called from any thread
+    bool tryPush(const T& x)
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            const size_t seq = cell->seq.load(std::memory_order_acquire);
+            const intptr_t dif = intptr_t(seq) - intptr_t(pos);
+            if (dif == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+                return false; // full
+            else
+                pos = enqueuePos.load(std::memory_order_relaxed); // another producer took this cell
+        }
+        cell->data = x;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // must only be called from the consumer thread
+    bool tryPop(T& x)
+    {
+        Cell& cell = cells[dequeuePos & mask];
+        const size_t seq = cell.seq.load(std::memory_order_acquire);
+        if (intptr_t(seq) - intptr_t(dequeuePos + 1) < 0)
+            return false; // empty, or the producer that owns the cell hasn't finished writing it
+        x = cell.data;
+        cell.seq.store(dequeuePos + mask + 1, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+};
@@ -0,0 +1,237 @@
+#include "scorch_atlas.hpp"
+#include <algorithm>
+#include <numeric>
+
+// imgui compiles its own copy with STBRP_STATIC, so it's not visible from here
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#include <imstb_rectpack.h>
+
+static u32 findChartRoot(std::vector<u32>& parents, u32 v)
+{
+    while (parents[v] != v) {
+        parents[v] = parents[parents[v]];
+        v = parents[v];
+    }
+    return v;
+}
+
+u32 generateLightmapUvs(std::span<LightmapMesh> meshes, float texelsPerMeter)
+{
+    struct Chart {
+        u32 meshInd;
+        std::vector<u32> verts;
+        vec3 normal = vec3(0); // not normalized, the sum is weighted by the areas
+        vec3 tangent, bitangent;
+        vec2 min = vec2(FLT_MAX), max = vec2(-FLT_MAX); // projected, in texels
+    };
+    std::vector<Chart> charts;
+    for (u32 meshInd = 0; meshInd < meshes.size(); meshInd++) {
+        LightmapMesh& mesh = meshes[meshInd];
+        const u32 numVerts = mesh.positions.size();
+        mesh.uvs.assign(numVerts, vec2(-1));
+
+        // union-find of the vertices through the triangles
+        std::vector<u32> parents(numVerts);
+        std::iota(parents.begin(), parents.end(), 0u);
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            const u32 r0 = findChartRoot(parents, mesh.indices[i]);
+            const u32 r1 = findChartRoot(parents, mesh.indices[i + 1]);
+            const u32 r2 = findChartRoot(parents, mesh.indices[i + 2]);
+            parents[r1] = r0;
+            parents[r2] = r0;
+        }
+        std::vector<u32> rootToChart(numVerts, u32(-1));
+        auto chartOf = [&](u32 v) -> Chart& {
+            u32& chartInd = rootToChart[findChartRoot(parents, v)];
+            if (chartInd == u32(-1)) {
+                chartInd = charts.size();
+                charts.push_back({ .meshInd = meshInd });
+            }
+            return charts[chartInd];
+        };
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            const vec3 p0 = mesh.positions[mesh.indices[i]];
+            const vec3 p1 = mesh.positions[mesh.indices[i + 1]];
+            const vec3 p2 = mesh.positions[mesh.indices[i + 2]];
+            chartOf(mesh.indices[i]).normal += cross(p1 - p0, p2 - p0);
+        }
+        for (u32 v = 0; v < numVerts; v++) {
+            if (rootToChart[findChartRoot(parents, v)] != u32(-1)) // vertices that are not used by any triangle don't get a chart
+                chartOf(v).verts.push_back(v);
+        }
+    }
+
+    std::vector<stbrp_rect> rects(charts.size());
+    for (u32 chartInd = 0; chartInd < charts.size(); chartInd++) {
+        Chart& chart = charts[chartInd];
+        const float len = length(chart.normal);
+        const vec3 n = len > 0 ? chart.normal / len : vec3(0, 1, 0);
+        chart.tangent = normalize(cross(abs(n.y) < 0.99f ? vec3(0, 1, 0) : vec3(1, 0, 0), n));
+        chart.bitangent = cross(n, chart.tangent);
+        for (u32 v : chart.verts) {
+            const vec3 p = meshes[chart.meshInd].positions[v];
+            const vec2 uv = texelsPerMeter * vec2(dot(p, chart.tangent), dot(p, chart.bitangent));
+            chart.min = glm::min(chart.min, uv);
+            chart.max = glm::max(chart.max, uv);
+        }
+        const vec2 size = glm::ceil(chart.max - chart.min) + float(2 * SCORCH_CHART_PADDING);
+        rects[chartInd] = { .id = int(chartInd), .w = int(size.x), .h = int(size.y) };
+    }
+
+    std::vector<stbrp_node> nodes(SCORCH_VIRTUAL_SIZE);
+    stbrp_context ctx;
+    stbrp_init_target(&ctx, SCORCH_VIRTUAL_SIZE, SCORCH_VIRTUAL_SIZE, nodes.data(), nodes.size());
+    stbrp_pack_rects(&ctx, rects.data(), rects.size());
+
+    u32 numUnpacked = 0;
+    for (const stbrp_rect& rect : rects) {
+        if (!rect.was_packed) {
+            numUnpacked++;
+            continue;
+        }
+        const Chart& chart = charts[rect.id];
+        LightmapMesh& mesh = meshes[chart.meshInd];
+        const vec2 origin = vec2(rect.x, rect.y) + float(SCORCH_CHART_PADDING);
+        for (u32 v : chart.verts) {
+            const vec3 p = mesh.positions[v];
+            mesh.uvs[v] = origin + texelsPerMeter * vec2(dot(p, chart.tangent), dot(p, chart.bitangent)) - chart.min;
+        }
+    }
+    return numUnpacked;
+}
+
+void ScorchAtlas::init(u32 numPhysicalPages)
+{
+    pages.assign(SCORCH_VIRTUAL_PAGES * SCORCH_VIRTUAL_PAGES, {});
+    surfacePages.clear();
+    physicalToVirtual.assign(numPhysicalPages, INVALID_SCORCH_PAGE);
+    numResident = 0;
+    numEvicted = 0;
+}
+
+void ScorchAtlas::addTriangle(const vec3 positions[3], const vec2 uvs[3])
+{
+    if (uvs[0].x < 0 || uvs[1].x < 0 || uvs[2].x < 0)
+        return; // the chart didn't fit in the virtual texture
+    const vec3 triMin = glm::min(positions[0], glm::min(positions[1], positions[2]));
+    const vec3 triMax = glm::max(positions[0], glm::max(positions[1], positions[2]));
+    const vec2 triUvMin = glm::min(uvs[0], glm::min(uvs[1], uvs[2]));
+    const vec2 triUvMax = glm::max(uvs[0], glm::max(uvs[1], uvs[2]));
+    // the UVs are an affine map of the triangle's plane, so the part of the triangle inside of a page is bounded by
+    // the corners of the page rectangle (clipped to the UV bounds of the triangle) mapped back to world space
+    const vec2 e1 = uvs[1] - uvs[0], e2 = uvs[2] - uvs[0];
+    const float det = e1.x * e2.y - e1.y * e2.x;
+    auto uvToWorld = [&](vec2 uv) {
+        const vec2 d = uv - uvs[0];
+        const float b1 = (d.x * e2.y - d.y * e2.x) / det;
+        const float b2 = (e1.x * d.y - e1.y * d.x) / det;
+        return positions[0] + b1 * (positions[1] - positions[0]) + b2 * (positions[2] - positions[0]);
+    };
+    // the borders of the neighbor pages also cover the triangle
+    const vec2 uvMin = triUvMin - float(SCORCH_PAGE_BORDER);
+    const vec2 uvMax = triUvMax + float(SCORCH_PAGE_BORDER);
+    const glm::ivec2 p0 = glm::clamp(glm::ivec2(glm::floor(uvMin / float(SCORCH_PAGE_SIZE))), 0, int(SCORCH_VIRTUAL_PAGES) - 1);
+    const glm::ivec2 p1 = glm::clamp(glm::ivec2(glm::floor(uvMax / float(SCORCH_PAGE_SIZE))), 0, int(SCORCH_VIRTUAL_PAGES) - 1);
+    for (int y = p0.y; y <= p1.y; y++)
+    for (int x = p0.x; x <= p1.x; x++) {
+        vec3 boundsMin = triMin, boundsMax = triMax;
+        if (abs(det) > 1e-6f) {
+            const vec2 rectMin = glm::max(vec2(x, y) * float(SCORCH_PAGE_SIZE) - float(SCORCH_PAGE_BORDER), triUvMin);
+            const vec2 rectMax = glm::min(vec2(x + 1, y + 1) * float(SCORCH_PAGE_SIZE) + float(SCORCH_PAGE_BORDER), triUvMax);
+            if (rectMin.x > rectMax.x || rectMin.y > rectMax.y)
+                continue;
+            boundsMin = vec3(FLT_MAX);
+            boundsMax = vec3(-FLT_MAX);
+            for (vec2 corner : { rectMin, vec2(rectMax.x, rectMin.y), vec2(rectMin.x, rectMax.y), rectMax }) {
+                const vec3 p = uvToWorld(corner);
+                boundsMin = glm::min(boundsMin, p);
+                boundsMax = glm::max(boundsMax, p);
+            }
+        }
+        const u32 pageInd = y * SCORCH_VIRTUAL_PAGES + x;
+        ScorchPage& page = pages[pageInd];
+        if (page.boundsMin.x == FLT_MAX)
+            surfacePages.push_back(pageInd);
+        page.boundsMin = glm::min(page.boundsMin, boundsMin);
+        page.boundsMax = glm::max(page.boundsMax, boundsMax);
+    }
+}
+
+void ScorchAtlas::clear()
+{
+    for (u32& virtualPage : physicalToVirtual) {
+        if (virtualPage != INVALID_SCORCH_PAGE)
+            pages[virtualPage].physical = INVALID_SCORCH_PAGE;
+        virtualPage = INVALID_SCORCH_PAGE;
+    }
+    numResident = 0;
+}
+
+void ScorchAtlas::queryPages(vec3 center, float radius, std::vector<u32>& outPages) const
+{
+    for (u32 pageInd : surfacePages) {
+        const ScorchPage& page = pages[pageInd];
+        if (distance2(glm::clamp(center, page.boundsMin, page.boundsMax), center) <= radius * radius)
+            outPages.push_back(pageInd);
+    }
+}
+
+void ScorchAtlas::touchVisiblePages(const Frustum& frustum)
+{
+    for (u32 virtualPage : physicalToVirtual) {
+        if (virtualPage == INVALID_SCORCH_PAGE)
+            continue;
+        ScorchPage& page = pages[virtualPage];
+        if (testAabbFrustum(frustum, page.boundsMin, page.boundsMax) != FRUSTUM_OUTSIDE)
+            page.lastUsedFrame = frame;
+    }
+}
+
+bool ScorchAtlas::canAcquirePages(std::span<const u32> virtualPages) const
+{
+    u32 needed = 0;
+    for (u32 pageInd : virtualPages)
+        needed += pages[pageInd].physical == INVALID_SCORCH_PAGE;
+    u32 available = 0;
+    for (u32 virtualPage : physicalToVirtual) {
+        const bool evictable = virtualPage == INVALID_SCORCH_PAGE ||
+            (pages[virtualPage].lastUsedFrame != frame && std::find(virtualPages.begin(), virtualPages.end(), virtualPage) == virtualPages.end());
+        available += evictable;
+    }
+    return needed <= available;
+}
+
+u32 ScorchAtlas::acquirePage(u32 virtualPage, bool& outAllocated, u32& outEvicted)
+{
+    ScorchPage& page = pages[virtualPage];
+    page.lastUsedFrame = frame;
+    outAllocated = false;
+    outEvicted = INVALID_SCORCH_PAGE;
+    if (page.physical != INVALID_SCORCH_PAGE)
+        return page.physical;
+
+    // a free page, or else the least recently used one
+    u32 best = INVALID_SCORCH_PAGE;
+    for (u32 p = 0; p < physicalToVirtual.size(); p++) {
+        const u32 other = physicalToVirtual[p];
+        if (other == INVALID_SCORCH_PAGE) {
+            best = p;
+            break;
+        }
+        if (pages[other].lastUsedFrame != frame && (best == INVALID_SCORCH_PAGE || pages[other].lastUsedFrame < pages[physicalToVirtual[best]].lastUsedFrame))
+            best = p;
+    }
+    assert(best != INVALID_SCORCH_PAGE);
+    if (physicalToVirtual[best] != INVALID_SCORCH_PAGE) {
+        outEvicted = physicalToVirtual[best];
+        pages[outEvicted].physical = INVALID_SCORCH_PAGE;
+        numEvicted++;
+    }
+    else
+        numResident++;
+    physicalToVirtual[best] = virtualPage;
+    page.physical = best;
+    outAllocated = true;
+    return best;
+}
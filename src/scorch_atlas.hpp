@@ -0,0 +1,61 @@
+#pragma once
+
+#include "utils.hpp"
+#include <float.h>
+#include <vector>
+
+// Persistent scorch atlas: the decals that settled are baked into a texture over the static geometry, so they stop costing fragment time every frame
+// The static meshes get a second set of UVs (lightmap style) that gives every surface its own place in a big virtual texture
+// The virtual texture is split in pages, which only get a physical page of the atlas when some decal is baked into them
+// When the atlas is full, the page that was least recently used (baked or visible) is evicted, and its scorch marks are lost
+constexpr u32 SCORCH_PAGE_SIZE = 128; // in texels, without the border
+constexpr u32 SCORCH_PAGE_BORDER = 1; // texels around each physical page, baked too, so the pages can be sampled with bilinear filtering
+constexpr u32 SCORCH_VIRTUAL_PAGES = 32; // per side of the virtual texture
+constexpr u32 SCORCH_VIRTUAL_SIZE = SCORCH_VIRTUAL_PAGES * SCORCH_PAGE_SIZE;
+constexpr u32 SCORCH_CHART_PADDING = 2; // empty texels around each chart
+constexpr u32 INVALID_SCORCH_PAGE = u32(-1);
+
+// a mesh instance to unwrap, in world space
+struct LightmapMesh {
+    std::span<const vec3> positions;
+    std::span<const u32> indices; // triangle list
+    std::vector<vec2> uvs; // output: texel coordinates in the virtual texture, one per vertex. (-1, -1) for the charts that didn't fit
+};
+
+// The triangles that share vertices form a chart, which is projected on the plane of its average normal. Then all the charts are packed
+// in the virtual texture (imstb_rectpack). The vertices must not be shared by surfaces that face different ways, which is the case for
+// flat shaded meshes, since their vertices are split at the hard edges
+// returns the number of charts that didn't fit
+u32 generateLightmapUvs(std::span<LightmapMesh> meshes, float texelsPerMeter);
+
+struct ScorchPage {
+    vec3 boundsMin = vec3(FLT_MAX), boundsMax = vec3(-FLT_MAX); // of the triangles that are baked into the page (or its border)
+    u32 physical = INVALID_SCORCH_PAGE;
+    u32 lastUsedFrame = 0;
+};
+
+struct ScorchAtlas {
+    std::vector<ScorchPage> pages; // virtual pages, SCORCH_VIRTUAL_PAGES^2
+    std::vector<u32> surfacePages; // the virtual pages that have some surface
+    std::vector<u32> physicalToVirtual; // INVALID_SCORCH_PAGE for the free physical pages
+    u32 frame = 1;
+    u32 numResident = 0;
+    u32 numEvicted = 0;
+
+    void init(u32 numPhysicalPages);
+    // expands the bounds of the pages the triangle touches. Call after init() for all the triangles of the static meshes
+    void addTriangle(const vec3 positions[3], const vec2 uvs[3]);
+    // evicts all the pages
+    void clear();
+    // the virtual pages that have surfaces within the sphere
+    void queryPages(vec3 center, float radius, std::vector<u32>& outPages) const;
+    // the resident pages in the frustum become the most recently used
+    void touchVisiblePages(const Frustum& frustum);
+    // whether acquirePage() can get all the virtual pages of the list: the ones that are not resident must fit in the free physical pages
+    // plus the ones that weren't used in this frame
+    bool canAcquirePages(std::span<const u32> virtualPages) const;
+    // returns the physical page of the virtual page, allocating it if needed. The allocated pages must be cleared before baking (outAllocated)
+    // outEvicted is the virtual page that lost its physical page, or INVALID_SCORCH_PAGE. Call canAcquirePages() first
+    u32 acquirePage(u32 virtualPage, bool& outAllocated, u32& outEvicted);
+    void nextFrame() { frame++; }
+};
@@ -1,5 +1,6 @@
 #include "utils.hpp"
 #include <span>
+#include <vector>
 #include <glm/gtx/euler_angles.hpp>
 
 char buffer[SCRATCH_BUFFER_SIZE];
@@ -9,7 +10,7 @@ namespace shader_srcs
 {
 
 extern ConstStr header =
-"#version 330\n"
+"#version 430\n"
 "#define PI 3.1415926535897932\n";
 
 }
@@ -40,6 +41,24 @@ void glErrorCallback(const char* name, void* funcptr, int len_args, ...) {
 	}
 }
 
+PFNGLBUFFERSTORAGEPROC glBufferStorage = nullptr;
+bool glHasPipelineStatistics = false;
+PFNGLCLIPCONTROLPROC glClipControl = nullptr;
+
+static bool hasGlVersion(int major, int minor)
+{
+    return GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor);
+}
+
+void loadGlExtensions(GLADloadproc load, int (*extensionSupported)(const char* name))
+{
+    if (hasGlVersion(4, 4) || extensionSupported("GL_ARB_buffer_storage"))
+        glBufferStorage = (PFNGLBUFFERSTORAGEPROC)load("glBufferStorage");
+    glHasPipelineStatistics = hasGlVersion(4, 6) || extensionSupported("GL_ARB_pipeline_statistics_query");
+    if (hasGlVersion(4, 5) || extensionSupported("GL_ARB_clip_control"))
+        glClipControl = (PFNGLCLIPCONTROLPROC)load("glClipControl");
+}
+
 // --- shader utils ---
 
 char* checkCompileErrors(u32 shad, std::span<char> buffer)
@@ -65,7 +84,7 @@ char* checkLinkErrors(u32 prog, std::span<char> buffer)
     return nullptr;
 }
 
-static void printCodeWithLines(std::span<const char*> srcs)
+static void printCodeWithLines(std::span<const char* const> srcs)
 {
     printf("%4d| ", 1);
     int line = 2;
@@ -87,15 +106,21 @@ static void printCodeWithLines(std::span<const char*> srcs)
     printf("\n");
 }
 
+void printShaderCodeWithHeader(std::span<const char* const> srcs)
+{
+    std::vector<const char*> allSrcs = { shader_srcs::header };
+    allSrcs.insert(allSrcs.end(), srcs.begin(), srcs.end());
+    printCodeWithLines(allSrcs);
+}
+
 void printShaderCodeWithHeader(const char* src)
 {
-    const char* srcs[2] = { shader_srcs::header, src };
-    printCodeWithLines(srcs);
+    printShaderCodeWithHeader({ &src, 1 });
 }
 
-u32 easyCreateShader(const char* name, const char* src, GLenum type)
+u32 easyCreateShader(const char* name, std::span<const char* const> srcs, GLenum type)
 {
-    static ConstStr s_shaderTypeNames[] = { "VERT", "FRAG", "GEOM" };
+    static ConstStr s_shaderTypeNames[] = { "VERT", "FRAG", "GEOM", "COMP" };
     const char* typeName = nullptr;
     switch (type) {
     case GL_VERTEX_SHADER:
@@ -104,23 +129,31 @@ u32 easyCreateShader(const char* name, const char* src, GLenum type)
         typeName = s_shaderTypeNames[1]; break;
     case GL_GEOMETRY_SHADER:
         typeName = s_shaderTypeNames[2]; break;
+    case GL_COMPUTE_SHADER:
+        typeName = s_shaderTypeNames[3]; break;
     default:
         assert(false);
     }
 
     const u32 shad = glCreateShader(type);
-    ConstStr srcs[] = { shader_srcs::header, src };
-    glShaderSource(shad, 2, srcs, nullptr);
+    std::vector<const char*> allSrcs = { shader_srcs::header };
+    allSrcs.insert(allSrcs.end(), srcs.begin(), srcs.end());
+    glShaderSource(shad, allSrcs.size(), allSrcs.data(), nullptr);
     glCompileShader(shad);
     if (const char* errMsg = checkCompileErrors(shad, buffer)) {
         printf("Error in '%s'(%s):\n%s", name, typeName, errMsg);
-        printShaderCodeWithHeader(src);
+        printShaderCodeWithHeader(srcs);
         assert(false);
     }
     return shad;
 }
 
-u32 easyCreateShaderProg(const char* name, const char* vertShadSrc, const char* fragShadSrc, u32 vertShad, u32 fragShad)
+u32 easyCreateShader(const char* name, const char* src, GLenum type)
+{
+    return easyCreateShader(name, { &src, 1 }, type);
+}
+
+u32 easyCreateShaderProg(const char* name, std::span<const char* const> vertShadSrcs, std::span<const char* const> fragShadSrcs, u32 vertShad, u32 fragShad)
 {
     u32 prog = glCreateProgram();
 
@@ -135,25 +168,50 @@ u32 easyCreateShaderProg(const char* name, const char* vertShadSrc, const char*
     if (const char* errMsg = checkLinkErrors(prog, buffer)) {
         printf("%s\n", errMsg);
         printf("Vertex Shader:\n");
-        printShaderCodeWithHeader(vertShadSrc);
+        printShaderCodeWithHeader(vertShadSrcs);
         printf("Fragment Shader:\n");
-        printShaderCodeWithHeader(fragShadSrc);
+        printShaderCodeWithHeader(fragShadSrcs);
         assert(false);
     }
 
     return prog;
 }
 
-u32 easyCreateShaderProg(const char* name, const char* vertShadSrc, const char* fragShadSrc)
+u32 easyCreateShaderProg(const char* name, std::span<const char* const> vertShadSrcs, std::span<const char* const> fragShadSrcs)
 {
-    const u32 vertShad = easyCreateShader(name, vertShadSrc, GL_VERTEX_SHADER);
-    const u32 fragShad = easyCreateShader(name, fragShadSrc, GL_FRAGMENT_SHADER);
-    const u32 prog = easyCreateShaderProg(name, vertShadSrc, fragShadSrc, vertShad, fragShad);
+    const u32 vertShad = easyCreateShader(name, vertShadSrcs, GL_VERTEX_SHADER);
+    const u32 fragShad = easyCreateShader(name, fragShadSrcs, GL_FRAGMENT_SHADER);
+    const u32 prog = easyCreateShaderProg(name, vertShadSrcs, fragShadSrcs, vertShad, fragShad);
     glDeleteShader(vertShad);
     glDeleteShader(fragShad);
     return prog;
 }
 
+u32 easyCreateShaderProg(const char* name, const char* vertShadSrc, const char* fragShadSrc)
+{
+    return easyCreateShaderProg(name, { &vertShadSrc, 1 }, { &fragShadSrc, 1 });
+}
+
+u32 easyCreateComputeProg(const char* name, std::span<const char* const> compShadSrcs)
+{
+    const u32 compShad = easyCreateShader(name, compShadSrcs, GL_COMPUTE_SHADER);
+    u32 prog = glCreateProgram();
+    glAttachShader(prog, compShad);
+    glLinkProgram(prog);
+    glDetachShader(prog, compShad);
+    glDeleteShader(compShad);
+    if (const char* errMsg = checkLinkErrors(prog, buffer)) {
+        printf("%s\n", errMsg);
+        printShaderCodeWithHeader(compShadSrcs);
+        assert(false);
+    }
+    return prog;
+}
+
+u32 easyCreateComputeProg(const char* name, const char* compShadSrc)
+{
+    return easyCreateComputeProg(name, { &compShadSrc, 1 });
+}
 
 static const vec3 s_icosahedronVerts[12] = {
     {0.0000000000000000000000000, 1.0000000000000000000000000, 0.0000000000000000000000000},
@@ -432,4 +490,69 @@ glm::mat3 randRotMtx(vec3 u)
     const vec3 axis(ct * sin(phi), sinf(theta), ct * cos(phi));
     const float angle = 2 * PI * u[2];
     return glm::rotate(mat4(1), angle, axis);
-}
\ No newline at end of file
+}
+
+Frustum makeFrustum(const mat4& viewProj, bool zeroToOneDepth)
+{
+    // Gribb-Hartmann: the planes are combinations of the rows of the matrix
+    const mat4 m = glm::transpose(viewProj);
+    Frustum f;
+    f.planes[0] = m[3] + m[0]; // left
+    f.planes[1] = m[3] - m[0]; // right
+    f.planes[2] = m[3] + m[1]; // bottom
+    f.planes[3] = m[3] - m[1]; // top
+    f.planes[4] = zeroToOneDepth ? m[2] : m[3] + m[2]; // near (far with reverse Z)
+    f.planes[5] = m[3] - m[2]; // far (near with reverse Z)
+    for (vec4& plane : f.planes)
+        plane /= glm::length(vec3(plane));
+    return f;
+}
+
+bool sphereInFrustum(const Frustum& frustum, vec3 center, float radius)
+{
+    for (const vec4& plane : frustum.planes) {
+        if (dot(vec3(plane), center) + plane.w < -radius)
+            return false;
+    }
+    return true;
+}
+
+EFrustumTest testAabbFrustum(const Frustum& frustum, vec3 min, vec3 max)
+{
+    EFrustumTest res = FRUSTUM_INSIDE;
+    for (const vec4& plane : frustum.planes) {
+        const vec3 n(plane);
+        // the corners that are the furthest in the direction of the plane normal, and the furthest in the opposite direction
+        const vec3 pos = glm::mix(min, max, glm::greaterThanEqual(n, vec3(0)));
+        const vec3 neg = glm::mix(max, min, glm::greaterThanEqual(n, vec3(0)));
+        if (dot(n, pos) + plane.w < 0)
+            return FRUSTUM_OUTSIDE;
+        if (dot(n, neg) + plane.w < 0)
+            res = FRUSTUM_INTERSECTS;
+    }
+    return res;
+}
+
+float raySphereIntersection(vec3 origin, vec3 dir, vec3 center, float radius)
+{
+    const vec3 oc = origin - center;
+    const float b = dot(oc, dir);
+    const float c = dot(oc, oc) - radius * radius;
+    const float disc = b * b - c;
+    if (disc < 0)
+        return -1;
+    const float sq = sqrtf(disc);
+    const float t = -b - sq;
+    return t >= 0 ? t : -b + sq; // when the origin is inside the sphere, return the exit point
+}
+
+bool rayAabbIntersection(vec3 origin, vec3 invDir, vec3 min, vec3 max, float maxDist, float& tmin)
+{
+    const vec3 t0 = (min - origin) * invDir;
+    const vec3 t1 = (max - origin) * invDir;
+    const vec3 tsmall = glm::min(t0, t1);
+    const vec3 tbig = glm::max(t0, t1);
+    tmin = glm::max(glm::max(tsmall.x, tsmall.y), glm::max(tsmall.z, 0.f));
+    const float tmax = glm::min(glm::min(tbig.x, tbig.y), glm::min(tbig.z, maxDist));
+    return tmin <= tmax;
+}
@@ -10,8 +10,11 @@
 #include <cgltf.h>
 
 typedef uint8_t u8;
+typedef int16_t i16;
+typedef uint16_t u16;
 typedef int32_t i32;
 typedef uint32_t u32;
+typedef uint64_t u64;
 using glm::vec2;
 using glm::vec3;
 using glm::vec4;
@@ -29,12 +32,36 @@ typedef const char* const ConstStr;
 
 void glErrorCallback(const char* name, void* funcptr, int len_args, ...);
 
+// -- functionality newer than the GL 4.3 glad was generated for --
+// The function pointers are null when the driver doesn't support them, so check before using
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
+#define GL_CLIENT_STORAGE_BIT 0x0200
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+extern PFNGLBUFFERSTORAGEPROC glBufferStorage; // GL 4.4 or ARB_buffer_storage
+#define GL_VERTEX_SHADER_INVOCATIONS 0x82F0
+#define GL_FRAGMENT_SHADER_INVOCATIONS 0x82F4
+extern bool glHasPipelineStatistics; // GL 4.6 or ARB_pipeline_statistics_query (query targets only, no new functions)
+#define GL_NEGATIVE_ONE_TO_ONE 0x935E
+#define GL_ZERO_TO_ONE 0x935F
+typedef void (APIENTRYP PFNGLCLIPCONTROLPROC)(GLenum origin, GLenum depth);
+extern PFNGLCLIPCONTROLPROC glClipControl; // GL 4.5 or ARB_clip_control
+
+void loadGlExtensions(GLADloadproc load, int (*extensionSupported)(const char* name));
+
 char* checkCompileErrors(u32 shad, std::span<char> buffer);
 char* checkLinkErrors(u32 prog, std::span<char> buffer);
 void printShaderCodeWithHeader(const char* src);
+void printShaderCodeWithHeader(std::span<const char* const> srcs);
+// the versions that take several sources concatenate them (after the header), so shaders can share code
 u32 easyCreateShader(const char* name, const char* src, GLenum type);
+u32 easyCreateShader(const char* name, std::span<const char* const> srcs, GLenum type);
 u32 easyCreateShaderProg(const char* name, const char* vertShadSrc, const char* fragShadSrc);
-u32 easyCreateShaderProg(const char* name, const char* vertShadSrc, const char* fragShadSrc, u32 vertShad, u32 fragShad);
+u32 easyCreateShaderProg(const char* name, std::span<const char* const> vertShadSrcs, std::span<const char* const> fragShadSrcs);
+u32 easyCreateShaderProg(const char* name, std::span<const char* const> vertShadSrcs, std::span<const char* const> fragShadSrcs, u32 vertShad, u32 fragShad);
+u32 easyCreateComputeProg(const char* name, const char* compShadSrc);
+u32 easyCreateComputeProg(const char* name, std::span<const char* const> compShadSrcs);
 
 void createIcoSphereMeshData(u32& numVerts, u32& numInds, glm::vec3* verts, u32* inds, u32 subDivs);
 void createIcoSphereMesh(u32& vao, u32& vbo, u32& ebo, u32& numInds, u32 subDivs);
@@ -53,6 +80,19 @@ static inline float distance2 (vec3 a, vec3 b) {
     return dot(ab, ab);
 };
 
+// planes point inwards: a point p is inside when dot(vec3(plane), p) + plane.w >= 0 for all of them
+struct Frustum {
+    vec4 planes[6];
+};
+Frustum makeFrustum(const mat4& viewProj, bool zeroToOneDepth = false); // zeroToOneDepth: for glClipControl(..., GL_ZERO_TO_ONE)
+bool sphereInFrustum(const Frustum& frustum, vec3 center, float radius);
+enum EFrustumTest { FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTS, FRUSTUM_INSIDE };
+EFrustumTest testAabbFrustum(const Frustum& frustum, vec3 min, vec3 max);
+
+// returns the distance along the ray to the first intersection, or a negative number if there's none. dir must be normalized
+float raySphereIntersection(vec3 origin, vec3 dir, vec3 center, float radius);
+bool rayAabbIntersection(vec3 origin, vec3 invDir, vec3 min, vec3 max, float maxDist, float& tmin);
+
 // -- DEFER --
 template <typename F>
 struct _Defer {